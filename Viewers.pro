@@ -4,9 +4,11 @@ TEMPLATE = subdirs
 CONFIG += ordered
 
 # add subdirs in the right order
-SUBDIRS = ffmpegWidget ffmpegViewer ffmpegWebcam4
+SUBDIRS = ffmpegWidget ffmpegViewer ffmpegWebcam4 ffmpegMosaic ffmpegShmReader ffmpegShmExample
 
 # Get dependencies right
 ffmpegViewer.depends = ffmpegWidget
 ffmpegWebcam4.depends = ffmpegWidget
+ffmpegMosaic.depends = ffmpegWidget
+ffmpegShmExample.depends = ffmpegShmReader
 
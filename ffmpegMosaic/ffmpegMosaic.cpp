@@ -0,0 +1,131 @@
+#include "ffmpegWidget.h"
+#include <QApplication>
+#include <QGridLayout>
+#include <QMouseEvent>
+#include <math.h>
+
+/* A grid of ffmpegWidgets, one per url. Double click a tile to maximise it,
+ * and again to go back to the grid. Tiles decode at reduced resolution to
+ * suit their size, and hidden tiles stop decoding altogether.
+ */
+class ffmpegMosaic : public QWidget
+{
+public:
+    ffmpegMosaic (const QStringList &urls, int cols, int hideTimeout, QWidget* parent = 0);
+
+protected:
+    bool eventFilter(QObject *obj, QEvent *event);
+
+private:
+    QList<ffmpegWidget *> tiles;
+    ffmpegWidget *maximised;
+};
+
+ffmpegMosaic::ffmpegMosaic (const QStringList &urls, int cols, int hideTimeout, QWidget* parent)
+    : QWidget (parent)
+{
+    this->maximised = NULL;
+    QGridLayout *layout = new QGridLayout(this);
+    layout->setMargin(0);
+    layout->setSpacing(1);
+    for (int i = 0; i < urls.size(); i++) {
+        ffmpegWidget *tile = new ffmpegWidget(this);
+        tile->setToolTip(urls.at(i));
+        tile->setAutoLowres(true);
+        tile->setHideTimeout(hideTimeout);
+        // there's no replay control, so don't keep packets for it
+        tile->setReplaySeconds(0);
+        tile->installEventFilter(this);
+        layout->addWidget(tile, i / cols, i % cols);
+        this->tiles.append(tile);
+        tile->setUrl(urls.at(i));
+    }
+}
+
+// maximise or restore a tile when it is double clicked
+bool ffmpegMosaic::eventFilter(QObject *obj, QEvent *event) {
+    if (event->type() == QEvent::MouseButtonDblClick &&
+            ((QMouseEvent *) event)->button() == Qt::LeftButton) {
+        ffmpegWidget *tile = (ffmpegWidget *) obj;
+        if (this->maximised == NULL) {
+            // hide the others, they will stop decoding while hidden
+            for (int i = 0; i < this->tiles.size(); i++) {
+                if (this->tiles[i] != tile) this->tiles[i]->hide();
+            }
+            this->maximised = tile;
+        } else {
+            for (int i = 0; i < this->tiles.size(); i++) {
+                this->tiles[i]->show();
+            }
+            this->maximised = NULL;
+        }
+        return true;
+    }
+    return QWidget::eventFilter(obj, event);
+}
+
+int main(int argc, char *argv[])
+{
+    /* Top level app */
+    QApplication app(argc, argv);
+
+    /* Parse the arguments */
+    QStringList urls;
+    int cols = 0, threads = 0, hideTimeout = 0;
+    const char * usage = \
+        "Usage: %s [options] <url> [<url> ...]\n\n" \
+        "Where url is an ffmpeg stream\n" \
+        "E.g. http://i11-webcam2.diamond.ac.uk/mjpg/video.mjpg\n\n" \
+        "Options:\n" \
+        "  -h\tShow this help message and quit\n" \
+        "  -f\tFallback mode, don't try to use xvideo\n" \
+        "  -c <n>\tNumber of columns in the grid (default: square)\n" \
+        "  -m <MB>\tMemory budget for frame buffers (default: %d)\n" \
+        "  -t <n>\tNumber of conversion threads (default: one per core)\n" \
+        "  -x <ms>\tDisconnect hidden tiles after this long (default: never)\n";
+    QStringList args = app.arguments();
+    for (int i = 1; i < args.size(); i++) {
+        if (args.at(i) == "-f") {
+            // fallback mode
+            fallback = 1;
+        } else if (args.at(i) == "-h") {
+            // asked for help
+            printf(usage, argv[0], DEFAULTBUDGET);
+            return 1;
+        } else if (args.at(i) == "-c" && i + 1 < args.size()) {
+            cols = args.at(++i).toInt();
+        } else if (args.at(i) == "-m" && i + 1 < args.size()) {
+            memoryBudget = args.at(++i).toInt();
+        } else if (args.at(i) == "-t" && i + 1 < args.size()) {
+            threads = args.at(++i).toInt();
+        } else if (args.at(i) == "-x" && i + 1 < args.size()) {
+            hideTimeout = args.at(++i).toInt();
+        } else if (args.at(i).startsWith("-")) {
+            // unknown option
+            printf(usage, argv[0], DEFAULTBUDGET);
+            return 1;
+        } else {
+            // positional args are urls
+            urls.append(args.at(i));
+        }
+    }
+
+    /* If we didn't specify any urls return usage */
+    if (urls.isEmpty() || memoryBudget <= 0) {
+        printf(usage, argv[0], DEFAULTBUDGET);
+        return 1;
+    }
+
+    /* Make the grid as square as we can */
+    if (cols <= 0) cols = (int) ceil(sqrt((double) urls.size()));
+    if (threads > 0) ffmpegWidget::conversionPool()->setMaxThreadCount(threads);
+
+    /* Make the mosaic */
+    ffmpegMosaic *top = new ffmpegMosaic(urls, cols, hideTimeout);
+    top->setWindowTitle(QString("ffmpegMosaic: %1 streams").arg(urls.size()));
+    top->resize(1280, 1024);
+
+    /* Show it */
+    top->show();
+    return app.exec();
+}
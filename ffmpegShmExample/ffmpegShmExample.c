@@ -0,0 +1,79 @@
+/* Example ffmpegShmReader client. Waits for frames published by an
+ * ffmpegViewer started with -s <name>, and prints the mean of the first
+ * plane of each, how long after its packet arrived we got to it and any
+ * frames we were too slow to see.
+ */
+#include "ffmpegShmReader.h"
+#include <sys/time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// ms to wait for each frame before saying so
+#define EXAMPLETIMEOUT 2000
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3 || strcmp(argv[1], "-h") == 0) {
+        printf("Usage: %s <name> [<frames>]\n\n"
+            "Print the mean of frames published by ffmpegViewer -s <name>,\n"
+            "stopping after <frames> if given\n", argv[0]);
+        return 1;
+    }
+    long count = (argc > 2) ? atol(argv[2]) : -1;
+
+    // wait for the viewer to start publishing
+    FFShmReader *reader;
+    while ((reader = ffshm_open(argv[1])) == NULL) {
+        if (errno != ENOENT && errno != EAGAIN) {
+            printf("Can't open %s: %s\n", argv[1], strerror(errno));
+            return 1;
+        }
+        usleep(100000);
+    }
+    printf("Reading %s from %s\n", ffshm_url(reader), argv[1]);
+
+    uint64_t last = 0;
+    while (count != 0) {
+        FFShmFrame frame;
+        int ret = ffshm_next(reader, last, EXAMPLETIMEOUT, &frame);
+        if (ret < 0) {
+            printf("Error reading %s: %s\n", argv[1], strerror(errno));
+            break;
+        }
+        if (ret == 0) {
+            printf("No frame for %d ms\n", EXAMPLETIMEOUT);
+            continue;
+        }
+        // sample the first plane straight from the shared memory, it is
+        // only one byte per pixel for grey and YUV frames, but it is enough
+        // to show the idea
+        uint64_t sum = 0;
+        for (int y = 0; y < frame.height; y++) {
+            const uint8_t *row = frame.planes[0] + (size_t) y * frame.strides[0];
+            for (int x = 0; x < frame.width; x++) sum += row[x];
+        }
+        if (!ffshm_valid(&frame)) {
+            printf("Frame %llu was overwritten while we read it\n",
+                (unsigned long long) frame.seq);
+            continue;
+        }
+        const long pixels = (long) frame.width * frame.height;
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        int64_t ageUs = (int64_t) tv.tv_sec * 1000000 + tv.tv_usec - frame.timestampUs;
+        printf("Frame %llu: %dx%d %s, mean %.1f, %.1f ms old",
+            (unsigned long long) frame.seq, frame.width, frame.height, frame.formatName,
+            pixels ? (double) sum / pixels : 0.0,
+            frame.timestampUs ? ageUs / 1000.0 : 0.0);
+        if (last && frame.seq > last + 1) {
+            printf(", missed %llu", (unsigned long long) (frame.seq - last - 1));
+        }
+        printf("\n");
+        last = frame.seq;
+        if (count > 0) count--;
+    }
+    ffshm_close(reader);
+    return 0;
+}
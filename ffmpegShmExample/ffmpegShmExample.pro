@@ -0,0 +1,9 @@
+TARGET = ffmpegShmExample
+CONFIG -= qt
+SOURCES += ffmpegShmExample.c
+target.path = ../../prefix/bin
+INSTALLS += target
+INCLUDEPATH += ../ffmpegShmReader ../ffmpegWidget
+LIBS += -L../ffmpegShmReader -lffmpegShmReader -lrt
+QMAKE_CFLAGS += -std=gnu99
+QMAKE_CLEAN += $$TARGET
@@ -0,0 +1,164 @@
+#include "ffmpegShmReader.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ms between attempts to open a segment again once the writer has let go,
+// it is only missing for the moment it takes to replace it with a bigger one
+#define FFSHM_REOPENMS 10
+
+struct FFShmReader {
+    char *name;                 // of the segment
+    const FFShmHeader *header;  // the mapped segment, NULL if it has gone
+    size_t size;                // bytes mapped
+};
+
+// map name read-only and check it is complete and one of ours
+static int mapSegment(FFShmReader *reader) {
+    struct stat st;
+    int fd = shm_open(reader->name, O_RDONLY, 0);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(FFShmHeader)) {
+        close(fd);
+        errno = EAGAIN;
+        return -1;
+    }
+    void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) return -1;
+    const FFShmHeader *header = (const FFShmHeader *) mem;
+    if (header->magic != FFSHM_MAGIC || header->stale) {
+        // not ours, the writer is still setting it up or it is about to go
+        munmap(mem, st.st_size);
+        errno = EAGAIN;
+        return -1;
+    }
+    __sync_synchronize();
+    if (header->version != FFSHM_VERSION || header->nslots == 0 ||
+            header->headerSize + header->nslots * header->slotSize > (uint64_t) st.st_size) {
+        munmap(mem, st.st_size);
+        errno = EPROTO;
+        return -1;
+    }
+    reader->header = header;
+    reader->size = st.st_size;
+    return 0;
+}
+
+static void unmapSegment(FFShmReader *reader) {
+    if (reader->header) munmap((void *) reader->header, reader->size);
+    reader->header = NULL;
+    reader->size = 0;
+}
+
+FFShmReader *ffshm_open(const char *name) {
+    FFShmReader *reader = (FFShmReader *) calloc(1, sizeof(FFShmReader));
+    if (reader == NULL) return NULL;
+    reader->name = (char *) malloc(strlen(name) + 2);
+    if (reader->name == NULL) {
+        free(reader);
+        return NULL;
+    }
+    // shm_open wants exactly one leading /
+    strcpy(reader->name, name[0] == '/' ? "" : "/");
+    strcat(reader->name, name);
+    if (mapSegment(reader) < 0) {
+        int err = errno;
+        ffshm_close(reader);
+        errno = err;
+        return NULL;
+    }
+    return reader;
+}
+
+void ffshm_close(FFShmReader *reader) {
+    if (reader == NULL) return;
+    unmapSegment(reader);
+    free(reader->name);
+    free(reader);
+}
+
+const char *ffshm_url(FFShmReader *reader) {
+    return reader->header ? reader->header->url : "";
+}
+
+// fill in frame from slot seq, 0 if the writer got there first
+static int readSlot(const FFShmHeader *header, uint64_t seq, FFShmFrame *frame) {
+    const FFShmSlot *slot = (const FFShmSlot *) ((const char *) header + header->headerSize +
+        ((seq - 1) % header->nslots) * header->slotSize);
+    uint64_t lock = slot->lock;
+    __sync_synchronize();
+    if ((lock & 1) || slot->seq != seq) return 0;
+    frame->seq = seq;
+    frame->timestampUs = slot->timestampUs;
+    frame->width = slot->width;
+    frame->height = slot->height;
+    frame->format = slot->format;
+    frame->formatName = slot->formatName;
+    frame->nplanes = slot->nplanes;
+    for (int p = 0; p < 4; p++) {
+        frame->strides[p] = slot->strides[p];
+        frame->planes[p] = (p < slot->nplanes) ? (const uint8_t *) slot + slot->offsets[p] : NULL;
+    }
+    frame->slot = slot;
+    frame->lock = lock;
+    return ffshm_valid(frame);
+}
+
+static int64_t nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int ffshm_next(FFShmReader *reader, uint64_t after, int timeoutMs, FFShmFrame *frame) {
+    const int64_t deadline = nowMs() + timeoutMs;
+    while (1) {
+        int64_t left = (timeoutMs < 0) ? FFSHM_REOPENMS : deadline - nowMs();
+        if (reader->header == NULL && mapSegment(reader) < 0) {
+            if (errno != ENOENT && errno != EAGAIN) return -1;
+            if (left <= 0) return 0;
+            usleep(1000 * (left < FFSHM_REOPENMS ? left : FFSHM_REOPENMS));
+            continue;
+        }
+        const FFShmHeader *header = reader->header;
+        uint32_t futex = header->futex;
+        __sync_synchronize();
+        // the writer has replaced or removed the segment, it marks it before
+        // it bumps the futex so we can't sleep on it for ever
+        if (header->stale) {
+            unmapSegment(reader);
+            continue;
+        }
+        uint64_t seq = header->seq;
+        if (seq > after) {
+            if (readSlot(header, seq, frame)) return 1;
+            // lapped while we looked, try the newest again
+            sched_yield();
+            continue;
+        }
+        if (left <= 0) return 0;
+        // sleep until the writer bumps the futex
+        struct timespec ts;
+        ts.tv_sec = left / 1000;
+        ts.tv_nsec = (left % 1000) * 1000000;
+        if (syscall(SYS_futex, &header->futex, FUTEX_WAIT, futex,
+                timeoutMs < 0 ? NULL : &ts, NULL, 0) < 0 &&
+                errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+            return -1;
+        }
+    }
+}
+
+int ffshm_valid(const FFShmFrame *frame) {
+    __sync_synchronize();
+    return frame->slot->lock == frame->lock;
+}
@@ -0,0 +1,55 @@
+#ifndef FFMPEGSHMREADER_H
+#define FFMPEGSHMREADER_H
+
+/* Reads the frames an ffmpegWidget publishes to POSIX shared memory, see
+ * ffmpegShm.h for the layout. The segment is mapped read-only and frames
+ * are handed out as pointers into it, so nothing is decoded or copied. The
+ * writer keeps going regardless of its readers, so a frame is only good
+ * while ffshm_valid says so: look at it, then check it is still valid
+ * before trusting what you saw. Plain C, link with -lrt.
+ */
+
+#include <stdint.h>
+#include "ffmpegShm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct FFShmReader FFShmReader;
+
+typedef struct {
+    uint64_t seq;               // frame number, counting from 1
+    int64_t timestampUs;        // when its packet arrived, us since the epoch, 0 if not live
+    int width;                  // in pixels
+    int height;
+    int format;                 // ffmpeg pixel format number
+    const char *formatName;     // ffmpeg pixel format name, e.g. "gray"
+    int nplanes;                // planes in use
+    int strides[4];             // bytes from one row of each plane to the next
+    const uint8_t *planes[4];   // the pixels, in the shared memory
+    // private, used by ffshm_valid
+    const FFShmSlot *slot;
+    uint64_t lock;
+} FFShmFrame;
+
+// map the segment called name, e.g. "/beam1", NULL with errno set if it
+// doesn't exist yet or isn't one of ours
+FFShmReader *ffshm_open(const char *name);
+void ffshm_close(FFShmReader *reader);
+// stream the frames come from
+const char *ffshm_url(FFShmReader *reader);
+/* wait up to timeoutMs for a frame newer than after, -1 waits for ever.
+ * Gives 1 and the newest frame, 0 on timeout or -1 on error. If the writer
+ * replaces the segment it is opened again, so frames from earlier calls
+ * must not be used after this one
+ */
+int ffshm_next(FFShmReader *reader, uint64_t after, int timeoutMs, FFShmFrame *frame);
+// 1 if the writer hasn't started to overwrite frame
+int ffshm_valid(const FFShmFrame *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,12 @@
+TEMPLATE = lib
+CONFIG = staticlib
+CONFIG -= qt
+HEADERS += ffmpegShmReader.h ../ffmpegWidget/ffmpegShm.h
+SOURCES += ffmpegShmReader.c
+INCLUDEPATH += ../ffmpegWidget
+QMAKE_CFLAGS += -std=gnu99
+QMAKE_CLEAN += libffmpegShmReader.a
+header_files.files = ffmpegShmReader.h ../ffmpegWidget/ffmpegShm.h
+header_files.path = ../../prefix/include
+target.path = ../../prefix/lib
+INSTALLS += target header_files
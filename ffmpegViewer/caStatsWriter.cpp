@@ -0,0 +1,103 @@
+#include "caStatsWriter.h"
+#include <stdio.h>
+#include <math.h>
+
+caStatsWriter::caStatsWriter(const QString &prefix, QObject* parent)
+    : QObject (parent)
+{
+    this->prefix = QString(prefix);
+    for (int i = 0; i < NPVS; i++) {
+        this->chids[i] = NULL;
+        this->last[i] = NAN;
+        this->current[i] = NAN;
+    }
+    this->timer = new QTimer(this);
+    QObject::connect( this->timer, SIGNAL(timeout()),
+                      this, SLOT(doWrite()) );
+}
+
+void caStatsWriter::create(int pv, const char *suffix) {
+    ca_create_channel((prefix + QString(suffix)).toAscii().data(), NULL, NULL, 0, &this->chids[pv]);
+}
+
+// the calling thread must have a CA context, shared with the caValueMonitor
+void caStatsWriter::start(bool beam, bool metrics) {
+    if (beam) {
+        create(CX, "CX");
+        create(CY, "CY");
+        create(SX, "SX");
+        create(SY, "SY");
+    }
+    if (metrics) {
+        create(FPS, "FPS");
+        create(DROPPED, "DROPPED");
+        create(DECODEMS, "DECODEMS");
+        create(CONVERTMS, "CONVERTMS");
+        create(RENDERMS, "RENDERMS");
+        create(POOLPCT, "POOLPCT");
+        create(LATENCYMS, "LATENCYMS");
+    }
+    ca_flush_io();
+    this->timer->start(STATSWRITEPERIOD);
+}
+
+void caStatsWriter::setCx(double cx) {
+    this->current[CX] = cx;
+}
+
+void caStatsWriter::setCy(double cy) {
+    this->current[CY] = cy;
+}
+
+void caStatsWriter::setSx(double sx) {
+    this->current[SX] = sx;
+}
+
+void caStatsWriter::setSy(double sy) {
+    this->current[SY] = sy;
+}
+
+void caStatsWriter::setFps(double fps) {
+    this->current[FPS] = fps;
+}
+
+void caStatsWriter::setDropped(int dropped) {
+    this->current[DROPPED] = dropped;
+}
+
+void caStatsWriter::setDecodeTime(double ms) {
+    this->current[DECODEMS] = ms;
+}
+
+void caStatsWriter::setConvertTime(double ms) {
+    this->current[CONVERTMS] = ms;
+}
+
+void caStatsWriter::setRenderTime(double ms) {
+    this->current[RENDERMS] = ms;
+}
+
+void caStatsWriter::setPoolUsage(double pct) {
+    this->current[POOLPCT] = pct;
+}
+
+void caStatsWriter::setLatency(double ms) {
+    this->current[LATENCYMS] = ms;
+}
+
+// write anything that changed since last time, then send it in one go
+void caStatsWriter::doWrite() {
+    for (int i = 0; i < NPVS; i++) {
+        chid ch = this->chids[i];
+        if (ch == NULL || isnan(this->current[i]) || this->current[i] == this->last[i] ||
+                ca_state(ch) != cs_conn) continue;
+        dbr_double_t value = this->current[i];
+        int status = ca_array_put(DBR_DOUBLE, 1, ch, &value);
+        if (status != ECA_NORMAL) {
+            fprintf(stderr, "error: %s: %s\n", ca_name(ch), ca_message(status));
+            continue;
+        }
+        this->last[i] = this->current[i];
+    }
+    ca_flush_io();
+}
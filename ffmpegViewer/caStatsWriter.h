@@ -0,0 +1,50 @@
+#ifndef CASTATSWRITER_H
+#define CASTATSWRITER_H
+
+#include <QTimer>
+#include <cadef.h>
+
+// min time between writes of the beam position and metrics in ms
+#define STATSWRITEPERIOD 200
+
+/* Writes numbers from an ffmpegWidget to PVs under a prefix. The beam
+ * centroid and size go to <prefix>CX, CY, SX and SY, and the viewer's own
+ * performance to <prefix>FPS, DROPPED, DECODEMS, CONVERTMS, RENDERMS,
+ * POOLPCT and LATENCYMS. Values arrive once per frame, but are only written when they
+ * have changed and at most once per STATSWRITEPERIOD, so a fast stream
+ * doesn't flood the IOC. Channels that aren't connected are skipped rather
+ * than waited for
+ */
+class caStatsWriter : public QObject
+{
+    Q_OBJECT
+
+public:
+    caStatsWriter (const QString &prefix, QObject* parent);
+    void start(bool beam, bool metrics);
+
+public slots:
+    void setCx(double);
+    void setCy(double);
+    void setSx(double);
+    void setSy(double);
+    void setFps(double);
+    void setDropped(int);
+    void setDecodeTime(double);
+    void setConvertTime(double);
+    void setRenderTime(double);
+    void setPoolUsage(double);
+    void setLatency(double);
+    void doWrite();
+
+private:
+    enum { CX, CY, SX, SY, FPS, DROPPED, DECODEMS, CONVERTMS, RENDERMS, POOLPCT, LATENCYMS, NPVS };
+    void create(int pv, const char *suffix);
+    chid chids[NPVS];           // NULL if we weren't asked to write it
+    double last[NPVS];          // last value written
+    double current[NPVS];       // latest value from the widget
+    QString prefix;
+    QTimer *timer;
+};
+
+#endif
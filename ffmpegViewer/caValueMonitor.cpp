@@ -7,12 +7,17 @@ void eventCallbackC(struct event_handler_args args) {
     ptr->eventCallback(args);
 }
 
+void putCallbackC(struct event_handler_args args) {
+    caValueMonitor *ptr = (caValueMonitor *) args.usr;
+    ptr->putCallback(args);
+}
+
 caValueMonitor::caValueMonitor(const QString &prefix, QWidget* parent)
     : QObject (parent)
 {
     this->prefix = QString(prefix);
-    this->sendBuf = calloc(1, dbr_size_n(DBR_LONG, 1));
-    this->timer = new QTimer();
+    this->mutex = new QMutex();
+    this->posted = false;
     this->gxLast = -1;
     this->gyLast = -1;
     this->gcolLast = -1;
@@ -23,17 +28,22 @@ caValueMonitor::caValueMonitor(const QString &prefix, QWidget* parent)
     this->gcolCurrent = -1;
     this->gridCurrent = -1;        
     this->gsCurrent = -1;    
+    this->gxPending = -1;
+    this->gyPending = -1;
+    this->gcolPending = -1;
+    this->gridPending = -1;
+    this->gsPending = -1;
+    this->timer = new QTimer(this);
     QObject::connect( this->timer, SIGNAL(timeout()),
-                      this, SLOT(doWrite()) );   
-    this->timer->start(100);                         
+                      this, SLOT(doPut()) );
 }
 
 caValueMonitor::~caValueMonitor() {
-    free(sendBuf);
+    delete this->mutex;
 }
 
+// the calling thread must have a preemptive CA context
 void caValueMonitor::start() {
-    ca_context_create(ca_enable_preemptive_callback);
     ca_create_channel((prefix + QString("GX")).toAscii().data(), NULL, NULL, 0, &this->gxChid);
     ca_create_channel((prefix + QString("GY")).toAscii().data(), NULL, NULL, 0, &this->gyChid);
     ca_create_channel((prefix + QString("GCOL")).toAscii().data(), NULL, NULL, 0, &this->gcolChid);
@@ -44,27 +54,42 @@ void caValueMonitor::start() {
     ca_create_subscription(DBR_LONG, 1, this->gcolChid, DBE_VALUE, eventCallbackC, (void*)this, NULL);
     ca_create_subscription(DBR_LONG, 1, this->gridChid, DBE_VALUE, eventCallbackC, (void*)this, NULL);
     ca_create_subscription(DBR_LONG, 1, this->gsChid, DBE_VALUE, eventCallbackC, (void*)this, NULL);    
-    ca_pend_io(3);
+    // don't wait for the connections, monitors will arrive when they are made
+    ca_flush_io();
+    this->timer->start(PUTPERIOD);
 }
 
+// runs in the GUI thread, emit the latest value of everything that changed
 void caValueMonitor::doWrite() {
-	if (this->gxLast != this->gxCurrent) {
-    	this->gxLast = this->gxCurrent;	
+    this->mutex->lock();
+    long gx = this->gxCurrent;
+    long gy = this->gyCurrent;
+    long gcol = this->gcolCurrent;
+    long grid = this->gridCurrent;
+    long gs = this->gsCurrent;
+    this->posted = false;
+    this->mutex->unlock();
+    if (this->gxLast != gx) {
+        this->gxLast = gx;
         emit gxChanged(this->gxLast);
-    } else if (this->gyLast != this->gyCurrent) {
-    	this->gyLast = this->gyCurrent;	
+    }
+    if (this->gyLast != gy) {
+        this->gyLast = gy;
         emit gyChanged(this->gyLast);
-    } else if (this->gcolLast != this->gcolCurrent) {
-    	this->gcolLast = this->gcolCurrent;	
+    }
+    if (this->gcolLast != gcol) {
+        this->gcolLast = gcol;
         emit gcolChanged(QColor((QRgb) (0xFF000000 + this->gcolLast)));
-    } else if (this->gridLast != this->gridCurrent) {
-    	this->gridLast = this->gridCurrent;	
+    }
+    if (this->gridLast != grid) {
+        this->gridLast = grid;
         emit gridChanged((bool) this->gridLast);
-    } else if (this->gsLast != this->gsCurrent) {
-    	this->gsLast = this->gsCurrent;	
+    }
+    if (this->gsLast != gs) {
+        this->gsLast = gs;
         emit gsChanged(this->gsLast);
     }
-}	
+}
 
 void caValueMonitor::eventCallback(struct event_handler_args args) {
     if(args.status != ECA_NORMAL) {
@@ -72,6 +97,7 @@ void caValueMonitor::eventCallback(struct event_handler_args args) {
         return;
     }
     unsigned int value = *(unsigned int *)args.dbr;
+    QMutexLocker locker(this->mutex);
     if (args.chid == this->gxChid) {
     	this->gxCurrent = value;
     } else if (args.chid == this->gyChid) {
@@ -83,34 +109,57 @@ void caValueMonitor::eventCallback(struct event_handler_args args) {
     } else if (args.chid == this->gsChid) {
     	this->gsCurrent = value;
     }
+    // a burst of updates only needs one trip through the event loop
+    if (!this->posted) {
+        this->posted = true;
+        QMetaObject::invokeMethod(this, "doWrite", Qt::QueuedConnection);
+    }
+}
+
+// runs in a CA thread when the IOC has processed a put
+void caValueMonitor::putCallback(struct event_handler_args args) {
+    if(args.status != ECA_NORMAL) {
+        fprintf(stderr, "error: put to %s failed: %s\n", ca_name(args.chid), ca_message(args.status));
+    }
 }
 
 void caValueMonitor::setGx(int gx) {
-    *(long*)this->sendBuf = gx;
-    ca_array_put(DBR_LONG, 1, this->gxChid, sendBuf);
-    ca_pend_io(3);
+    this->gxPending = gx;
 }
 
 void caValueMonitor::setGy(int gy) {
-    *(long*)this->sendBuf = gy;
-    ca_array_put(DBR_LONG, 1, this->gyChid, sendBuf);
-    ca_pend_io(3);
+    this->gyPending = gy;
 }
 
 void caValueMonitor::setGcol(QColor gcol) {
-    *(long*)this->sendBuf = gcol.rgb() - 0xFF000000;
-    ca_array_put(DBR_LONG, 1, this->gcolChid, sendBuf);
-    ca_pend_io(3);
+    this->gcolPending = gcol.rgb() - 0xFF000000;
 }
 
 void caValueMonitor::setGrid(bool grid) {
-    *(long*)this->sendBuf = grid;
-    ca_array_put(DBR_LONG, 1, this->gridChid, sendBuf);
-    ca_pend_io(3);
+    this->gridPending = grid;
 }
 
 void caValueMonitor::setGs(int gs) {
-    *(long*)this->sendBuf = gs;
-    ca_array_put(DBR_LONG, 1, this->gsChid, sendBuf);
-    ca_pend_io(3);
+    this->gsPending = gs;
+}
+
+// start a put of the pending value, keeping it if the channel isn't there yet
+void caValueMonitor::put(chid ch, long *pending) {
+    if (*pending == -1 || ca_state(ch) != cs_conn) return;
+    dbr_long_t value = *pending;
+    int status = ca_array_put_callback(DBR_LONG, 1, ch, &value, putCallbackC, (void*)this);
+    if (status != ECA_NORMAL) {
+        fprintf(stderr, "error: put to %s failed: %s\n", ca_name(ch), ca_message(status));
+    }
+    *pending = -1;
+}
+
+// send the latest value of everything that has been set since last time
+void caValueMonitor::doPut() {
+    put(this->gxChid, &this->gxPending);
+    put(this->gyChid, &this->gyPending);
+    put(this->gcolChid, &this->gcolPending);
+    put(this->gridChid, &this->gridPending);
+    put(this->gsChid, &this->gsPending);
+    ca_flush_io();
 }
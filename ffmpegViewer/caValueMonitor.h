@@ -4,8 +4,20 @@
 #include <QThread>
 #include <QTimer>
 #include <QColor>
+#include <QMutex>
+#include <QMutexLocker>
 #include <cadef.h>
 
+// time between flushes of queued puts in ms
+#define PUTPERIOD 50
+
+/* Keeps the grid of an ffmpegWidget in sync with <prefix>GX, GY, GCOL, GRID
+ * and GS. Monitor callbacks arrive on CA threads, so they just store the
+ * latest value and post a single doWrite() to the GUI thread, which emits
+ * everything that has changed since the last one. Puts go the other way:
+ * the setters just note the latest value, and a timer sends whatever is
+ * pending without waiting, so a slow IOC never blocks the GUI
+ */
 class caValueMonitor : public QObject
 {
     Q_OBJECT
@@ -15,6 +27,7 @@ public:
     ~caValueMonitor ();
     void start();
     void eventCallback(struct event_handler_args args);
+    void putCallback(struct event_handler_args args);
 
 public slots:
     void setGx(int);
@@ -23,6 +36,7 @@ public slots:
     void setGrid(bool);
     void setGs(int);    
     void doWrite();
+    void doPut();
 
 signals:
     void gxChanged(int);
@@ -35,7 +49,11 @@ private:
     chid gxChid, gyChid, gcolChid, gridChid, gsChid;
     long gxLast, gyLast, gcolLast, gridLast, gsLast;
     long gxCurrent, gyCurrent, gcolCurrent, gridCurrent, gsCurrent;
-    void *sendBuf;
+    QMutex *mutex;              // protects the *Current values and posted
+    bool posted;                // a doWrite() is waiting in the event loop
+    void put(chid ch, long *pending);
+    // values waiting to be put, -1 if nothing to send, only touched in the GUI thread
+    long gxPending, gyPending, gcolPending, gridPending, gsPending;
     QString prefix;
     QTimer *timer;
 };
@@ -1,5 +1,7 @@
 #include "ui_ffmpegViewer.h"
 #include "caValueMonitor.h"
+#include "caStatsWriter.h"
+#include "ffmpegColorMap.h"
 #include <QApplication>
 
 int main(int argc, char *argv[])
@@ -8,17 +10,83 @@ int main(int argc, char *argv[])
     QApplication app(argc, argv);
 
     /* Parse the arguments */
-    QString url, prefix;
+    QString url, prefix, recordFile;
     int closeDocks = 0;
+    int publishStats = 0;
+    int publishMetrics = 0;
+    int replaySeconds = DEFAULTREPLAY;
+    int backend = BACKEND_AUTO;
+    QString cpus, convertCpus;
+    int niceness = NICE_UNSET, rtPriority = RTPRIORITY_UNSET;
+    QString shmName;
     const char * usage = \
         "Usage: %s [options] <mjpg_url> [<CA prefix for grid>]\n\n" \
         "  -h\tShow this help message and quit\n" \
         "  -d\tDo not show docking controls on right of player window\n" \
-        "  -f\tFallback mode, don't try to use xvideo\n";
+        "  -f\tFallback mode, don't try to use xvideo\n" \
+        "  -b <name>\tDraw with auto, xvshm, xv, xshm, qimage or null. xshm\n" \
+        "    \tscales frames itself into shared memory, without xvideo. null\n" \
+        "    \tdraws nothing, it counts and checksums the frames and prints\n" \
+        "    \tthe totals on exit\n" \
+        "  -r <s>\tSeconds of stream to keep for replay, 0 to disable\n" \
+        "  -o <file>\tRecord the stream to this file, without re-encoding\n" \
+        "  -m <file>\tLoad a false colour map from this file, one r g b per line\n" \
+        "  -a <cpus>\tRead and decode on these cpus, e.g. 2-3,6\n" \
+        "  -A <cpus>\tConvert frames on these cpus\n" \
+        "  -n <nice>\tNice value of the decode thread\n" \
+        "  -R <prio>\tRun the decode thread SCHED_FIFO at this priority, if allowed\n" \
+        "    \tThese default to $FFMPEGWIDGET_CPUS, _CONVERTCPUS, _NICE and\n" \
+        "    \t_RTPRIORITY, what took effect is shown in the stats dock\n" \
+        "  -s <name>\tPublish decoded frames to POSIX shared memory /<name>\n" \
+        "    \tfor ffmpegShmReader clients\n" \
+        "  -c\tPublish the beam centroid and size to <prefix>CX, CY, SX, SY\n" \
+        "  -p\tPublish fps, dropped frames, decode, convert, render and latency\n" \
+        "    \ttimes and memory use to <prefix>FPS, DROPPED, DECODEMS, CONVERTMS,\n" \
+        "    \tRENDERMS, LATENCYMS and POOLPCT\n";
     for (int i = 1; i < app.arguments().size(); i++) {
         if (app.arguments().at(i) == "-f") {
             // fallback mode
             fallback = 1;
+        } else if (app.arguments().at(i) == "-b" && i + 1 < app.arguments().size()) {
+            // render backend
+            QString name = app.arguments().at(++i);
+            for (backend = BACKEND_XSHM; backend >= BACKEND_AUTO; backend--) {
+                if (name == ffBackendName(backend)) break;
+            }
+            if (backend < BACKEND_AUTO) {
+                printf(usage, argv[0]);
+                return 1;
+            }
+        } else if (app.arguments().at(i) == "-r" && i + 1 < app.arguments().size()) {
+            // replay length
+            replaySeconds = app.arguments().at(++i).toInt();
+        } else if (app.arguments().at(i) == "-o" && i + 1 < app.arguments().size()) {
+            // record to file
+            recordFile = app.arguments().at(++i);
+        } else if (app.arguments().at(i) == "-m" && i + 1 < app.arguments().size()) {
+            // extra colour map
+            if (FFColorMap::load(app.arguments().at(++i)) < 0) return 1;
+        } else if (app.arguments().at(i) == "-a" && i + 1 < app.arguments().size()) {
+            // decode thread affinity
+            cpus = app.arguments().at(++i);
+        } else if (app.arguments().at(i) == "-A" && i + 1 < app.arguments().size()) {
+            // conversion affinity
+            convertCpus = app.arguments().at(++i);
+        } else if (app.arguments().at(i) == "-n" && i + 1 < app.arguments().size()) {
+            // decode thread nice value
+            niceness = app.arguments().at(++i).toInt();
+        } else if (app.arguments().at(i) == "-R" && i + 1 < app.arguments().size()) {
+            // decode thread realtime priority
+            rtPriority = app.arguments().at(++i).toInt();
+        } else if (app.arguments().at(i) == "-s" && i + 1 < app.arguments().size()) {
+            // shared memory frame export
+            shmName = app.arguments().at(++i);
+        } else if (app.arguments().at(i) == "-c") {
+            // publish the beam position
+            publishStats = 1;
+        } else if (app.arguments().at(i) == "-p") {
+            // publish the viewer performance
+            publishMetrics = 1;
         } else if (app.arguments().at(i) == "-d") {
             // no docks
             closeDocks = 1;            
@@ -49,19 +117,39 @@ int main(int argc, char *argv[])
     QMainWindow *top = new QMainWindow;
     Ui::ffmpegViewer ui;
     ui.setupUi(top);
+
+    /* Offer any colour maps the form doesn't know about */
+    QStringList colorMaps = FFColorMap::names();
+    for (int i = ui.fcolCombo->count(); i < colorMaps.size(); i++) {
+        ui.fcolCombo->addItem(colorMaps.at(i));
+    }
     
     /* Close docks if asked */
     if (closeDocks) {
         ui.imageDock->close();
         ui.gridDock->close();        
+        ui.statsDock->close();
     }
     
     /* Set the url and start */
+    ui.video->setBackend(backend);
+    ui.video->setReplaySeconds(replaySeconds);
+    if (!cpus.isNull()) ui.video->setCpus(cpus);
+    if (!convertCpus.isNull()) ui.video->setConvertCpus(convertCpus);
+    if (niceness != NICE_UNSET) ui.video->setNiceness(niceness);
+    if (rtPriority != RTPRIORITY_UNSET) ui.video->setRtPriority(rtPriority);
+    if (!shmName.isNull()) ui.video->setShmName(shmName);
     ui.video->setUrl(url);
+    if (!recordFile.isNull()) {
+        ui.video->setRecordFile(recordFile);
+        ui.video->setRecording(true);
+    }
     top->setWindowTitle(QString("ffmpegViewer: %1").arg(url));
 
     /* Connect it to CA */
     if (!prefix.isNull()) {
+        // one context on the GUI thread, shared by the monitor and the writer
+        ca_context_create(ca_enable_preemptive_callback);
         caValueMonitor *mon = new caValueMonitor(prefix, top);
         QObject::connect( mon, SIGNAL(gxChanged(int)),
                           ui.video, SLOT(setGx(int)) );
@@ -84,6 +172,33 @@ int main(int argc, char *argv[])
         QObject::connect( ui.video, SIGNAL(gcolChanged(QColor)),
                           mon, SLOT(setGcol(QColor)) );
         mon->start();
+        if (publishStats || publishMetrics) {
+            caStatsWriter *writer = new caStatsWriter(prefix, top);
+            QObject::connect( ui.video, SIGNAL(centroidXChanged(double)),
+                              writer, SLOT(setCx(double)) );
+            QObject::connect( ui.video, SIGNAL(centroidYChanged(double)),
+                              writer, SLOT(setCy(double)) );
+            QObject::connect( ui.video, SIGNAL(sigmaXChanged(double)),
+                              writer, SLOT(setSx(double)) );
+            QObject::connect( ui.video, SIGNAL(sigmaYChanged(double)),
+                              writer, SLOT(setSy(double)) );
+            QObject::connect( ui.video, SIGNAL(fpsChanged(double)),
+                              writer, SLOT(setFps(double)) );
+            QObject::connect( ui.video, SIGNAL(framesDroppedChanged(int)),
+                              writer, SLOT(setDropped(int)) );
+            QObject::connect( ui.video, SIGNAL(decodeTimeChanged(double)),
+                              writer, SLOT(setDecodeTime(double)) );
+            QObject::connect( ui.video, SIGNAL(convertTimeChanged(double)),
+                              writer, SLOT(setConvertTime(double)) );
+            QObject::connect( ui.video, SIGNAL(renderTimeChanged(double)),
+                              writer, SLOT(setRenderTime(double)) );
+            QObject::connect( ui.video, SIGNAL(poolUsageChanged(double)),
+                              writer, SLOT(setPoolUsage(double)) );
+            QObject::connect( ui.video, SIGNAL(latencyChanged(double)),
+                              writer, SLOT(setLatency(double)) );
+            if (publishStats) ui.video->setStats(true);
+            writer->start(publishStats, publishMetrics);
+        }
     } else {
 		/* Set the grid */
 		ui.video->setGx(100);
@@ -93,5 +208,10 @@ int main(int argc, char *argv[])
     
     /* Show it */
     top->show();
-    return app.exec();
+    int ret = app.exec();
+    if (backend == BACKEND_NULL) {
+        printf("Rendered %d frames, last checksum %08x, %.2f ms each\n",
+            ui.video->renderCount(), ui.video->renderChecksum(), ui.video->renderTime());
+    }
+    return ret;
 }
@@ -1,6 +1,6 @@
 TARGET = ffmpegViewer
-HEADERS += SSpinBox.h caValueMonitor.h
-SOURCES += ffmpegViewer.cpp SSpinBox.cpp caValueMonitor.cpp
+HEADERS += SSpinBox.h caValueMonitor.h caStatsWriter.h plotWidget.h
+SOURCES += ffmpegViewer.cpp SSpinBox.cpp caValueMonitor.cpp caStatsWriter.cpp plotWidget.cpp
 FORMS += ffmpegViewer.ui  
 target.path = ../../prefix/bin
 INSTALLS += target
@@ -22,4 +22,7 @@ LIBS += -L$$(FFMPEG_PREFIX)/lib -lavfilter -lavdevice -lavformat -lavcodec -lavu
 DEFINES += __STDC_CONSTANT_MACROS
 
 # xvideo stuff
-LIBS += -lXv
+LIBS += -lXv -lXext
+
+# shared memory frame export
+LIBS += -lrt
@@ -0,0 +1,30 @@
+#include "plotWidget.h"
+#include <QPainter>
+
+plotWidget::plotWidget(QWidget *parent)
+    : QWidget(parent)
+{
+    this->setMinimumSize(128, 64);
+}
+
+void plotWidget::setData(QVector<int> data) {
+    this->data = data;
+    update();
+}
+
+// scale the data to fill the widget, with 0 at the bottom
+void plotWidget::paintEvent(QPaintEvent *) {
+    QPainter painter(this);
+    painter.fillRect(rect(), Qt::black);
+    if (this->data.size() < 2) return;
+    int max = 1;
+    for (int i = 0; i < this->data.size(); i++) max = qMax(max, this->data[i]);
+    double sx = (width() - 1) / (double) (this->data.size() - 1);
+    double sy = (height() - 1) / (double) max;
+    QPolygonF line;
+    for (int i = 0; i < this->data.size(); i++) {
+        line << QPointF(i * sx, height() - 1 - this->data[i] * sy);
+    }
+    painter.setPen(Qt::green);
+    painter.drawPolyline(line);
+}
@@ -0,0 +1,25 @@
+#ifndef PLOTWIDGET_H
+#define PLOTWIDGET_H
+
+#include <QWidget>
+#include <QVector>
+
+/* Draws a compact array of values as a line, scaled to fill the widget */
+class plotWidget : public QWidget
+{
+    Q_OBJECT
+
+public:
+    plotWidget(QWidget *parent = 0);
+
+public slots:
+    void setData(QVector<int> data);
+
+protected:
+    void paintEvent(QPaintEvent *);
+
+private:
+    QVector<int> data;
+};
+
+#endif
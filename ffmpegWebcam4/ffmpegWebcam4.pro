@@ -14,5 +14,8 @@ LIBS += -L$$(FFMPEG_PREFIX)/lib -lavfilter -lavdevice -lavformat -lavcodec -lavu
 DEFINES += __STDC_CONSTANT_MACROS
 
 # xvideo stuff
-LIBS += -lXv
+LIBS += -lXv -lXext
 
+
+# shared memory frame export
+LIBS += -lrt
@@ -0,0 +1,183 @@
+#include "ffmpegAccumulator.h"
+#include <QtCore/qmath.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// sum += in - out, out may be NULL while the boxcar is filling
+static void accumulateRow(quint16 *sum, const unsigned char *in,
+        const unsigned char *out, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (in + i));
+        __m128i s0 = _mm_loadu_si128((const __m128i *) (sum + i));
+        __m128i s1 = _mm_loadu_si128((const __m128i *) (sum + i + 8));
+        s0 = _mm_add_epi16(s0, _mm_unpacklo_epi8(a, zero));
+        s1 = _mm_add_epi16(s1, _mm_unpackhi_epi8(a, zero));
+        if (out) {
+            __m128i b = _mm_loadu_si128((const __m128i *) (out + i));
+            s0 = _mm_sub_epi16(s0, _mm_unpacklo_epi8(b, zero));
+            s1 = _mm_sub_epi16(s1, _mm_unpackhi_epi8(b, zero));
+        }
+        _mm_storeu_si128((__m128i *) (sum + i), s0);
+        _mm_storeu_si128((__m128i *) (sum + i + 8), s1);
+    }
+#endif
+    for (; i < n; i++) {
+        sum[i] += in[i];
+        if (out) sum[i] -= out[i];
+    }
+}
+
+// dest = sum / count, where recip = 65536 / count rounded up
+static void averageRow(const quint16 *sum, unsigned char *dest, quint16 recip, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i r = _mm_set1_epi16((short) recip);
+    for (; i + 16 <= n; i += 16) {
+        __m128i s0 = _mm_loadu_si128((const __m128i *) (sum + i));
+        __m128i s1 = _mm_loadu_si128((const __m128i *) (sum + i + 8));
+        s0 = _mm_mulhi_epu16(s0, r);
+        s1 = _mm_mulhi_epu16(s1, r);
+        _mm_storeu_si128((__m128i *) (dest + i), _mm_packus_epi16(s0, s1));
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned int v = ((unsigned int) sum[i] * recip) >> 16;
+        dest[i] = v > 255 ? 255 : v;
+    }
+}
+
+// acc += ((in << 7) - acc) >> shift, then in = acc >> 7 rounded
+static void decayRow(qint16 *acc, unsigned char *in, int shift, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi16(64);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (in + i));
+        __m128i a0 = _mm_slli_epi16(_mm_unpacklo_epi8(a, zero), 7);
+        __m128i a1 = _mm_slli_epi16(_mm_unpackhi_epi8(a, zero), 7);
+        __m128i s0 = _mm_loadu_si128((const __m128i *) (acc + i));
+        __m128i s1 = _mm_loadu_si128((const __m128i *) (acc + i + 8));
+        s0 = _mm_add_epi16(s0, _mm_sra_epi16(_mm_sub_epi16(a0, s0), sh));
+        s1 = _mm_add_epi16(s1, _mm_sra_epi16(_mm_sub_epi16(a1, s1), sh));
+        _mm_storeu_si128((__m128i *) (acc + i), s0);
+        _mm_storeu_si128((__m128i *) (acc + i + 8), s1);
+        s0 = _mm_srli_epi16(_mm_add_epi16(s0, half), 7);
+        s1 = _mm_srli_epi16(_mm_add_epi16(s1, half), 7);
+        _mm_storeu_si128((__m128i *) (in + i), _mm_packus_epi16(s0, s1));
+    }
+#endif
+    for (; i < n; i++) {
+        acc[i] += ((in[i] << 7) - acc[i]) >> shift;
+        in[i] = (acc[i] + 64) >> 7;
+    }
+}
+
+FFAccumulator::FFAccumulator() {
+    this->pool = new FFBufferPool();
+    this->acc = NULL;
+    this->width = 0;
+    this->height = 0;
+    this->pix_fmt = PIX_FMT_NONE;
+    this->frames = 1;
+    this->mode = 0;
+    this->count = 0;
+}
+
+FFAccumulator::~FFAccumulator() {
+    reset();
+    delete this->pool;
+}
+
+// forget everything we've summed so far
+void FFAccumulator::reset() {
+    for (int i = 0; i < this->history.size(); i++) {
+        this->history[i]->release();
+    }
+    this->history.clear();
+    if (this->acc) this->acc->release();
+    this->acc = NULL;
+    this->count = 0;
+}
+
+// replace the luma plane of buf with the average of the last few frames
+void FFAccumulator::process(FFBuffer *buf, int frames, int mode) {
+    frames = qBound(1, frames, MAXACCUMULATE);
+    if (frames != this->frames || mode != this->mode || buf->width != this->width ||
+            buf->height != this->height || buf->pix_fmt != this->pix_fmt) {
+        // start again
+        reset();
+        this->frames = frames;
+        this->mode = mode;
+        this->width = buf->width;
+        this->height = buf->height;
+        this->pix_fmt = buf->pix_fmt;
+    }
+    if (frames <= 1) return;
+
+    // we can only do this for formats with an 8-bit luma plane
+    if (!hasLumaPlane(buf->pix_fmt)) return;
+
+    // make the sum
+    const int w = buf->width;
+    const int h = buf->height;
+    const int ls = buf->pFrame->linesize[0];
+    unsigned char *luma = buf->pFrame->data[0];
+    if (this->acc == NULL) {
+        this->acc = this->pool->findFree(w * h * sizeof(quint16));
+        if (this->acc == NULL) {
+            printf("Out of memory for accumulation, not averaging\n");
+            return;
+        }
+        memset(this->acc->mem, 0, w * h * sizeof(quint16));
+    }
+
+    if (mode == 1) {
+        // exponential decay, starting from the first frame
+        qint16 *acc = (qint16 *) this->acc->mem;
+        if (this->count == 0) {
+            for (int y = 0; y < h; y++) {
+                for (int x = 0; x < w; x++) acc[y * w + x] = luma[y * ls + x] << 7;
+            }
+            this->count = 1;
+            return;
+        }
+        int shift = qRound(log((double) frames) / log(2.0));
+        for (int y = 0; y < h; y++) {
+            decayRow(acc + y * w, luma + y * ls, shift, w);
+        }
+        return;
+    }
+
+    // boxcar, recycle the oldest plane once we have enough of them
+    FFBuffer *slot = NULL;
+    if (this->history.size() < frames) {
+        slot = this->pool->findFree(w * h);
+        if (slot == NULL && this->history.isEmpty()) {
+            printf("Out of memory for accumulation, not averaging\n");
+            return;
+        }
+    }
+    FFBuffer *oldest = NULL;
+    if (slot == NULL) {
+        oldest = this->history.takeFirst();
+        slot = oldest;
+    } else {
+        this->count++;
+    }
+    quint16 *sum = (quint16 *) this->acc->mem;
+    quint16 recip = (quint16) qMin(65535, (65536 + this->count - 1) / this->count);
+    for (int y = 0; y < h; y++) {
+        unsigned char *row = slot->mem + y * w;
+        accumulateRow(sum + y * w, luma + y * ls, oldest ? row : NULL, w);
+        memcpy(row, luma + y * ls, w);
+        if (this->count > 1) averageRow(sum + y * w, luma + y * ls, recip, w);
+    }
+    this->history.append(slot);
+}
@@ -0,0 +1,35 @@
+#ifndef FFMPEGACCUMULATOR_H
+#define FFMPEGACCUMULATOR_H
+
+#include "ffmpegWidget.h"
+
+// max number of frames that can be averaged, the sums are 16-bit
+#define MAXACCUMULATE 256
+
+/* Averages the luma plane of the last few frames from a stream. It keeps a
+ * running 16-bit sum per pixel, so the cost per frame doesn't depend on the
+ * number of frames averaged. In boxcar mode the oldest frame is subtracted
+ * from the sum as each new one is added, in decay mode the sum is an
+ * exponentially weighted average with a time constant of about N frames
+ */
+class FFAccumulator
+{
+public:
+    FFAccumulator ();
+    ~FFAccumulator ();
+    void process(FFBuffer *buf, int frames, int mode);
+    void reset();
+
+private:
+    FFBufferPool *pool;         // luma planes and sums, from the frame budget
+    QList<FFBuffer *> history;  // luma planes in the boxcar, oldest first
+    FFBuffer *acc;              // per pixel sum, or v<<7 in decay mode
+    int width;
+    int height;
+    PixelFormat pix_fmt;
+    int frames;                 // number of frames we are averaging
+    int mode;                   // 0 = boxcar, 1 = exponential decay
+    int count;                  // frames in the sum so far
+};
+
+#endif
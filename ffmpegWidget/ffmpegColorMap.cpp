@@ -0,0 +1,211 @@
+#include "ffmpegColorMap.h"
+#include "colorMaps.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QFile>
+#include <QFileInfo>
+#include <QVector>
+#include <stdio.h>
+#include <string.h>
+
+/* Control points for the generated maps, as 0xRRGGBB. Unless positions are
+ * given they are evenly spaced over the grey levels and we interpolate
+ * linearly between them. The perceptually uniform ones are sampled from the
+ * matplotlib maps of the same name
+ */
+static const unsigned int greyStops[] = { 0x000000, 0xffffff };
+static const unsigned int hotStops[] = { 0x000000, 0xff0000, 0xffff00, 0xffffff };
+static const double hotPos[] = { 0.0, 0.375, 0.75, 1.0 };
+static const unsigned int viridisStops[] = {
+    0x440154, 0x472c7a, 0x3b518b, 0x2c718e, 0x21908d,
+    0x27ad81, 0x5cc863, 0xaadc32, 0xfde725 };
+static const unsigned int infernoStops[] = {
+    0x000004, 0x1f0c48, 0x550f6d, 0x88226a, 0xba3655,
+    0xe35933, 0xf98c0a, 0xf9c932, 0xfcffa4 };
+static const unsigned int magmaStops[] = {
+    0x000004, 0x1c1044, 0x4f127b, 0x812581, 0xb5367a,
+    0xe55064, 0xfb8761, 0xfec287, 0xfcfdbf };
+static const unsigned int plasmaStops[] = {
+    0x0d0887, 0x46039f, 0x7201a8, 0x9c179e, 0xbd3786,
+    0xd8576b, 0xed7953, 0xfb9f3a, 0xfdca26, 0xf0f921 };
+
+#define NSTOPS(a) ((int) (sizeof(a) / sizeof(a[0])))
+
+// fill in r, g and b by interpolating between n control points
+static void interpolate(FFColorMap *map, const unsigned int *rgb, const double *pos, int n) {
+    int seg = 0;
+    for (int i = 0; i < 256; i++) {
+        double t = i / 255.0;
+        while (seg < n - 2 && t > (pos ? pos[seg + 1] : (seg + 1) / (double) (n - 1))) seg++;
+        double t0 = pos ? pos[seg] : seg / (double) (n - 1);
+        double t1 = pos ? pos[seg + 1] : (seg + 1) / (double) (n - 1);
+        double f = (t1 > t0) ? (t - t0) / (t1 - t0) : 0;
+        if (f < 0) f = 0;
+        if (f > 1) f = 1;
+        unsigned int a = rgb[seg], b = rgb[seg + 1];
+        map->r[i] = (unsigned char) ((a >> 16 & 0xff) * (1 - f) + (b >> 16 & 0xff) * f + 0.5);
+        map->g[i] = (unsigned char) ((a >> 8 & 0xff) * (1 - f) + (b >> 8 & 0xff) * f + 0.5);
+        map->b[i] = (unsigned char) ((a & 0xff) * (1 - f) + (b & 0xff) * f + 0.5);
+    }
+}
+
+static unsigned char clip(double v) {
+    if (v < 0) return 0;
+    if (v > 255) return 255;
+    return (unsigned char) (v + 0.5);
+}
+
+void FFColorMap::makeYUV() {
+    for (int i = 0; i < 256; i++) {
+        this->y[i] = clip(0.299 * r[i] + 0.587 * g[i] + 0.114 * b[i]);
+        this->u[i] = clip(-0.169 * r[i] - 0.331 * g[i] + 0.499 * b[i] + 128);
+        this->v[i] = clip(0.499 * r[i] - 0.418 * g[i] - 0.0813 * b[i] + 128);
+    }
+}
+
+/* The table of maps, made the first time anyone asks for one. It is static
+ * so the alignment of the tables is honoured, and maps are only ever added
+ * to the end of it
+ */
+class FFColorMapTable
+{
+public:
+    FFColorMapTable();
+    FFColorMap *add(const char *name);
+    void copy(const char *name, const unsigned char *r, const unsigned char *g,
+        const unsigned char *b, const unsigned char *y, const unsigned char *u,
+        const unsigned char *v);
+    void generate(const char *name, const unsigned int *rgb, const double *pos, int n);
+    FFColorMap maps[MAXCOLORMAPS];
+    int n;                      // number of maps in use
+    QMutex mutex;               // protects n while maps are loaded
+};
+
+FFColorMapTable::FFColorMapTable() {
+    this->n = 0;
+    // the hand made maps, numbered as they always were
+    copy("Rainbow", RainbowColorR, RainbowColorG, RainbowColorB,
+        RainbowColorY, RainbowColorU, RainbowColorV);
+    copy("Iron", IronColorR, IronColorG, IronColorB,
+        IronColorY, IronColorU, IronColorV);
+    // and the generated ones
+    generate("Grey", greyStops, NULL, NSTOPS(greyStops));
+    generate("Hot", hotStops, hotPos, NSTOPS(hotStops));
+    generate("Viridis", viridisStops, NULL, NSTOPS(viridisStops));
+    generate("Inferno", infernoStops, NULL, NSTOPS(infernoStops));
+    generate("Magma", magmaStops, NULL, NSTOPS(magmaStops));
+    generate("Plasma", plasmaStops, NULL, NSTOPS(plasmaStops));
+}
+
+FFColorMap *FFColorMapTable::add(const char *name) {
+    if (this->n >= MAXCOLORMAPS) return NULL;
+    FFColorMap *map = &(this->maps[this->n]);
+    strncpy(map->name, name, sizeof(map->name) - 1);
+    map->name[sizeof(map->name) - 1] = 0;
+    return map;
+}
+
+void FFColorMapTable::copy(const char *name, const unsigned char *r, const unsigned char *g,
+        const unsigned char *b, const unsigned char *y, const unsigned char *u,
+        const unsigned char *v) {
+    FFColorMap *map = add(name);
+    memcpy(map->r, r, 256);
+    memcpy(map->g, g, 256);
+    memcpy(map->b, b, 256);
+    memcpy(map->y, y, 256);
+    memcpy(map->u, u, 256);
+    memcpy(map->v, v, 256);
+    this->n++;
+}
+
+void FFColorMapTable::generate(const char *name, const unsigned int *rgb, const double *pos, int n) {
+    FFColorMap *map = add(name);
+    interpolate(map, rgb, pos, n);
+    map->makeYUV();
+    this->n++;
+}
+
+static FFColorMapTable &table() {
+    static FFColorMapTable t;
+    return t;
+}
+
+const FFColorMap *FFColorMap::get(int fcol) {
+    FFColorMapTable &t = table();
+    QMutexLocker locker(&t.mutex);
+    if (fcol < 1 || fcol > t.n) fcol = 1;
+    return &(t.maps[fcol - 1]);
+}
+
+int FFColorMap::count() {
+    FFColorMapTable &t = table();
+    QMutexLocker locker(&t.mutex);
+    return t.n;
+}
+
+QStringList FFColorMap::names() {
+    FFColorMapTable &t = table();
+    QMutexLocker locker(&t.mutex);
+    QStringList names;
+    names << "None";
+    for (int i = 0; i < t.n; i++) names << t.maps[i].name;
+    return names;
+}
+
+/* Load a map from a text file with one colour per line, as "r g b". Values
+ * are 0..255, or 0..1 if any of them has a decimal point. Blank lines and
+ * lines starting with # are ignored. Any number of colours from 2 up can be
+ * given, they are spread evenly over the grey levels
+ */
+int FFColorMap::load(const QString &filename) {
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        printf("Can't open colour map %s\n", filename.toAscii().data());
+        return -1;
+    }
+    QVector<double> values;
+    bool unit = false;
+    while (!file.atEnd()) {
+        QString line = QString(file.readLine()).trimmed();
+        if (line.isEmpty() || line.startsWith("#")) continue;
+        QStringList fields = line.split(QRegExp("[\\s,]+"), QString::SkipEmptyParts);
+        if (fields.size() < 3) {
+            printf("Bad line in colour map %s: %s\n", filename.toAscii().data(), line.toAscii().data());
+            return -1;
+        }
+        for (int i = 0; i < 3; i++) {
+            bool ok;
+            values.append(fields.at(i).toDouble(&ok));
+            if (!ok) {
+                printf("Bad line in colour map %s: %s\n", filename.toAscii().data(), line.toAscii().data());
+                return -1;
+            }
+            if (fields.at(i).contains('.')) unit = true;
+        }
+    }
+    int n = values.size() / 3;
+    if (n < 2) {
+        printf("Colour map %s needs at least 2 colours\n", filename.toAscii().data());
+        return -1;
+    }
+    QVector<unsigned int> rgb(n);
+    double scale = unit ? 255.0 : 1.0;
+    for (int i = 0; i < n; i++) {
+        rgb[i] = clip(values[3 * i] * scale) << 16 |
+                 clip(values[3 * i + 1] * scale) << 8 |
+                 clip(values[3 * i + 2] * scale);
+    }
+
+    FFColorMapTable &t = table();
+    QMutexLocker locker(&t.mutex);
+    FFColorMap *map = t.add(QFileInfo(filename).baseName().toAscii().data());
+    if (map == NULL) {
+        printf("Too many colour maps, can't load %s\n", filename.toAscii().data());
+        return -1;
+    }
+    interpolate(map, rgb.data(), NULL, n);
+    map->makeYUV();
+    // only count it once it is complete
+    t.n++;
+    return t.n;
+}
@@ -0,0 +1,40 @@
+#ifndef FFMPEGCOLORMAP_H
+#define FFMPEGCOLORMAP_H
+
+#include <QString>
+#include <QStringList>
+
+// max number of colour maps, built in and loaded from files
+#define MAXCOLORMAPS 32
+
+/* A false colour map, with RGB and full range YUV tables for each of the 256
+ * grey levels. Maps are made once, either from the built in generators or
+ * from a file, and never change or move afterwards, so the conversion threads
+ * can look them up without any setup per frame. Each table starts on a cache
+ * line. fcol 0 means no false colour, the maps are numbered from 1.
+ */
+class FFColorMap
+{
+public:
+    unsigned char r[256] __attribute__((aligned(64)));
+    unsigned char g[256] __attribute__((aligned(64)));
+    unsigned char b[256] __attribute__((aligned(64)));
+    unsigned char y[256] __attribute__((aligned(64)));
+    unsigned char u[256] __attribute__((aligned(64)));
+    unsigned char v[256] __attribute__((aligned(64)));
+    char name[64];
+
+    // map number fcol, anything we don't know about gives Rainbow
+    static const FFColorMap *get(int fcol);
+    // number of maps, including any loaded from files
+    static int count();
+    // names of the maps, index 0 is "None"
+    static QStringList names();
+    // load a map from a file, returns its fcol or -1 on error
+    static int load(const QString &filename);
+
+    // fill in y, u and v from r, g and b
+    void makeYUV();
+};
+
+#endif
@@ -0,0 +1,287 @@
+#include "ffmpegMjpegReader.h"
+#include <QUrl>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+// size of the buffer we receive headers into, parts with a Content-Length
+// are received straight into the packet instead
+#define MJPEGBUFSIZE 65536
+
+FFMjpegReader::FFMjpegReader (int *stopping) {
+    // the FFThread sets this to 1 when it wants us to give up
+    this->stopping = stopping;
+    this->fd = -1;
+    this->buf.resize(MJPEGBUFSIZE);
+    this->start = 0;
+    this->end = 0;
+    this->frameSize = 0;
+}
+
+FFMjpegReader::~FFMjpegReader() {
+    close();
+}
+
+// ffmpegServer serves its MJPEG streams as http://host:port/name.mjpg
+bool FFMjpegReader::handles(const char *url) {
+    QUrl u(QString::fromAscii(url));
+    return u.scheme() == "http" && u.path().endsWith(".mjpg");
+}
+
+int FFMjpegReader::open(const char *url) {
+    close();
+    QUrl u(QString::fromAscii(url));
+    QByteArray host = u.host().toAscii();
+    QByteArray port = QByteArray::number(u.port(80));
+    QByteArray path = u.encodedPath();
+    if (path.isEmpty()) path = "/";
+    if (u.hasQuery()) path += "?" + u.encodedQuery();
+
+    // connect
+    struct addrinfo hints, *res, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.data(), port.data(), &hints, &res) != 0) {
+        printf("Can't resolve %s\n", host.data());
+        return -1;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        this->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (this->fd < 0) continue;
+        // the send timeout limits connect too, the receive one lets us
+        // notice we've been asked to stop
+        struct timeval tv;
+        tv.tv_sec = MJPEGCONNECTTIMEOUT;
+        tv.tv_usec = 0;
+        setsockopt(this->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        tv.tv_sec = 0;
+        tv.tv_usec = MJPEGSTOPCHECK * 1000;
+        setsockopt(this->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (::connect(this->fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        ::close(this->fd);
+        this->fd = -1;
+    }
+    freeaddrinfo(res);
+    if (this->fd < 0) {
+        printf("Can't connect to %s:%s\n", host.data(), port.data());
+        return -1;
+    }
+
+    // ask for the stream, 1.0 so it can't come back chunked
+    QByteArray request = "GET " + path + " HTTP/1.0\r\nHost: " + host +
+        "\r\nUser-Agent: ffmpegWidget\r\nConnection: close\r\n\r\n";
+    if (send(this->fd, request.data(), request.size(), MSG_NOSIGNAL) != request.size()) {
+        printf("Can't send request to %s:%s\n", host.data(), port.data());
+        close();
+        return -1;
+    }
+
+    // check the response is a multipart stream and find its boundary
+    QByteArray line;
+    if (readLine(line) < 0) {
+        close();
+        return -1;
+    }
+    if (!line.startsWith("HTTP/1.") || line.mid(9, 3) != "200") {
+        printf("%s returned %s\n", url, line.data());
+        close();
+        return 0;
+    }
+    QByteArray contentType;
+    while (true) {
+        if (readLine(line) < 0) {
+            close();
+            return -1;
+        }
+        if (line.isEmpty()) break;
+        if (line.toLower().startsWith("content-type:")) {
+            contentType = line.mid(13).trimmed();
+        }
+    }
+    int b = contentType.toLower().indexOf("boundary=");
+    if (!contentType.toLower().startsWith("multipart/") || b < 0) {
+        close();
+        return 0;
+    }
+    this->boundary = contentType.mid(b + 9);
+    int semi = this->boundary.indexOf(';');
+    if (semi >= 0) this->boundary.truncate(semi);
+    this->boundary = this->boundary.trimmed();
+    if (this->boundary.startsWith('"')) this->boundary = this->boundary.mid(1);
+    if (this->boundary.endsWith('"')) this->boundary.chop(1);
+    if (this->boundary.isEmpty()) {
+        close();
+        return 0;
+    }
+    return 1;
+}
+
+void FFMjpegReader::close() {
+    if (this->fd >= 0) ::close(this->fd);
+    this->fd = -1;
+    this->start = 0;
+    this->end = 0;
+}
+
+// receive up to size bytes, waiting for at least one unless we're stopping
+int FFMjpegReader::receive(char *dest, int size) {
+    while (true) {
+        int n = recv(this->fd, dest, size, 0);
+        if (n > 0) return n;
+        if (n == 0) return -1;
+        if (errno == EINTR) continue;
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) && *this->stopping != 1) continue;
+        return -1;
+    }
+}
+
+// receive more into buf, moving what we have to the front if it is full
+int FFMjpegReader::fill() {
+    if (this->start == this->end) {
+        this->start = 0;
+        this->end = 0;
+    } else if (this->end == this->buf.size()) {
+        memmove(this->buf.data(), this->buf.data() + this->start, this->end - this->start);
+        this->end -= this->start;
+        this->start = 0;
+    }
+    if (this->end == this->buf.size()) return -1;
+    int n = receive(this->buf.data() + this->end, this->buf.size() - this->end);
+    if (n < 0) return -1;
+    this->end += n;
+    return n;
+}
+
+// read a header line without its line ending
+int FFMjpegReader::readLine(QByteArray &line) {
+    while (true) {
+        const char *p = this->buf.constData() + this->start;
+        const char *nl = (const char *) memchr(p, '\n', this->end - this->start);
+        if (nl) {
+            int len = nl - p;
+            if (len > 0 && p[len - 1] == '\r') len--;
+            line = QByteArray(p, len);
+            this->start += nl - p + 1;
+            return 0;
+        }
+        if (this->end - this->start >= MJPEGMAXLINE) {
+            printf("Header line too long in MJPEG stream\n");
+            return -1;
+        }
+        if (fill() < 0) return -1;
+    }
+}
+
+// servers don't agree whether the boundary parameter includes the --
+bool FFMjpegReader::isBoundary(const QByteArray &line) {
+    return line.startsWith("--" + this->boundary) || line.startsWith(this->boundary);
+}
+
+/* read the data of a part into frame, length is its Content-Length or -1 if
+ * it didn't give one, in which case it ends at the next boundary or when
+ * what we've received ends with a JPEG end of image marker
+ */
+int FFMjpegReader::readPart(int length) {
+    const int maxSize = MJPEGMAXFRAMEMB * 1024 * 1024;
+    if (length > maxSize) {
+        printf("JPEG of %d bytes is too big, max is %d MB\n", length, MJPEGMAXFRAMEMB);
+        return -1;
+    }
+    if (length >= 0) {
+        if (this->frame.size() < length + FF_INPUT_BUFFER_PADDING_SIZE) {
+            this->frame.resize(length + FF_INPUT_BUFFER_PADDING_SIZE);
+        }
+        // take what we already have, then receive the rest straight into
+        // the packet
+        int have = qMin(this->end - this->start, length);
+        memcpy(this->frame.data(), this->buf.constData() + this->start, have);
+        this->start += have;
+        while (have < length) {
+            int n = receive(this->frame.data() + have, length - have);
+            if (n < 0) return -1;
+            have += n;
+        }
+        this->frameSize = length;
+        return 0;
+    }
+
+    int have = 0;
+    while (true) {
+        // move what we've received into the packet
+        int n = this->end - this->start;
+        if (have + n > maxSize) {
+            printf("JPEG is too big, max is %d MB\n", MJPEGMAXFRAMEMB);
+            return -1;
+        }
+        if (this->frame.size() < have + n + FF_INPUT_BUFFER_PADDING_SIZE) {
+            this->frame.resize(qMax(2 * this->frame.size(), have + n + FF_INPUT_BUFFER_PADDING_SIZE));
+        }
+        memcpy(this->frame.data() + have, this->buf.constData() + this->start, n);
+        this->start = this->end = 0;
+        int from = qMax(have - this->boundary.size(), 0);
+        have += n;
+        // look for the boundary in what's new
+        int b = QByteArray::fromRawData(this->frame.constData(), have).indexOf(this->boundary, from);
+        if (b >= 0) {
+            // give it and anything after it back to the header parser
+            if (this->buf.size() < have - b) this->buf.resize(have - b);
+            memcpy(this->buf.data(), this->frame.constData() + b, have - b);
+            this->end = have - b;
+            if (b >= 2 && this->frame.at(b - 1) == '-' && this->frame.at(b - 2) == '-') b -= 2;
+            if (b >= 1 && this->frame.at(b - 1) == '\n') b--;
+            if (b >= 1 && this->frame.at(b - 1) == '\r') b--;
+            this->frameSize = b;
+            return 0;
+        }
+        // or the end of the image, which is only ever followed by the
+        // line ending before the next boundary. Apart from in embedded
+        // thumbnails it can't appear in the middle of a JPEG
+        int e = have;
+        while (e > 0 && (this->frame.at(e - 1) == '\r' || this->frame.at(e - 1) == '\n')) e--;
+        if (e >= 2 && (unsigned char) this->frame.at(e - 2) == 0xff &&
+                (unsigned char) this->frame.at(e - 1) == 0xd9) {
+            this->frameSize = e;
+            return 0;
+        }
+        if (fill() < 0) return -1;
+    }
+}
+
+int FFMjpegReader::read(AVPacket *packet) {
+    if (this->fd < 0) return -1;
+    // skip to the next boundary, then read the part headers
+    QByteArray line;
+    do {
+        if (readLine(line) < 0) return -1;
+    } while (!isBoundary(line));
+    if (line.endsWith("--")) {
+        // the server has finished
+        return -1;
+    }
+    int length = -1;
+    while (true) {
+        if (readLine(line) < 0) return -1;
+        if (line.isEmpty()) break;
+        if (line.toLower().startsWith("content-length:")) {
+            bool ok;
+            length = line.mid(15).trimmed().toInt(&ok);
+            if (!ok || length < 0) length = -1;
+        }
+    }
+    if (readPart(length) < 0) return -1;
+    memset(this->frame.data() + this->frameSize, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+    // every JPEG is a key frame, and the packet doesn't own its data so
+    // av_free_packet leaves our buffer alone
+    av_init_packet(packet);
+    packet->data = (uint8_t *) this->frame.data();
+    packet->size = this->frameSize;
+    packet->stream_index = 0;
+    packet->flags = AV_PKT_FLAG_KEY;
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef FFMPEGMJPEGREADER_H
+#define FFMPEGMJPEGREADER_H
+
+#include "ffmpegWidget.h"
+
+// max size of a single JPEG we'll accept from a stream in MB
+#define MJPEGMAXFRAMEMB 32
+// max length of an HTTP header line
+#define MJPEGMAXLINE 4096
+// seconds to wait for a connection to an MJPEG server
+#define MJPEGCONNECTTIMEOUT 5
+// ms between checks that we haven't been asked to stop while waiting for
+// data, well inside the time ffmpegWidget waits for the thread to finish
+#define MJPEGSTOPCHECK 100
+
+/* Reads the multipart JPEG streams that ffmpegServer serves over HTTP
+ * straight from a socket, instead of probing them with avformat and going
+ * through the mpjpeg demuxer. Each part is read into a packet buffer that is
+ * reused for every frame, directly from the socket when the part gives its
+ * Content-Length, and handed back as soon as its last byte arrives.
+ */
+class FFMjpegReader
+{
+public:
+    FFMjpegReader (int *stopping);
+    ~FFMjpegReader ();
+    // true if url looks like an ffmpegServer MJPEG stream
+    static bool handles(const char *url);
+    // 1 if connected to a multipart stream, 0 if the server answered with
+    // something else, -1 if we couldn't talk to it
+    int open(const char *url);
+    // 0 and a packet pointing into our buffer, valid until the next read,
+    // or -1 at the end of the stream
+    int read(AVPacket *packet);
+    void close();
+
+private:
+    int receive(char *dest, int size);
+    int fill();
+    int readLine(QByteArray &line);
+    bool isBoundary(const QByteArray &line);
+    int readPart(int length);
+    int *stopping;              // the thread is finishing, give up
+    int fd;                     // socket, -1 if closed
+    QByteArray boundary;        // part delimiter, as the server gave it
+    QByteArray buf;             // received but not yet parsed
+    int start, end;             // the bytes of buf in use
+    QByteArray frame;           // packet data, only ever grows
+    int frameSize;              // bytes of frame in the packet
+};
+
+#endif
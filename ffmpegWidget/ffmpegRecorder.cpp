@@ -0,0 +1,242 @@
+#include "ffmpegRecorder.h"
+#include <QFileInfo>
+
+FFRecorder::FFRecorder (const QString &filename, QObject* parent)
+    : QThread (parent)
+{
+    this->mutex = new QMutex();
+    this->cond = new QWaitCondition();
+    this->queueBytes = 0;
+    // set this to 1 to finish when the queue is empty
+    this->stopping = 0;
+    this->_dropped = 0;
+    this->_written = 0;
+    this->waitKey = 0;
+    // if this has no extension we'll pick one to suit the codec
+    this->_filename = filename;
+    this->haveCodec = false;
+    this->codec_id = AV_CODEC_ID_NONE;
+    this->width = 0;
+    this->height = 0;
+    this->pix_fmt = PIX_FMT_NONE;
+    this->frameRate.num = 0;
+    this->frameRate.den = 1;
+    this->oc = NULL;
+    this->st = NULL;
+    this->headerWritten = false;
+    this->srcTimeBase.num = 1;
+    this->srcTimeBase.den = 1000;
+    this->firstMs = 0;
+    this->lastDts = AV_NOPTS_VALUE;
+}
+
+FFRecorder::~FFRecorder() {
+    delete this->cond;
+    delete this->mutex;
+}
+
+// copy the stream parameters, only the first call counts
+void FFRecorder::setCodec(AVCodecContext *codecCtx, AVRational frameRate) {
+    QMutexLocker locker(this->mutex);
+    if (this->haveCodec) return;
+    this->codec_id = codecCtx->codec_id;
+    this->width = codecCtx->coded_width ? codecCtx->coded_width : codecCtx->width;
+    this->height = codecCtx->coded_height ? codecCtx->coded_height : codecCtx->height;
+    this->pix_fmt = codecCtx->pix_fmt;
+    this->extradata = QByteArray((const char *) codecCtx->extradata,
+        codecCtx->extradata_size);
+    this->frameRate = frameRate;
+    this->haveCodec = true;
+}
+
+// queue a packet for writing, this never blocks on the disk
+bool FFRecorder::push(const FFPacket &packet) {
+    QMutexLocker locker(this->mutex);
+    if (this->stopping) return false;
+    // after dropping a packet we need a key frame to keep the file decodable
+    if (this->waitKey && !(packet.flags & AV_PKT_FLAG_KEY)) {
+        this->_dropped++;
+        return false;
+    }
+    if (this->queueBytes + packet.size > (qint64) RECORDQUEUEMB * 1024 * 1024) {
+        this->_dropped++;
+        this->waitKey = 1;
+        return false;
+    }
+    this->waitKey = 0;
+    this->queue.append(packet);
+    this->queueBytes += packet.size;
+    this->cond->wakeOne();
+    return true;
+}
+
+int FFRecorder::dropped() {
+    QMutexLocker locker(this->mutex);
+    return this->_dropped;
+}
+
+int FFRecorder::written() {
+    QMutexLocker locker(this->mutex);
+    return this->_written;
+}
+
+QString FFRecorder::filename() {
+    QMutexLocker locker(this->mutex);
+    return this->_filename;
+}
+
+// finish writing what's queued, then close the file
+void FFRecorder::stopGracefully() {
+    QMutexLocker locker(this->mutex);
+    this->stopping = 1;
+    this->cond->wakeOne();
+}
+
+// run the FFRecorder
+void FFRecorder::run() {
+    AVPacket pkt;
+    ffNameThread("ffrecord");
+    while (true) {
+        // wait for a packet
+        this->mutex->lock();
+        while (this->queue.isEmpty() && !this->stopping) {
+            this->cond->wait(this->mutex);
+        }
+        if (this->queue.isEmpty()) {
+            // stopping and nothing left to write
+            this->mutex->unlock();
+            break;
+        }
+        FFPacket packet = this->queue.takeFirst();
+        this->queueBytes -= packet.size;
+        this->mutex->unlock();
+
+        // the file has to start with a key frame
+        if (this->oc == NULL) {
+            if (!(packet.flags & AV_PKT_FLAG_KEY)) continue;
+            if (!openOutput()) break;
+            this->firstMs = packet.ms;
+        }
+
+        // Make up timestamps from the arrival time, or the frame count for
+        // containers that want a constant frame rate
+        qint64 ts;
+        if (this->srcTimeBase.den == 1000 && this->srcTimeBase.num == 1) {
+            ts = packet.ms - this->firstMs;
+        } else {
+            ts = this->_written;
+        }
+        ts = av_rescale_q(ts, this->srcTimeBase, this->st->time_base);
+        if (this->lastDts != AV_NOPTS_VALUE && ts <= this->lastDts) ts = this->lastDts + 1;
+        this->lastDts = ts;
+
+        // Write it without decoding
+        av_init_packet(&pkt);
+        pkt.data = (uint8_t *) packet.data.constData();
+        pkt.size = packet.size;
+        pkt.flags = packet.flags;
+        pkt.stream_index = this->st->index;
+        pkt.pts = ts;
+        pkt.dts = ts;
+        if (av_write_frame(this->oc, &pkt) < 0) {
+            emit failed(QString("Writing to '%1' failed").arg(this->_filename));
+            break;
+        }
+        this->mutex->lock();
+        this->_written++;
+        this->mutex->unlock();
+    }
+    closeOutput();
+}
+
+// make the output file and write its header
+bool FFRecorder::openOutput() {
+    // the stream parameters don't change once they are set
+    this->mutex->lock();
+    QString filename = this->_filename;
+    bool haveCodec = this->haveCodec;
+    this->mutex->unlock();
+    if (!haveCodec) {
+        emit failed(QString("No stream information for '%1'").arg(filename));
+        return false;
+    }
+
+    // pick a container to suit the codec if we weren't given one
+    if (QFileInfo(filename).suffix().isEmpty()) {
+        filename += (this->codec_id == AV_CODEC_ID_H264) ? ".mp4" : ".mkv";
+    }
+    QByteArray fn = filename.toLocal8Bit();
+    if (avformat_alloc_output_context2(&this->oc, NULL, NULL, fn.data()) < 0 || this->oc == NULL) {
+        emit failed(QString("Could not find a container for '%1'").arg(filename));
+        this->oc = NULL;
+        return false;
+    }
+    this->st = avformat_new_stream(this->oc, NULL);
+    if (this->st == NULL) {
+        emit failed(QString("Could not add a stream to '%1'").arg(filename));
+        closeOutput();
+        return false;
+    }
+
+    // copy the stream parameters across
+    AVCodecContext *c = this->st->codec;
+    c->codec_type = AVMEDIA_TYPE_VIDEO;
+    c->codec_id = this->codec_id;
+    c->codec_tag = 0;
+    c->width = this->width;
+    c->height = this->height;
+    c->pix_fmt = this->pix_fmt;
+    if (strcmp(this->oc->oformat->name, "avi") == 0) {
+        // avi can't cope with gaps in the timestamps, so count frames instead
+        if (this->frameRate.num > 0 && this->frameRate.den > 0) {
+            this->srcTimeBase.num = this->frameRate.den;
+            this->srcTimeBase.den = this->frameRate.num;
+        } else {
+            this->srcTimeBase.num = 1;
+            this->srcTimeBase.den = 25;
+        }
+    }
+    c->time_base = this->srcTimeBase;
+    this->st->time_base = this->srcTimeBase;
+    if (this->extradata.size() > 0) {
+        c->extradata = (uint8_t *) av_mallocz(this->extradata.size() + FF_INPUT_BUFFER_PADDING_SIZE);
+        memcpy(c->extradata, this->extradata.constData(), this->extradata.size());
+        c->extradata_size = this->extradata.size();
+    }
+    if (this->oc->oformat->flags & AVFMT_GLOBALHEADER) {
+        c->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    // open the file and write the header
+    if (!(this->oc->oformat->flags & AVFMT_NOFILE) &&
+            avio_open(&this->oc->pb, fn.data(), AVIO_FLAG_WRITE) < 0) {
+        emit failed(QString("Could not open '%1' for writing").arg(filename));
+        closeOutput();
+        return false;
+    }
+    if (avformat_write_header(this->oc, NULL) < 0) {
+        emit failed(QString("Could not write header to '%1'").arg(filename));
+        closeOutput();
+        return false;
+    }
+    this->headerWritten = true;
+    this->mutex->lock();
+    this->_filename = filename;
+    this->mutex->unlock();
+    printf("Recording to %s\n", fn.data());
+    emit opened(filename);
+    return true;
+}
+
+// write the trailer and close the file
+void FFRecorder::closeOutput() {
+    if (this->oc == NULL) return;
+    if (this->headerWritten) av_write_trailer(this->oc);
+    if (!(this->oc->oformat->flags & AVFMT_NOFILE) && this->oc->pb) {
+        avio_close(this->oc->pb);
+    }
+    avformat_free_context(this->oc);
+    this->oc = NULL;
+    this->st = NULL;
+    this->headerWritten = false;
+}
@@ -0,0 +1,63 @@
+#ifndef FFMPEGRECORDER_H
+#define FFMPEGRECORDER_H
+
+#include "ffmpegWidget.h"
+#include <QWaitCondition>
+
+// max size of the queue of packets waiting to be written in MB
+#define RECORDQUEUEMB 64
+
+/* thread that remuxes the packets an FFThread reads into a file without
+ * decoding them. The FFThread pushes packets onto a bounded queue, and if
+ * the disk can't keep up they are dropped and counted rather than blocking
+ */
+class FFRecorder : public QThread
+{
+    Q_OBJECT
+
+public:
+    FFRecorder (const QString &filename, QObject* parent);
+    ~FFRecorder ();
+    void run();
+    void setCodec(AVCodecContext *codecCtx, AVRational frameRate);
+    bool push(const FFPacket &packet);
+    int dropped();
+    int written();
+    QString filename();
+
+public slots:
+    void stopGracefully();
+
+signals:
+    void opened(QString filename);
+    void failed(QString message);
+
+private:
+    bool openOutput();
+    void closeOutput();
+    QMutex *mutex;              // protects the variables below
+    QWaitCondition *cond;
+    QList<FFPacket> queue;
+    qint64 queueBytes;
+    int stopping;
+    int _dropped;
+    int _written;
+    int waitKey;                // dropped a packet, so wait for a key frame
+    QString _filename;
+    // stream parameters, copied from the FFThread's codec context
+    bool haveCodec;
+    enum AVCodecID codec_id;
+    int width, height;
+    PixelFormat pix_fmt;
+    QByteArray extradata;
+    AVRational frameRate;
+    // output, only touched by the recorder thread
+    AVFormatContext *oc;
+    AVStream *st;
+    bool headerWritten;
+    AVRational srcTimeBase;     // time base of the timestamps we make up
+    qint64 firstMs;             // arrival time of the first packet written
+    qint64 lastDts;             // last dts written, in the stream time base
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef FFMPEGSHM_H
+#define FFMPEGSHM_H
+
+/* Layout of the POSIX shared memory an ffmpegWidget publishes its decoded
+ * frames into, shared by the widget and ffmpegShmReader. It is plain C with
+ * fixed size fields so other languages can map it too: a header, then
+ * FFSHM_SLOTS slots, each a slot header followed by the planes of one frame.
+ * Frame n goes in slot n % FFSHM_SLOTS. While the writer fills a slot its
+ * lock is odd, so a reader that sees the same even lock before and after
+ * looking at a frame knows it wasn't overwritten underneath it. The header
+ * futex is bumped and woken after every frame, so readers can sleep on it.
+ */
+
+#include <stdint.h>
+
+// "FFSH", first word of the header
+#define FFSHM_MAGIC 0x48534646
+// bumped when the layout changes
+#define FFSHM_VERSION 1
+// frames in the ring, a reader has this many frame times to use one
+#define FFSHM_SLOTS 4
+// slots start on this boundary, and so do the planes in them
+#define FFSHM_ALIGN 4096
+
+typedef struct {
+    uint32_t magic;             // FFSHM_MAGIC
+    uint32_t version;           // FFSHM_VERSION
+    uint32_t nslots;            // slots in the ring
+    uint32_t stale;             // 1 when the writer has replaced or removed this segment
+    uint64_t headerSize;        // offset of the first slot
+    uint64_t slotSize;          // bytes from one slot to the next
+    volatile uint64_t seq;      // last frame published, 0 = none yet
+    volatile uint32_t futex;    // bumped and woken after every frame
+    int32_t writerPid;          // process publishing the frames
+    char url[1024];             // stream the frames come from
+} FFShmHeader;
+
+typedef struct {
+    volatile uint64_t lock;     // odd while the writer is filling the slot
+    uint64_t seq;               // frame number, counting from 1
+    int64_t timestampUs;        // when its packet arrived, us since the epoch, 0 if not live
+    int32_t width;              // in pixels
+    int32_t height;
+    int32_t format;             // ffmpeg pixel format number
+    int32_t nplanes;            // planes in use
+    char formatName[32];        // ffmpeg pixel format name, e.g. "gray"
+    int32_t strides[4];         // bytes from one row of each plane to the next
+    uint64_t offsets[4];        // of each plane from the start of the slot
+    uint64_t size;              // bytes of the slot in use
+} FFShmSlot;
+
+#endif
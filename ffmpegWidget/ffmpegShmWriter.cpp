@@ -0,0 +1,157 @@
+#include "ffmpegShmWriter.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+extern "C" {
+#include "libavutil/pixdesc.h"
+#include "libavutil/imgutils.h"
+}
+
+FFShmWriter::FFShmWriter () {
+    this->header = NULL;
+    this->mapSize = 0;
+    this->seq = 0;
+}
+
+FFShmWriter::~FFShmWriter() {
+    close();
+}
+
+int FFShmWriter::open(const QString &name, const char *url) {
+    close();
+    this->name = name.trimmed().toAscii();
+    if (!this->name.startsWith('/')) this->name.prepend('/');
+    this->url = QByteArray(url);
+    // start small, the first frame makes it as big as it needs to be
+    return create(FFSHM_ALIGN);
+}
+
+void FFShmWriter::close() {
+    if (this->header == NULL) return;
+    release();
+    shm_unlink(this->name.data());
+}
+
+// tell anyone still looking at the current segment to open it again, then
+// let go of it
+void FFShmWriter::release() {
+    if (this->header == NULL) return;
+    this->header->stale = 1;
+    __sync_synchronize();
+    this->header->futex++;
+    syscall(SYS_futex, &this->header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    munmap(this->header, this->mapSize);
+    this->header = NULL;
+    this->mapSize = 0;
+}
+
+// make a new segment with slots of slotSize bytes, replacing any old one
+int FFShmWriter::create(uint64_t slotSize) {
+    release();
+    shm_unlink(this->name.data());
+    int fd = shm_open(this->name.data(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        printf("Can't create shared memory %s: %s\n", this->name.data(), strerror(errno));
+        return -1;
+    }
+    const uint64_t headerSize = FFALIGN((uint64_t) sizeof(FFShmHeader), FFSHM_ALIGN);
+    const uint64_t size = headerSize + FFSHM_SLOTS * slotSize;
+    void *mem = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (mem == MAP_FAILED) {
+        printf("Can't map %d MB of shared memory %s: %s\n",
+            (int) (size >> 20), this->name.data(), strerror(errno));
+        shm_unlink(this->name.data());
+        return -1;
+    }
+    // the pages start zeroed, so every slot lock starts even
+    this->header = (FFShmHeader *) mem;
+    this->mapSize = size;
+    this->header->version = FFSHM_VERSION;
+    this->header->nslots = FFSHM_SLOTS;
+    this->header->headerSize = headerSize;
+    this->header->slotSize = slotSize;
+    this->header->seq = 0;
+    this->header->writerPid = getpid();
+    strncpy(this->header->url, this->url.data(), sizeof(this->header->url) - 1);
+    // readers check the magic, so write it last
+    __sync_synchronize();
+    this->header->magic = FFSHM_MAGIC;
+    return 0;
+}
+
+void FFShmWriter::publish(FFBuffer *buf) {
+    if (this->header == NULL || buf == NULL) return;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(buf->pix_fmt);
+    if (desc == NULL || (desc->flags & PIX_FMT_HWACCEL)) return;
+    const bool pal = desc->flags & PIX_FMT_PAL;
+
+    // work out where the planes go, keeping our padded strides
+    int nplanes = pal ? 2 : 0;
+    for (int i = 0; i < desc->nb_components; i++) {
+        nplanes = qMax(nplanes, desc->comp[i].plane + 1);
+    }
+    int rows[4], rowBytes[4];
+    uint64_t offsets[4];
+    uint64_t size = FFSHM_ALIGN;
+    for (int p = 0; p < nplanes; p++) {
+        if (pal && p == 1) {
+            // 256 entries of 4 bytes
+            rows[p] = 1;
+            rowBytes[p] = 1024;
+        } else {
+            const int shift = (p == 1 || p == 2) ? desc->log2_chroma_h : 0;
+            rows[p] = -((-buf->height) >> shift);
+            rowBytes[p] = av_image_get_linesize(buf->pix_fmt, buf->width, p);
+        }
+        offsets[p] = size;
+        size = FFALIGN(size + (uint64_t) buf->pFrame->linesize[p] * (rows[p] - 1) +
+            rowBytes[p], FFSHM_ALIGN);
+    }
+    // if we can't grow it create has let go of the segment, so we stop
+    // publishing rather than fail every frame
+    if (size > this->header->slotSize && create(size) != 0) return;
+
+    // fill the next slot, with its lock odd while we do
+    this->seq++;
+    FFShmSlot *slot = (FFShmSlot *) ((char *) this->header + this->header->headerSize +
+        ((this->seq - 1) % this->header->nslots) * this->header->slotSize);
+    slot->lock++;
+    __sync_synchronize();
+    slot->seq = this->seq;
+    slot->timestampUs = buf->ms * 1000;
+    slot->width = buf->width;
+    slot->height = buf->height;
+    slot->format = buf->pix_fmt;
+    slot->nplanes = nplanes;
+    memset(slot->formatName, 0, sizeof(slot->formatName));
+    strncpy(slot->formatName, desc->name, sizeof(slot->formatName) - 1);
+    for (int p = 0; p < 4; p++) {
+        slot->strides[p] = (p < nplanes) ? buf->pFrame->linesize[p] : 0;
+        slot->offsets[p] = (p < nplanes) ? offsets[p] : 0;
+    }
+    slot->size = size;
+    for (int p = 0; p < nplanes; p++) {
+        av_image_copy_plane((uint8_t *) slot + offsets[p], slot->strides[p],
+            buf->pFrame->data[p], buf->pFrame->linesize[p], rowBytes[p], rows[p]);
+    }
+    __sync_synchronize();
+    slot->lock++;
+
+    // then tell the readers
+    this->header->seq = this->seq;
+    __sync_synchronize();
+    this->header->futex++;
+    syscall(SYS_futex, &this->header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
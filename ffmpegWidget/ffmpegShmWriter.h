@@ -0,0 +1,37 @@
+#ifndef FFMPEGSHMWRITER_H
+#define FFMPEGSHMWRITER_H
+
+#include "ffmpegWidget.h"
+#include "ffmpegShm.h"
+
+/* Publishes decoded frames into a POSIX shared memory ring laid out as in
+ * ffmpegShm.h, so other processes on this machine can get at the pixels
+ * without a second connection to the server and a second decode. Each
+ * frame is copied in once, by the decode thread, and readers map it
+ * read-only. If a frame doesn't fit the slots the segment is replaced with
+ * a bigger one under the same name, and the old one is marked stale so
+ * readers know to open it again.
+ */
+class FFShmWriter
+{
+public:
+    FFShmWriter ();
+    ~FFShmWriter ();
+    // create the segment, name is like "/beam1", 0 on success
+    int open(const QString &name, const char *url);
+    // unmap and remove the segment
+    void close();
+    // copy buf into the next slot and wake any waiting readers
+    void publish(FFBuffer *buf);
+
+private:
+    int create(uint64_t slotSize);
+    void release();
+    QByteArray name;            // of the segment, with a leading /
+    QByteArray url;             // stream we're publishing
+    FFShmHeader *header;        // the mapped segment, NULL if closed
+    uint64_t mapSize;           // bytes mapped
+    uint64_t seq;               // last frame published
+};
+
+#endif
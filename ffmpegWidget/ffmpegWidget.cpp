@@ -1,16 +1,65 @@
 #include <QtDebug>
 #include <QToolTip>
 #include "ffmpegWidget.h"
+#include "ffmpegRecorder.h"
+#include "ffmpegAccumulator.h"
+#include "ffmpegMjpegReader.h"
+#include "ffmpegShmWriter.h"
 #include <QColorDialog>
-#include "colorMaps.h"
+#include "ffmpegColorMap.h"
 #include <QX11Info>
 #include <assert.h>
 #include <QImage>
 #include <QPainter>
+#include <QRunnable>
+#include <QMutexLocker>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QUrl>
+
+#include <QThreadStorage>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/Xutil.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+
+extern "C" {
+#include "libavutil/pixdesc.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/time.h"
+#include "libavutil/adler32.h"
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// ask for 2MB pages by name, older headers don't have it
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
 
 /* global switch for fallback mode */
 int fallback = 0;
 
+/* global memory budget for all frame buffers in the process in MB */
+int memoryBudget = DEFAULTBUDGET;
+
+/* bytes currently allocated to frame buffers, protected by budgetMutex */
+static qint64 allocated = 0;
+static QMutex budgetMutex;
+
 /* set this when the ffmpeg lib is initialised */
 static int ffinit=0;
 
@@ -22,12 +71,26 @@ FFBuffer::FFBuffer() {
     this->mutex = new QMutex();
     this->refs = 0;
     this->pFrame = avcodec_alloc_frame();
-    this->mem = (unsigned char *) calloc(MAXWIDTH*MAXHEIGHT*3, sizeof(unsigned char));
+    this->mem = NULL;
+    this->size = 0;
+    this->lowres = 0;
+    this->ms = 0;
+    this->decodeUs = 0;
+    this->bin = 1;
+    this->offX = 0;
+    this->offY = 0;
+    this->fullW = 0;
+    this->fullH = 0;
+    this->orient = 0;
 }
 
 FFBuffer::~FFBuffer() {
     av_free(this->pFrame);
-    free(this->mem);
+    ffFreeFrameMem(this->mem, this->size);
+    // give the memory back to the budget
+    budgetMutex.lock();
+    allocated -= this->size;
+    budgetMutex.unlock();
 }
 
 bool FFBuffer::grabFree() {
@@ -57,27 +120,613 @@ void FFBuffer::release() {
     this->mutex->unlock();    
 }
 
-// List of FFBuffers to use for raw frames
-static FFBuffer rawbuffers[NBUFFERS];
+// make sure mem can hold size bytes, staying within the memory budget
+bool FFBuffer::alloc(int size) {
+    if (size <= this->size) return true;
+    budgetMutex.lock();
+    if (allocated - this->size + size > (qint64) memoryBudget * 1024 * 1024) {
+        budgetMutex.unlock();
+        return false;
+    }
+    allocated += size - this->size;
+    budgetMutex.unlock();
+    ffFreeFrameMem(this->mem, this->size);
+    this->mem = (unsigned char *) ffAllocFrameMem(size);
+    if (this->mem == NULL) {
+        budgetMutex.lock();
+        allocated -= size;
+        budgetMutex.unlock();
+        this->size = 0;
+        return false;
+    }
+    this->size = size;
+    return true;
+}
+
+/* Big frames are mapped in whole huge pages, so a pass over a 36 MB frame
+ * needs 18 TLB entries instead of thousands. We try the reserved pool of
+ * explicit 2MB pages first, then ask for transparent ones on a mapping that
+ * starts on a huge page boundary. Smaller buffers come from the heap. The
+ * explicit pages are asked for by size rather than taking the system default,
+ * which may be 1GB, so that ffFreeFrameMem unmaps the length we mapped
+ */
+void * ffAllocFrameMem(int size) {
+    if (size < HUGEPAGESIZE) {
+        void *mem = NULL;
+        if (posix_memalign(&mem, FRAMEALIGN, size) != 0) return NULL;
+        return mem;
+    }
+    size_t len = FFALIGN((size_t) size, HUGEPAGESIZE);
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (mem != MAP_FAILED) return mem;
+    // map an extra huge page, then trim either end to align it
+    char *map = (char *) mmap(NULL, len + HUGEPAGESIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return NULL;
+    char *start = (char *) FFALIGN((uintptr_t) map, HUGEPAGESIZE);
+    if (start > map) munmap(map, start - map);
+    if (map + HUGEPAGESIZE > start) munmap(start + len, map + HUGEPAGESIZE - start);
+    madvise(start, len, MADV_HUGEPAGE);
+    return start;
+}
+
+void ffFreeFrameMem(void *mem, int size) {
+    if (mem == NULL) return;
+    if (size < HUGEPAGESIZE) {
+        free(mem);
+    } else {
+        munmap(mem, FFALIGN((size_t) size, HUGEPAGESIZE));
+    }
+}
 
-// List of FFBuffers to use for uncompressed frames
-static FFBuffer outbuffers[NBUFFERS];
+// linesizes for a frame of pix_fmt, padded to FRAMEALIGN
+static void frameLinesizes(PixelFormat pix_fmt, int width, int linesize[4]) {
+    av_image_fill_linesizes(linesize, pix_fmt, width);
+    for (int i = 0; i < 4; i++) linesize[i] = FFALIGN(linesize[i], FRAMEALIGN);
+}
+
+// every plane is a whole number of padded rows, so they all stay aligned
+int ffFrameSize(PixelFormat pix_fmt, int width, int height) {
+    int linesize[4];
+    uint8_t *data[4];
+    if (av_image_check_size(width, height) < 0) return -1;
+    frameLinesizes(pix_fmt, width, linesize);
+    return av_image_fill_pointers(data, pix_fmt, height, NULL, linesize);
+}
+
+void ffFrameFill(AVFrame *frame, unsigned char *mem, PixelFormat pix_fmt, int width, int height) {
+    frameLinesizes(pix_fmt, width, frame->linesize);
+    av_image_fill_pointers(frame->data, pix_fmt, height, mem, frame->linesize);
+}
+
+// percentage of the memory budget allocated to frame buffers
+double memoryUsage() {
+    QMutexLocker locker(&budgetMutex);
+    return 100.0 * allocated / ((qint64) memoryBudget * 1024 * 1024);
+}
 
-// find a free FFBuffer
-FFBuffer * findFreeBuffer(FFBuffer* source) {
-    for (int i = 0; i < NBUFFERS; i++) {
-        // if we can lock it and it has a 0 refcount, we can use it!
-        if (source[i].mutex->tryLock()) {
-            if (source[i].refs == 0) {
-                source[i].refs += 1;
-                source[i].mutex->unlock();    
-                return &source[i];
+// parse a cpu list like "0-3,6" into set, false if it is malformed
+static bool parseCpus(const QString &cpus, cpu_set_t *set) {
+    CPU_ZERO(set);
+    QStringList ranges = cpus.split(',', QString::SkipEmptyParts);
+    if (ranges.isEmpty()) return false;
+    for (int i = 0; i < ranges.size(); i++) {
+        QStringList ends = ranges.at(i).trimmed().split('-');
+        bool ok, ok2 = true;
+        int first = ends.at(0).toInt(&ok);
+        int last = (ends.size() == 2) ? ends.at(1).toInt(&ok2) : first;
+        if (!ok || !ok2 || ends.size() > 2 || first < 0 || last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+    }
+    return true;
+}
+
+// the kernel keeps the first 15 characters
+void ffNameThread(const QString &name) {
+    pthread_setname_np(pthread_self(), name.left(15).toAscii().data());
+}
+
+QString ffSetThreadCpus(const QString &cpus) {
+    cpu_set_t set;
+    if (cpus.trimmed().isEmpty()) {
+        // go back to the cpus the process was started with
+        if (sched_getaffinity(getpid(), sizeof(set), &set) == 0) {
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+        return QString("any cpu");
+    }
+    if (!parseCpus(cpus, &set)) return QString("bad cpu list '%1'").arg(cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err) return QString("cpus %1 refused, %2").arg(cpus).arg(strerror(err));
+    return QString("cpus %1").arg(cpus);
+}
+
+// raising the priority needs privileges, so we may get less than we asked for
+QString ffSetThreadPriority(int nice, int rtPriority) {
+    QString info;
+    struct sched_param param;
+    int policy;
+    if (rtPriority > 0) {
+        param.sched_priority = qBound(sched_get_priority_min(SCHED_FIFO), rtPriority,
+            sched_get_priority_max(SCHED_FIFO));
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err == 0) return QString("SCHED_FIFO %1").arg(param.sched_priority);
+        info = QString("SCHED_FIFO %1 refused, %2, ").arg(rtPriority).arg(strerror(err));
+    } else if (rtPriority == 0) {
+        // normal scheduling, in case we were realtime before
+        param.sched_priority = 0;
+        pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    }
+    // we may still be realtime, from before or from chrt
+    if (pthread_getschedparam(pthread_self(), &policy, &param) == 0 &&
+            (policy == SCHED_FIFO || policy == SCHED_RR)) {
+        info += QString("%1 %2, ").arg(policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR")
+            .arg(param.sched_priority);
+    }
+    // on Linux nice values belong to threads, not the whole process
+    id_t tid = (id_t) syscall(SYS_gettid);
+    if (nice != NICE_UNSET && setpriority(PRIO_PROCESS, tid, nice) != 0) {
+        info += QString("nice %1 refused, %2, ").arg(nice).arg(strerror(errno));
+    }
+    errno = 0;
+    int now = getpriority(PRIO_PROCESS, tid);
+    if (errno == 0) info += QString("nice %1").arg(now);
+    return info;
+}
+
+// pool threads are shared by all streams, so they are pinned to suit each
+// job as it starts. Most of the time it's the same as the last job
+static QThreadStorage<QString *> poolThreadCpus;
+
+static void pinPoolThread(const QString &cpus) {
+    if (!poolThreadCpus.hasLocalData()) {
+        ffNameThread("ffconvert");
+        poolThreadCpus.setLocalData(new QString(""));
+    }
+    QString *current = poolThreadCpus.localData();
+    if (*current != cpus) {
+        QString info = ffSetThreadCpus(cpus);
+        if (info.startsWith("bad") || info.contains("refused")) {
+            printf("Conversion thread: %s\n", info.toAscii().data());
+        }
+        *current = cpus;
+    }
+}
+
+// An FFBufferPool hands out FFBuffers, growing as needed within the budget
+FFBufferPool::FFBufferPool() {
+    this->mutex = new QMutex();
+}
+
+FFBufferPool::~FFBufferPool() {
+    for (int i = 0; i < this->buffers.size(); i++) {
+        delete this->buffers[i];
+    }
+    delete this->mutex;
+}
+
+// find a free FFBuffer with at least size bytes, the caller gets 1 ref
+FFBuffer * FFBufferPool::findFree(int size) {
+    FFBuffer *small = NULL;
+    QMutexLocker locker(this->mutex);
+    // look for a free buffer that is big enough
+    for (int i = 0; i < this->buffers.size(); i++) {
+        FFBuffer *buf = this->buffers[i];
+        if (buf->grabFree()) {
+            if (buf->size >= size) {
+                if (small) small->release();
+                return buf;
+            } else if (small == NULL) {
+                // remember the first free one in case we need to grow it
+                small = buf;
             } else {
-                source[i].mutex->unlock();    
+                buf->release();
+            }
+        }
+    }
+    // try to grow a free buffer that's too small
+    if (small) {
+        if (small->alloc(size)) return small;
+        small->release();
+        return NULL;
+    }
+    // no free buffers, so make a new one if the budget allows
+    FFBuffer *buf = new FFBuffer();
+    if (!buf->alloc(size)) {
+        delete buf;
+        return NULL;
+    }
+    buf->refs = 1;
+    this->buffers.append(buf);
+    return buf;
+}
+
+// An FFPacketRing holds the last few seconds of packets from a stream
+FFPacketRing::FFPacketRing() {
+    this->mutex = new QMutex();
+    this->bytes = 0;
+    this->_seconds = 0;
+    this->codec_id = AV_CODEC_ID_NONE;
+}
+
+FFPacketRing::~FFPacketRing() {
+    delete this->mutex;
+}
+
+// set the number of seconds of packets to keep, 0 to disable
+void FFPacketRing::setSeconds(int seconds) {
+    QMutexLocker locker(this->mutex);
+    this->_seconds = seconds;
+    if (seconds <= 0) {
+        this->packets.clear();
+        this->bytes = 0;
+    }
+}
+
+// store what we need to make a decoder for the packets
+void FFPacketRing::setCodec(AVCodecContext *codecCtx) {
+    QMutexLocker locker(this->mutex);
+    if (this->codec_id != codecCtx->codec_id) {
+        // packets from a different codec are no use to us
+        this->packets.clear();
+        this->bytes = 0;
+    }
+    this->codec_id = codecCtx->codec_id;
+    this->extradata = QByteArray((const char *) codecCtx->extradata,
+        codecCtx->extradata_size);
+}
+
+// add a packet, dropping the oldest ones if we're over our limits
+void FFPacketRing::push(const FFPacket &packet) {
+    QMutexLocker locker(this->mutex);
+    if (this->_seconds <= 0) return;
+    this->packets.append(packet);
+    this->bytes += packet.data.size();
+    while (!this->packets.isEmpty() &&
+            (this->packets.first().ms < packet.ms - this->_seconds * 1000 ||
+             this->bytes > (qint64) REPLAYMAXMB * 1024 * 1024)) {
+        this->bytes -= this->packets.first().data.size();
+        this->packets.removeFirst();
+    }
+}
+
+void FFPacketRing::clear() {
+    QMutexLocker locker(this->mutex);
+    this->packets.clear();
+    this->bytes = 0;
+}
+
+// copy out the packets, starting at a key frame so they can all be decoded
+QList<FFPacket> FFPacketRing::snapshot(enum AVCodecID *codec_id, QByteArray *extradata) {
+    QMutexLocker locker(this->mutex);
+    QList<FFPacket> out = this->packets;
+    while (!out.isEmpty() && !(out.first().flags & AV_PKT_FLAG_KEY)) {
+        out.removeFirst();
+    }
+    *codec_id = this->codec_id;
+    *extradata = this->extradata;
+    return out;
+}
+
+// true if the first plane of pix_fmt is 8-bit luma, one byte per pixel
+bool hasLumaPlane(PixelFormat pix_fmt) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    return desc && !(desc->flags & (PIX_FMT_RGB | PIX_FMT_PAL)) &&
+        desc->comp[0].plane == 0 && desc->comp[0].step_minus1 == 0 &&
+        desc->comp[0].depth_minus1 == 7;
+}
+
+const char * ffBackendName(int backend) {
+    static const char *names[] = { "auto", "xvshm", "xv", "qimage", "null", "xshm" };
+    if (backend < BACKEND_AUTO || backend > BACKEND_XSHM) return NULL;
+    return names[backend];
+}
+
+// Pool of FFBuffers to use for raw frames
+static FFBufferPool rawbuffers;
+
+// Pool of FFBuffers to use for uncompressed frames
+static FFBufferPool outbuffers;
+
+// 8x8 block of bytes, dst row i is src column i
+static void transposeBlock8(const unsigned char *src, int sls, unsigned char *dst, int dls) {
+#ifdef __SSE2__
+    __m128i t0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) src),
+                                   _mm_loadl_epi64((const __m128i *) (src + sls)));
+    __m128i t1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (src + 2 * sls)),
+                                   _mm_loadl_epi64((const __m128i *) (src + 3 * sls)));
+    __m128i t2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (src + 4 * sls)),
+                                   _mm_loadl_epi64((const __m128i *) (src + 5 * sls)));
+    __m128i t3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (src + 6 * sls)),
+                                   _mm_loadl_epi64((const __m128i *) (src + 7 * sls)));
+    // columns 0-3 and 4-7 of rows 0-3 and 4-7
+    __m128i u0 = _mm_unpacklo_epi16(t0, t1);
+    __m128i u1 = _mm_unpackhi_epi16(t0, t1);
+    __m128i u2 = _mm_unpacklo_epi16(t2, t3);
+    __m128i u3 = _mm_unpackhi_epi16(t2, t3);
+    // pairs of whole columns
+    __m128i v0 = _mm_unpacklo_epi32(u0, u2);
+    __m128i v1 = _mm_unpackhi_epi32(u0, u2);
+    __m128i v2 = _mm_unpacklo_epi32(u1, u3);
+    __m128i v3 = _mm_unpackhi_epi32(u1, u3);
+    _mm_storel_epi64((__m128i *) dst, v0);
+    _mm_storel_epi64((__m128i *) (dst + dls), _mm_unpackhi_epi64(v0, v0));
+    _mm_storel_epi64((__m128i *) (dst + 2 * dls), v1);
+    _mm_storel_epi64((__m128i *) (dst + 3 * dls), _mm_unpackhi_epi64(v1, v1));
+    _mm_storel_epi64((__m128i *) (dst + 4 * dls), v2);
+    _mm_storel_epi64((__m128i *) (dst + 5 * dls), _mm_unpackhi_epi64(v2, v2));
+    _mm_storel_epi64((__m128i *) (dst + 6 * dls), v3);
+    _mm_storel_epi64((__m128i *) (dst + 7 * dls), _mm_unpackhi_epi64(v3, v3));
+#else
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) dst[i * dls + j] = src[j * sls + i];
+    }
+#endif
+}
+
+// 8x8 block of 16-bit pixels, dst row i is src column i
+static void transposeBlock16(const unsigned char *src, int sls, unsigned char *dst, int dls) {
+#ifdef __SSE2__
+    __m128i a[8], t[8], u[8];
+    for (int i = 0; i < 8; i++) a[i] = _mm_loadu_si128((const __m128i *) (src + i * sls));
+    for (int i = 0; i < 4; i++) {
+        t[2 * i] = _mm_unpacklo_epi16(a[2 * i], a[2 * i + 1]);
+        t[2 * i + 1] = _mm_unpackhi_epi16(a[2 * i], a[2 * i + 1]);
+    }
+    for (int i = 0; i < 2; i++) {
+        u[4 * i] = _mm_unpacklo_epi32(t[4 * i], t[4 * i + 2]);
+        u[4 * i + 1] = _mm_unpackhi_epi32(t[4 * i], t[4 * i + 2]);
+        u[4 * i + 2] = _mm_unpacklo_epi32(t[4 * i + 1], t[4 * i + 3]);
+        u[4 * i + 3] = _mm_unpackhi_epi32(t[4 * i + 1], t[4 * i + 3]);
+    }
+    for (int i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i *) (dst + 2 * i * dls), _mm_unpacklo_epi64(u[i], u[i + 4]));
+        _mm_storeu_si128((__m128i *) (dst + (2 * i + 1) * dls), _mm_unpackhi_epi64(u[i], u[i + 4]));
+    }
+#else
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+            memcpy(dst + i * dls + 2 * j, src + j * sls + 2 * i, 2);
+        }
+    }
+#endif
+}
+
+/* dst[x][y] = src[y][x] for a w x h plane of bpp byte pixels. The strides
+ * may be negative, which is how the mirrored orientations are done. It works
+ * through the plane in tiles so each tile and its destination stay in cache
+ */
+static void transposePlane(const unsigned char *src, int sls, unsigned char *dst, int dls,
+        int w, int h, int bpp) {
+    for (int ty = 0; ty < h; ty += ORIENTTILE) {
+        const int th = qMin(ORIENTTILE, h - ty);
+        for (int tx = 0; tx < w; tx += ORIENTTILE) {
+            const int tw = qMin(ORIENTTILE, w - tx);
+            const unsigned char *s = src + ty * sls + tx * bpp;
+            unsigned char *d = dst + tx * dls + ty * bpp;
+            int y = 0;
+            for (; y + 8 <= th; y += 8) {
+                int x = 0;
+                for (; x + 8 <= tw; x += 8) {
+                    if (bpp == 1) {
+                        transposeBlock8(s + y * sls + x, sls, d + x * dls + y, dls);
+                    } else {
+                        transposeBlock16(s + y * sls + 2 * x, sls, d + x * dls + 2 * y, dls);
+                    }
+                }
+                // ragged right hand edge of the tile
+                for (; x < tw; x++) {
+                    for (int j = y; j < y + 8; j++) {
+                        memcpy(d + x * dls + j * bpp, s + j * sls + x * bpp, bpp);
+                    }
+                }
             }
+            // and bottom edge
+            for (; y < th; y++) {
+                for (int x = 0; x < tw; x++) {
+                    memcpy(d + x * dls + y * bpp, s + y * sls + x * bpp, bpp);
+                }
+            }
+        }
+    }
+}
+
+// dst = src back to front, for n pixels of bpp bytes
+static void mirrorRow(const unsigned char *src, unsigned char *dst, int n, int bpp) {
+    int i = 0;
+#ifdef __SSE2__
+    const int per = 16 / bpp;
+    for (; i + per <= n; i += per) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + (n - i - per) * bpp));
+        v = _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        if (bpp == 1) v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *) (dst + i * bpp), v);
+    }
+#endif
+    for (; i < n; i++) memcpy(dst + i * bpp, src + (n - 1 - i) * bpp, bpp);
+}
+
+// turn a w x h plane into dst as orient says
+static void orientPlane(const unsigned char *src, int sls, unsigned char *dst, int dls,
+        int w, int h, int bpp, int orient) {
+    if (orient & ORIENT_TRANSPOSE) {
+        // dst x comes from src y, and dst y from src x
+        if (orient & ORIENT_MIRRORX) {
+            src += (h - 1) * sls;
+            sls = -sls;
+        }
+        if (orient & ORIENT_MIRRORY) {
+            dst += (w - 1) * dls;
+            dls = -dls;
+        }
+        transposePlane(src, sls, dst, dls, w, h, bpp);
+        return;
+    }
+    if (orient & ORIENT_MIRRORY) {
+        src += (h - 1) * sls;
+        sls = -sls;
+    }
+    for (int y = 0; y < h; y++) {
+        if (orient & ORIENT_MIRRORX) {
+            mirrorRow(src + y * sls, dst + y * dls, w, bpp);
+        } else {
+            memcpy(dst + y * dls, src + y * sls, w * bpp);
+        }
+    }
+}
+
+/* The format a pix_fmt frame has once it is turned plane by plane, or
+ * PIX_FMT_NONE if it can't be. That needs each component in a plane of its
+ * own, all 1 or 2 bytes per pixel, and transposing swaps the chroma
+ * subsampling so 4:2:2 becomes 4:4:0
+ */
+static PixelFormat orientFormat(PixelFormat pix_fmt, int orient) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    if (desc == NULL || (desc->flags & (PIX_FMT_PAL | PIX_FMT_BITSTREAM | PIX_FMT_HWACCEL))) {
+        return PIX_FMT_NONE;
+    }
+    if (desc->nb_components > 1 && !(desc->flags & PIX_FMT_PLANAR)) return PIX_FMT_NONE;
+    for (int i = 0; i < desc->nb_components; i++) {
+        if (desc->comp[i].plane != i || desc->comp[i].offset_plus1 != 1 ||
+                desc->comp[i].step_minus1 != desc->comp[0].step_minus1 ||
+                desc->comp[i].step_minus1 > 1) {
+            return PIX_FMT_NONE;
+        }
+    }
+    if (!(orient & ORIENT_TRANSPOSE) || desc->log2_chroma_w == desc->log2_chroma_h) {
+        return pix_fmt;
+    }
+    switch (pix_fmt) {
+        case PIX_FMT_YUV422P:   return PIX_FMT_YUV440P;
+        case PIX_FMT_YUVJ422P:  return PIX_FMT_YUVJ440P;
+        case PIX_FMT_YUV440P:   return PIX_FMT_YUV422P;
+        case PIX_FMT_YUVJ440P:  return PIX_FMT_YUVJ422P;
+        default:                return PIX_FMT_NONE;
+    }
+}
+
+// copy a decoded frame into a raw FFBuffer, the caller gets 1 ref. If orient
+// is set it is turned as it is copied, formats that can't be turned plane by
+// plane are made planar with sws first
+static FFBuffer * copyRawFrame(AVCodecContext *codecCtx, AVFrame *frame,
+        int orient, struct SwsContext **sws) {
+    PixelFormat pix_fmt = codecCtx->pix_fmt;
+    int width = codecCtx->width;
+    int height = codecCtx->height;
+    if (orient == 0) {
+        FFBuffer *raw = rawbuffers.findFree(ffFrameSize(pix_fmt, width, height));
+        if (raw == NULL) return NULL;
+        ffFrameFill(raw->pFrame, raw->mem, pix_fmt, width, height);
+        av_picture_copy((AVPicture *) raw->pFrame, (const AVPicture *) frame,
+            pix_fmt, width, height);
+        raw->pix_fmt = pix_fmt;
+        raw->width = width;
+        raw->height = height;
+        raw->lowres = codecCtx->lowres;
+        raw->ms = 0;
+        raw->decodeUs = 0;
+        raw->orient = 0;
+        return raw;
+    }
+
+    uint8_t *data[4] = { frame->data[0], frame->data[1], frame->data[2], frame->data[3] };
+    int linesize[4] = { frame->linesize[0], frame->linesize[1], frame->linesize[2], frame->linesize[3] };
+    FFBuffer *planar = NULL;
+    PixelFormat out_fmt = orientFormat(pix_fmt, orient);
+    if (out_fmt == PIX_FMT_NONE) {
+        // grey stays grey at its own depth, anything else goes to 4:4:4
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+        PixelFormat planar_fmt = PIX_FMT_YUVJ444P;
+        if (desc && desc->nb_components <= 2 && !(desc->flags & PIX_FMT_RGB)) {
+            planar_fmt = desc->comp[0].depth_minus1 >= 8 ? PIX_FMT_GRAY16 : PIX_FMT_GRAY8;
         }
+        planar = rawbuffers.findFree(ffFrameSize(planar_fmt, width, height));
+        if (planar == NULL) return NULL;
+        ffFrameFill(planar->pFrame, planar->mem, planar_fmt, width, height);
+        *sws = sws_getCachedContext(*sws, width, height, pix_fmt,
+            width, height, planar_fmt, SWS_POINT, NULL, NULL, NULL);
+        sws_scale(*sws, frame->data, frame->linesize, 0, height,
+            planar->pFrame->data, planar->pFrame->linesize);
+        for (int i = 0; i < 4; i++) {
+            data[i] = planar->pFrame->data[i];
+            linesize[i] = planar->pFrame->linesize[i];
+        }
+        pix_fmt = planar_fmt;
+        out_fmt = orientFormat(pix_fmt, orient);
+    }
+
+    // transposing swaps the dimensions
+    const bool transpose = orient & ORIENT_TRANSPOSE;
+    const int outW = transpose ? height : width;
+    const int outH = transpose ? width : height;
+    FFBuffer *raw = rawbuffers.findFree(ffFrameSize(out_fmt, outW, outH));
+    if (raw == NULL) {
+        if (planar) planar->release();
+        return NULL;
+    }
+    ffFrameFill(raw->pFrame, raw->mem, out_fmt, outW, outH);
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    const int bpp = desc->comp[0].step_minus1 + 1;
+    for (int i = 0; i < desc->nb_components; i++) {
+        // chroma planes are subsampled, luma and alpha aren't
+        bool chroma = (i == 1 || i == 2) && !(desc->flags & PIX_FMT_RGB);
+        int w = chroma ? -((-width) >> desc->log2_chroma_w) : width;
+        int h = chroma ? -((-height) >> desc->log2_chroma_h) : height;
+        orientPlane(data[i], linesize[i], raw->pFrame->data[i], raw->pFrame->linesize[i],
+            w, h, bpp, orient);
     }
-    return NULL;
+    if (planar) planar->release();
+    raw->pix_fmt = out_fmt;
+    raw->width = outW;
+    raw->height = outH;
+    raw->lowres = codecCtx->lowres;
+    raw->ms = 0;
+    raw->decodeUs = 0;
+    raw->orient = orient;
+    return raw;
+}
+
+// ORIENT_ flags for a frame mirrored as asked then rotated clockwise
+static int orientFlags(int rotate, bool flipH, bool flipV) {
+    // where the x and y axes end up, as a matrix of 0 and +-1
+    const int r[4][4] = { { 1, 0, 0, 1 }, { 0, -1, 1, 0 }, { -1, 0, 0, -1 }, { 0, 1, -1, 0 } };
+    const int *m = r[(rotate / 90) & 3];
+    const int fx = flipH ? -1 : 1;
+    const int fy = flipV ? -1 : 1;
+    int orient = 0;
+    if (m[0] == 0) orient |= ORIENT_TRANSPOSE;
+    if (m[0] * fx + m[1] * fy < 0) orient |= ORIENT_MIRRORX;
+    if (m[2] * fx + m[3] * fy < 0) orient |= ORIENT_MIRRORY;
+    return orient;
+}
+
+// move x, y in a w x h frame to where it is once the frame is turned
+static void orientPoint(int orient, int w, int h, int *x, int *y) {
+    int ox = *x, oy = *y;
+    if (orient & ORIENT_TRANSPOSE) {
+        ox = *y;
+        oy = *x;
+        qSwap(w, h);
+    }
+    if (orient & ORIENT_MIRRORX) ox = w - 1 - ox;
+    if (orient & ORIENT_MIRRORY) oy = h - 1 - oy;
+    *x = ox;
+    *y = oy;
+}
+
+// and back again, w x h is the size of the turned frame
+static void unorientPoint(int orient, int w, int h, int *x, int *y) {
+    int ox = *x, oy = *y;
+    if (orient & ORIENT_MIRRORX) ox = w - 1 - ox;
+    if (orient & ORIENT_MIRRORY) oy = h - 1 - oy;
+    if (orient & ORIENT_TRANSPOSE) qSwap(ox, oy);
+    *x = ox;
+    *y = oy;
 }
 
 /* thread that decodes frames from video stream and emits updateSignal when
@@ -90,6 +739,30 @@ FFThread::FFThread (const QString &url, QWidget* parent)
     strcpy(this->url, url.toAscii().data());
     // set this to 1 to finish
     this->stopping = 0;
+    // set this to 1 to stop decoding while the widget is hidden
+    this->paused = 0;
+    // full resolution to start with
+    this->lowres = 0;
+    // no averaging
+    this->accumulate = 1;
+    this->accumulateMode = 0;
+    this->accumulator = new FFAccumulator();
+    // frames the way up they come
+    this->orient = 0;
+    this->orientCtx = NULL;
+    // packet ring for replay, disabled until we're told how long to make it
+    this->ring = new FFPacketRing();
+    // not recording
+    this->recordMutex = new QMutex();
+    this->recorder = NULL;
+    // run anywhere, scheduled as we were started, until told otherwise
+    this->settingsMutex = new QMutex();
+    this->nice = NICE_UNSET;
+    this->rtPriority = RTPRIORITY_UNSET;
+    this->settingsChanged = 1;
+    // not publishing frames
+    this->shmChanged = 0;
+    this->shm = NULL;
     // initialise the ffmpeg library once only
     if (ffinit==0) {
         ffinit = 1;
@@ -104,6 +777,66 @@ FFThread::FFThread (const QString &url, QWidget* parent)
 
 // destroy widget
 FFThread::~FFThread() {
+    delete this->ring;
+    delete this->recordMutex;
+    delete this->settingsMutex;
+    delete this->accumulator;
+    delete this->shm;
+    if (this->orientCtx) sws_freeContext(this->orientCtx);
+}
+
+// start or stop passing packets to a recorder
+void FFThread::setRecorder(FFRecorder *r) {
+    QMutexLocker locker(this->recordMutex);
+    this->recorder = r;
+}
+
+// change the cpus and priority, the thread applies them itself
+void FFThread::setThreadSettings(const QString &cpus, int nice, int rtPriority) {
+    QMutexLocker locker(this->settingsMutex);
+    this->cpus = cpus;
+    this->nice = nice;
+    this->rtPriority = rtPriority;
+    this->settingsChanged = 1;
+}
+
+// start, stop or move publishing frames to shared memory
+void FFThread::setShmName(const QString &name) {
+    QMutexLocker locker(this->settingsMutex);
+    this->shmName = name;
+    this->shmChanged = 1;
+}
+
+// called from run, so only this thread ever touches the writer
+void FFThread::openShm() {
+    this->settingsMutex->lock();
+    QString name = this->shmName;
+    this->shmChanged = 0;
+    this->settingsMutex->unlock();
+    delete this->shm;
+    this->shm = NULL;
+    if (name.trimmed().isEmpty()) return;
+    this->shm = new FFShmWriter();
+    if (this->shm->open(name, this->url) != 0) {
+        delete this->shm;
+        this->shm = NULL;
+        return;
+    }
+    printf("Publishing frames from %s to shared memory %s\n", this->url,
+        name.toAscii().data());
+}
+
+// called from run, so the settings apply to this thread and nothing else
+void FFThread::applySettings() {
+    this->settingsMutex->lock();
+    QString cpus = this->cpus;
+    int nice = this->nice;
+    int rtPriority = this->rtPriority;
+    this->settingsChanged = 0;
+    this->settingsMutex->unlock();
+    QString info = ffSetThreadCpus(cpus) + ", " + ffSetThreadPriority(nice, rtPriority);
+    printf("Decoding %s: %s\n", this->url, info.toAscii().data());
+    emit settingsApplied(info);
 }
 
 // run the FFThread
@@ -115,10 +848,22 @@ void FFThread::run()
     AVCodecContext      *pCodecCtx;
     AVCodec             *pCodec;
     AVPacket            packet;
+    AVPacket            keyPacket;
+    int                 haveKeyPacket = 0, wasPaused = 0, waitKey = 0;
+    int                 openLowres;
+    int                 orient, lastOrient = 0;
     int                 frameFinished, len;
     AVFrame             *tmpFrame = avcodec_alloc_frame();
+    FFMjpegReader       *reader = NULL;
+    AVRational          frameRate;
+    int64_t             openStart;
+    int                 firstFrame;
+
+    // one thread reads and decodes each stream, name it after the stream
+    ffNameThread("ff:" + QFileInfo(QUrl(QString(this->url)).path()).baseName());
 
     while (True) {
+        if (this->settingsChanged) applySettings();
         if (firstrun) {
             firstrun = 0;
         } else{            
@@ -128,44 +873,91 @@ void FFThread::run()
         
         // Open video file
         printf("Open %s\n", this->url);
-        if (avformat_open_input(&pFormatCtx, this->url, NULL, NULL)!=0) {
-            printf("Opening input '%s' failed\n", this->url);
-            continue;
+        openStart = av_gettime();
+        firstFrame = 1;
+        frameRate.num = 0;
+        frameRate.den = 1;
+        if (FFMjpegReader::handles(this->url)) {
+            // ffmpegServer MJPEG, read it ourselves unless the server
+            // answers with something else
+            reader = new FFMjpegReader(&this->stopping);
+            len = reader->open(this->url);
+            if (len <= 0) {
+                delete reader;
+                reader = NULL;
+            }
+            if (len < 0) {
+                printf("Opening input '%s' failed\n", this->url);
+                continue;
+            }
         }
+        if (reader) {
+            // it's JPEGs, no need to probe for a stream or codec
+            videoStream = 0;
+            pCodec = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
+            if (pCodec == NULL) {
+                printf("Could not find decoder for '%s'\n", this->url);
+                delete reader;
+                reader = NULL;
+                continue;
+            }
+            pCodecCtx = avcodec_alloc_context3(pCodec);
+            this->ring->setCodec(pCodecCtx);
+        } else {
+            if (avformat_open_input(&pFormatCtx, this->url, NULL, NULL)!=0) {
+                printf("Opening input '%s' failed\n", this->url);
+                continue;
+            }
 
-        // Find the first video stream
-        videoStream=-1;
-        for (unsigned int i=0; i<pFormatCtx->nb_streams; i++) {
-            if(pFormatCtx->streams[i]->codec->codec_type==AVMEDIA_TYPE_VIDEO) {
-                videoStream=i;
-                break;
+            // Find the first video stream
+            videoStream=-1;
+            for (unsigned int i=0; i<pFormatCtx->nb_streams; i++) {
+                if(pFormatCtx->streams[i]->codec->codec_type==AVMEDIA_TYPE_VIDEO) {
+                    videoStream=i;
+                    break;
+                }
+            }
+            if( videoStream==-1) {
+                printf("Finding video stream in '%s' failed\n", this->url);
+                continue;
             }
-        }
-        if( videoStream==-1) {
-            printf("Finding video stream in '%s' failed\n", this->url);
-            continue;
-        }
 
-        // Get a pointer to the codec context for the video stream
-        pCodecCtx=pFormatCtx->streams[videoStream]->codec;
+            // Get a pointer to the codec context for the video stream
+            pCodecCtx=pFormatCtx->streams[videoStream]->codec;
+            frameRate = pFormatCtx->streams[videoStream]->r_frame_rate;
+            this->ring->setCodec(pCodecCtx);
 
-        // Find the decoder for the video stream
-        pCodec=avcodec_find_decoder(pCodecCtx->codec_id);
-        if(pCodec==NULL) {
-            printf("Could not find decoder for '%s'\n", this->url);
-            continue;
+            // Find the decoder for the video stream
+            pCodec=avcodec_find_decoder(pCodecCtx->codec_id);
+            if(pCodec==NULL) {
+                printf("Could not find decoder for '%s'\n", this->url);
+                continue;
+            }
         }
 
         // Open codec
         ffmutex->lock();
+        openLowres = qMin(this->lowres, (int) pCodec->max_lowres);
+        pCodecCtx->lowres = openLowres;
         if(avcodec_open2(pCodecCtx, pCodec, NULL)<0) {
             printf("Could not open codec for '%s'\n", this->url);
+            // tidy up as we do at the end of the stream
+            if (reader) {
+                av_free(pCodecCtx);
+                delete reader;
+                reader = NULL;
+            } else {
+                avformat_close_input(&pFormatCtx);
+            }
+            pCodecCtx = NULL;
+            ffmutex->unlock();
             continue;
         }
         ffmutex->unlock();
 
         // read frames into the packets
-        while (stopping !=1 && av_read_frame(pFormatCtx, &packet) >= 0) {
+        while (stopping !=1 &&
+                (reader ? reader->read(&packet) : av_read_frame(pFormatCtx, &packet)) >= 0) {
 
             // Is this a packet from the video stream?
             if (packet.stream_index!=videoStream) {
@@ -175,33 +967,136 @@ void FFThread::run()
                 continue;
             }
 
-            // grab a buffer to decode into
-            FFBuffer *raw = findFreeBuffer(rawbuffers);        
-            if (raw == NULL) {
-                printf("Couldn't get a free buffer, skipping packet\n");
+            // Pick up any new cpus or priority
+            if (this->settingsChanged) applySettings();
+
+            // Keep a copy of the packet for replay and recording
+            qint64 arrivalMs = QDateTime::currentMSecsSinceEpoch();
+            FFPacket copy;
+            int recordLater = 0;
+            this->recordMutex->lock();
+            if (this->ring->seconds() > 0 || this->recorder) {
+                copy.data.resize(packet.size + FF_INPUT_BUFFER_PADDING_SIZE);
+                memcpy(copy.data.data(), packet.data, packet.size);
+                memset(copy.data.data() + packet.size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+                copy.size = packet.size;
+                copy.flags = packet.flags;
+                copy.ms = arrivalMs;
+                this->ring->push(copy);
+                if (this->recorder && pCodecCtx->width == 0) {
+                    // ffmpegServer's JPEGs and some containers don't give the
+                    // size or format, so the recorder gets this packet once
+                    // the decoder below has found them
+                    recordLater = 1;
+                } else if (this->recorder) {
+                    // never blocks, the recorder drops packets if it's behind
+                    this->recorder->setCodec(pCodecCtx, frameRate);
+                    this->recorder->push(copy);
+                }
+            }
+            this->recordMutex->unlock();
+
+            // If we're paused then just keep the connection alive, holding
+            // on to the last key frame so we can show it as soon as we resume
+            if (this->paused) {
+                wasPaused = 1;
+                if (packet.flags & AV_PKT_FLAG_KEY) {
+                    if (haveKeyPacket) av_free_packet(&keyPacket);
+                    haveKeyPacket = (av_copy_packet(&keyPacket, &packet) == 0);
+                }
                 av_free_packet(&packet);
                 continue;
             }
 
+            // If we've just resumed, decoding must restart from a key frame
+            int fromStore = 0;
+            if (wasPaused) {
+                wasPaused = 0;
+                waitKey = 1;
+                avcodec_flush_buffers(pCodecCtx);
+                if (haveKeyPacket && !(packet.flags & AV_PKT_FLAG_KEY)) {
+                    // show the stored key frame straight away instead
+                    av_free_packet(&packet);
+                    packet = keyPacket;
+                    haveKeyPacket = 0;
+                    fromStore = 1;
+                }
+            }
+            if (waitKey && !fromStore) {
+                if (!(packet.flags & AV_PKT_FLAG_KEY)) {
+                    av_free_packet(&packet);
+                    continue;
+                }
+                // don't let the stored key frame be used as a reference
+                avcodec_flush_buffers(pCodecCtx);
+                waitKey = 0;
+            }
+            if (haveKeyPacket) {
+                av_free_packet(&keyPacket);
+                haveKeyPacket = 0;
+            }
+
+            // If we've been asked for a different resolution, reopen the
+            // codec at the next key frame
+            if (qMin(this->lowres, (int) pCodec->max_lowres) != openLowres &&
+                    (packet.flags & AV_PKT_FLAG_KEY)) {
+                ffmutex->lock();
+                avcodec_close(pCodecCtx);
+                openLowres = qMin(this->lowres, (int) pCodec->max_lowres);
+                pCodecCtx->lowres = openLowres;
+                len = avcodec_open2(pCodecCtx, pCodec, NULL);
+                ffmutex->unlock();
+                if (len < 0) {
+                    printf("Could not reopen codec for '%s'\n", this->url);
+                    av_free_packet(&packet);
+                    break;
+                }
+            }
+
             // Decode video frame
+            int64_t decodeStart = av_gettime();
             len = avcodec_decode_video2(pCodecCtx, tmpFrame, &frameFinished, &packet);
+            if (recordLater && pCodecCtx->width > 0) {
+                this->recordMutex->lock();
+                if (this->recorder) {
+                    this->recorder->setCodec(pCodecCtx, frameRate);
+                    this->recorder->push(copy);
+                }
+                this->recordMutex->unlock();
+            }
             if (!frameFinished) {
                 printf("Frame not finished. Shouldn't see this...\n");
                 av_free_packet(&packet);
-                raw->release();
                 continue;
             }
-            
-            // Copy it into the raw frame
-            avpicture_fill((AVPicture *) raw->pFrame, raw->mem,
-                pCodecCtx->pix_fmt, pCodecCtx->width, pCodecCtx->height);
-            av_picture_copy((AVPicture *) raw->pFrame, (const AVPicture *) tmpFrame,
-                pCodecCtx->pix_fmt, pCodecCtx->width, pCodecCtx->height); 
-                        
-            // Fill in the output buffer
-            raw->pix_fmt = pCodecCtx->pix_fmt;         
-            raw->height = pCodecCtx->height;
-            raw->width = pCodecCtx->width;                
+
+            // Copy it into a raw frame, turning it if asked to
+            orient = this->orient;
+            if (orient != lastOrient) {
+                // don't average frames that are different ways up
+                this->accumulator->reset();
+                lastOrient = orient;
+            }
+            FFBuffer *raw = copyRawFrame(pCodecCtx, tmpFrame, orient, &this->orientCtx);
+            if (raw == NULL) {
+                printf("Couldn't get a free buffer, skipping frame\n");
+                av_free_packet(&packet);
+                continue;
+            }
+            raw->ms = arrivalMs;
+            raw->decodeUs = (int) (av_gettime() - decodeStart);
+            if (firstFrame) {
+                firstFrame = 0;
+                printf("First frame from %s after %d ms\n", this->url,
+                    (int) ((av_gettime() - openStart) / 1000));
+            }
+
+            // Average it with the previous frames if asked to
+            this->accumulator->process(raw, this->accumulate, this->accumulateMode);
+
+            // Give other processes a copy of what we'll show
+            if (this->shmChanged) openShm();
+            if (this->shm) this->shm->publish(raw);
 
             // Emit and free
             emit updateSignal(raw);        
@@ -209,16 +1104,340 @@ void FFThread::run()
         }
         // Emit blank frame
         emit updateSignal(NULL);
+        this->accumulator->reset();
+        if (haveKeyPacket) {
+            av_free_packet(&keyPacket);
+            haveKeyPacket = 0;
+        }
+        wasPaused = 0;
+        waitKey = 0;
         
         // tidy up
         ffmutex->lock();
         avcodec_close(pCodecCtx);
-        avformat_close_input(&pFormatCtx);
+        if (reader) {
+            av_free(pCodecCtx);
+            delete reader;
+            reader = NULL;
+        } else {
+            avformat_close_input(&pFormatCtx);
+        }
         pCodecCtx = NULL;
         ffmutex->unlock();        
     }
 }
 
+/* job that converts a raw frame for an ffmpegWidget on the shared pool */
+class FFConvertJob : public QRunnable
+{
+public:
+    FFConvertJob (ffmpegWidget *widget, FFBuffer *raw, const FFConvertParams &params)
+        : widget(widget), raw(raw), params(params) {}
+    void run() {
+        pinPoolThread(params.cpus);
+        widget->runConversion(raw, params);
+    }
+
+private:
+    ffmpegWidget *widget;
+    FFBuffer *raw;
+    FFConvertParams params;
+};
+
+/* job that does the stats on a raw frame for an ffmpegWidget */
+class FFStatsJob : public QRunnable
+{
+public:
+    FFStatsJob (ffmpegWidget *widget, FFBuffer *raw, const FFStatsParams &params)
+        : widget(widget), raw(raw), params(params) {}
+    void run() {
+        pinPoolThread(params.cpus);
+        widget->runStats(raw, params);
+    }
+
+private:
+    ffmpegWidget *widget;
+    FFBuffer *raw;
+    FFStatsParams params;
+};
+
+/* job that writes a snapshot of a raw frame for an ffmpegWidget */
+class FFSnapshotJob : public QRunnable
+{
+public:
+    FFSnapshotJob (ffmpegWidget *widget, FFBuffer *raw, const QString &filename,
+            const QString &format, bool processed, const FFConvertParams &params)
+        : widget(widget), raw(raw), filename(filename), format(format),
+          processed(processed), params(params) {}
+    void run() {
+        ffNameThread("ffsnapshot");
+        widget->runSnapshot(raw, filename, format, processed, params);
+    }
+
+private:
+    ffmpegWidget *widget;
+    FFBuffer *raw;
+    QString filename;
+    QString format;
+    bool processed;
+    FFConvertParams params;
+};
+
+// error code of the last X error caught by xErrorTrap
+static int xErrorCode = 0;
+
+static int xErrorTrap(Display *, XErrorEvent *event) {
+    xErrorCode = event->error_code;
+    return 0;
+}
+
+/* Attach a shared memory segment to the X server and wait to hear if it
+ * worked. XShmAttach returns True as soon as the request is queued, and the
+ * server refuses it later, e.g. with BadAccess over ssh -X, so trap errors
+ * until it has answered. Only call this from the GUI thread
+ */
+static bool attachShm(Display *dpy, XShmSegmentInfo *shminfo) {
+    // don't catch errors from earlier requests
+    XSync(dpy, False);
+    xErrorCode = 0;
+    int (*oldHandler)(Display *, XErrorEvent *) = XSetErrorHandler(xErrorTrap);
+    Bool ok = XShmAttach(dpy, shminfo);
+    XSync(dpy, False);
+    XSetErrorHandler(oldHandler);
+    return ok && xErrorCode == 0;
+}
+
+/* The server can have MIT-SHM but not be able to use our memory, e.g. over
+ * ssh -X, so try attaching a small segment once, as Qt does, before we
+ * count on it
+ */
+static bool shmUsable(Display *dpy) {
+    if (!XShmQueryExtension(dpy)) return false;
+    XShmSegmentInfo shminfo;
+    shminfo.shmid = shmget(IPC_PRIVATE, 4096, IPC_CREAT | 0600);
+    if (shminfo.shmid < 0) return false;
+    shminfo.shmaddr = (char *) shmat(shminfo.shmid, NULL, 0);
+    shmctl(shminfo.shmid, IPC_RMID, NULL);
+    if (shminfo.shmaddr == (char *) -1) return false;
+    shminfo.readOnly = False;
+    bool ok = attachShm(dpy, &shminfo);
+    if (ok) {
+        XShmDetach(dpy, &shminfo);
+        XSync(dpy, False);
+    }
+    shmdt(shminfo.shmaddr);
+    return ok;
+}
+
+/* xvideo, which scales the frame in the server, from shared memory images
+ * the conversion fills in if shm is set
+ */
+class FFXvRenderer : public FFRenderer
+{
+public:
+    FFXvRenderer (ffmpegWidget *widget, bool shm) : FFRenderer(widget), shm(shm) {}
+    int backend() const { return shm ? BACKEND_XVSHM : BACKEND_XV; }
+    PixelFormat format() const { return PIX_FMT_YUVJ420P; }
+    bool onWindow() const { return true; }
+    bool paint(FFBuffer *buf, const QRect &) {
+        widget->paintXv(buf);
+        return true;
+    }
+
+private:
+    bool shm;
+};
+
+/* Plain MIT-SHM: we scale the frame into a shared XImage the size of the
+ * view and the server copies it onto the window, so there's no xvideo and no
+ * pixmap upload through the socket. The image is laid out like a
+ * QImage::Format_RGB32, so the QImage backend's scaling and pan reuse can
+ * work in it directly as panImage
+ */
+class FFXShmRenderer : public FFRenderer
+{
+public:
+    FFXShmRenderer (ffmpegWidget *widget) : FFRenderer(widget), image(NULL) {}
+    ~FFXShmRenderer () { free(); }
+    int backend() const { return BACKEND_XSHM; }
+    PixelFormat format() const { return PIX_FMT_RGB24; }
+    bool onWindow() const { return true; }
+    bool paint(FFBuffer *buf, const QRect &) {
+        const int w = widget->_scVisW, h = widget->_scVisH;
+        if (w <= 0 || h <= 0) return true;
+        if (this->image == NULL || this->image->width != w || this->image->height != h) {
+            if (!alloc(w, h)) {
+                printf("Couldn't make shared memory images, not using them\n");
+                widget->xshm = false;
+                return false;
+            }
+        } else {
+            // the server must have finished copying the last frame out
+            // before we scale into it again
+            XSync(widget->dpy, False);
+        }
+        widget->updatePanImage(buf);
+        XShmPutImage(widget->dpy, widget->w, widget->gc, this->image,
+            0, 0, 0, 0, w, h, False);
+        /* Draw the grid over it */
+        widget->paintXvOverlay(widget->sfx, widget->sfy, widget->panOriginX, widget->panOriginY);
+        return true;
+    }
+
+private:
+    // make the image, and point panImage into it
+    bool alloc(int w, int h) {
+        free();
+        XImage *img = XShmCreateImage(widget->dpy, (Visual *) widget->x11Info().visual(),
+            widget->x11Info().depth(), ZPixmap, NULL, &this->shminfo, w, h);
+        if (img == NULL) return false;
+        if (img->bits_per_pixel != 32 || img->red_mask != 0xff0000 ||
+                img->green_mask != 0xff00 || img->blue_mask != 0xff ||
+                img->byte_order != (Q_BYTE_ORDER == Q_LITTLE_ENDIAN ? LSBFirst : MSBFirst)) {
+            // we'd have to convert every pixel, so it's no better than QImage
+            XDestroyImage(img);
+            return false;
+        }
+        this->shminfo.shmid = shmget(IPC_PRIVATE, img->bytes_per_line * h, IPC_CREAT | 0600);
+        if (this->shminfo.shmid < 0) {
+            XDestroyImage(img);
+            return false;
+        }
+        img->data = (char *) shmat(this->shminfo.shmid, NULL, 0);
+        // it goes away when both we and the server have detached
+        shmctl(this->shminfo.shmid, IPC_RMID, NULL);
+        if (img->data == (char *) -1) {
+            XDestroyImage(img);
+            return false;
+        }
+        this->shminfo.shmaddr = img->data;
+        this->shminfo.readOnly = False;
+        if (!attachShm(widget->dpy, &this->shminfo)) {
+            shmdt(img->data);
+            XDestroyImage(img);
+            return false;
+        }
+        this->image = img;
+        widget->panImage = QImage((uchar *) img->data, w, h, img->bytes_per_line,
+            QImage::Format_RGB32);
+        widget->panValid = false;
+        return true;
+    }
+
+    void free() {
+        if (this->image == NULL) return;
+        // stop scaling into it first
+        widget->panImage = QImage();
+        widget->panValid = false;
+        XShmDetach(widget->dpy, &this->shminfo);
+        XSync(widget->dpy, False);
+        XDestroyImage(this->image);
+        shmdt(this->shminfo.shmaddr);
+        this->image = NULL;
+    }
+
+    XImage *image;              // the size of the view, NULL until we paint
+    XShmSegmentInfo shminfo;
+};
+
+/* QPainter, which works everywhere but sends every pixel down the socket */
+class FFQImageRenderer : public FFRenderer
+{
+public:
+    FFQImageRenderer (ffmpegWidget *widget) : FFRenderer(widget) {}
+    int backend() const { return BACKEND_QIMAGE; }
+    PixelFormat format() const { return PIX_FMT_RGB24; }
+    bool paint(FFBuffer *buf, const QRect &rect) {
+        widget->paintQImage(buf, rect);
+        return true;
+    }
+};
+
+/* draws nothing, it takes each frame as it is converted so the pipeline can
+ * be run and timed without a display
+ */
+class FFNullRenderer : public FFRenderer
+{
+public:
+    FFNullRenderer (ffmpegWidget *widget) : FFRenderer(widget) {}
+    int backend() const { return BACKEND_NULL; }
+    PixelFormat format() const { return PIX_FMT_YUVJ420P; }
+    void frame(FFBuffer *buf) { widget->renderNull(buf); }
+    bool paint(FFBuffer *, const QRect &) { return true; }
+};
+
+// encode a frame as a single image with an ffmpeg encoder and write it out
+static bool writeEncoded(FFBuffer *src, enum AVCodecID codec_id,
+        PixelFormat pix_fmt, const QString &filename) {
+    AVCodec *codec = avcodec_find_encoder(codec_id);
+    if (codec == NULL) return false;
+    // convert to a format the encoder takes, with our own scale context so
+    // we don't get in the way of the display conversion
+    FFBuffer *conv = outbuffers.findFree(ffFrameSize(pix_fmt, src->width, src->height));
+    if (conv == NULL) return false;
+    ffFrameFill(conv->pFrame, conv->mem, pix_fmt, src->width, src->height);
+    struct SwsContext *sws = sws_getContext(src->width, src->height, src->pix_fmt,
+        src->width, src->height, pix_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+    if (sws == NULL) {
+        conv->release();
+        return false;
+    }
+    sws_scale(sws, src->pFrame->data, src->pFrame->linesize, 0, src->height,
+        conv->pFrame->data, conv->pFrame->linesize);
+    sws_freeContext(sws);
+    conv->pFrame->width = src->width;
+    conv->pFrame->height = src->height;
+    conv->pFrame->format = pix_fmt;
+    conv->pFrame->pts = 0;
+
+    // open the encoder
+    AVCodecContext *c = avcodec_alloc_context3(codec);
+    c->width = src->width;
+    c->height = src->height;
+    c->pix_fmt = pix_fmt;
+    c->time_base.num = 1;
+    c->time_base.den = 25;
+    ffmutex->lock();
+    int ret = avcodec_open2(c, codec, NULL);
+    ffmutex->unlock();
+    if (ret < 0) {
+        av_free(c);
+        conv->release();
+        return false;
+    }
+
+    // encode it and write it out
+    AVPacket pkt;
+    int got = 0;
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    bool ok = avcodec_encode_video2(c, &pkt, conv->pFrame, &got) >= 0 && got;
+    conv->release();
+    if (ok) {
+        QFile file(filename);
+        ok = file.open(QIODevice::WriteOnly) &&
+            file.write((const char *) pkt.data, pkt.size) == pkt.size;
+        av_free_packet(&pkt);
+    }
+    ffmutex->lock();
+    avcodec_close(c);
+    ffmutex->unlock();
+    av_free(c);
+    return ok;
+}
+
+// write the decoded planes one after the other without any padding
+static bool writeRaw(FFBuffer *src, const QString &filename) {
+    int size = avpicture_get_size(src->pix_fmt, src->width, src->height);
+    if (size <= 0) return false;
+    QByteArray data(size, 0);
+    avpicture_layout((const AVPicture *) src->pFrame, src->pix_fmt,
+        src->width, src->height, (unsigned char *) data.data(), size);
+    QFile file(filename);
+    return file.open(QIODevice::WriteOnly) && file.write(data) == size;
+}
+
 ffmpegWidget::ffmpegWidget (QWidget* parent)
     : QWidget (parent)
 {
@@ -226,12 +1445,18 @@ ffmpegWidget::ffmpegWidget (QWidget* parent)
     this->xv_port = -1;
     this->xv_format = -1;
     this->xv_image = NULL;
+    this->xv_shm = false;
+    this->xv_shm_images[0] = NULL;
+    this->xv_shm_images[1] = NULL;
+    this->xv_front = 0;
+    this->xv_front_valid = false;
+    this->xshm = false;
     this->dpy = NULL;
     this->maxW = 0;
     this->maxH = 0;
     this->setMinimumSize(64,48);
-    /* Now setup QImage or xv whichever we have */
-    this->ff_fmt = PIX_FMT_RGB24;
+    /* Now setup xv if we can, pickRenderer decides whether to use it */
+    this->renderer = new FFQImageRenderer(this);
     if (fallback == 0) this->xvSetup();
     /* setup some defaults, we'll overwrite them with sensible numbers later */
     /* Private variables, read/write */
@@ -245,6 +1470,43 @@ ffmpegWidget::ffmpegWidget (QWidget* parent)
     _gcol = Qt::white;  // grid colour
     _fcol = 0;          // false colour
     _url = QString(""); // ffmpeg url
+    _hideTimeout = 0;   // ms hidden before disconnect, 0 = never
+    _lowres = 0;        // decode at 1/2^lowres resolution
+    _autoLowres = false; // pick lowres from widget size
+    _accumulate = 1;    // number of frames averaged, 1 = off
+    _accumulateMode = 0; // 0 = boxcar, 1 = exponential decay
+    _rotate = 0;        // degrees clockwise, 0, 90, 180 or 270
+    _flipH = false;     // mirror left to right, before rotating
+    _flipV = false;     // mirror top to bottom, before rotating
+    _subtract = false;  // subtract the captured background
+    _subtractGain = 1.0; // gain after background subtraction
+    _subtractOffset = 0; // offset after background subtraction
+    _level = 32768; // centre of the window for 16-bit mono streams
+    _window = 65535; // width of the window for 16-bit mono streams
+    _autoLevel = false; // stretch black, white and gamma to suit the frame
+    _stats = false;     // compute projections, profiles and histogram
+    _roiX = 0;          // stats region x in image pixels
+    _roiY = 0;          // stats region y in image pixels
+    _roiW = 0;          // stats region width, 0 = to the edge
+    _roiH = 0;          // stats region height, 0 = to the edge
+    _threshold = 0;     // background level for the centroid
+    _followCentroid = false; // move the grid to the centroid
+    _replaySeconds = DEFAULTREPLAY; // seconds of packets kept for replay
+    _replay = false;    // paused, showing frames from the replay ring
+    _playhead = 0;      // frame shown in replay mode
+    _recording = false; // remuxing the stream to a file
+    _recordFile = QString(""); // file to record to, "" = auto
+    _snapshotFormat = QString("png"); // "png", "tiff" or "raw"
+    _snapshotProcessed = false; // burn false colour and grid into snapshots
+    // the environment gives the thread settings for every stream, until
+    // they are set for this one
+    _cpus = QString(qgetenv("FFMPEGWIDGET_CPUS")); // cpus to read and decode on, "" = any
+    _convertCpus = QString(qgetenv("FFMPEGWIDGET_CONVERTCPUS")); // cpus to convert on, "" = any
+    _niceness = qgetenv("FFMPEGWIDGET_NICE").isEmpty() ? NICE_UNSET :
+        qBound(-20, qgetenv("FFMPEGWIDGET_NICE").toInt(), 19); // nice value of the decode thread, NICE_UNSET = as inherited
+    _rtPriority = qgetenv("FFMPEGWIDGET_RTPRIORITY").isEmpty() ? RTPRIORITY_UNSET :
+        qBound(0, qgetenv("FFMPEGWIDGET_RTPRIORITY").toInt(), 99); // SCHED_FIFO priority of the decode thread, 0 = off, -1 = as inherited
+    _shmName = QString(""); // POSIX shared memory to publish frames to, "" = off
     this->disableUpdates = false;
     /* Private variables: read only */
     _maxX = 0;    // Max x offset in image pixels
@@ -253,6 +1515,7 @@ ffmpegWidget::ffmpegWidget (QWidget* parent)
     _maxGy = 0;   // Max grid y offset in image pixels
     _imW = 0;     // Image width in image pixels
     _imH = 0;     // Image height in image pixels
+    _imOrient = 0; // ORIENT_ flags of the frame _imW and _imH come from
     _visW = 0;    // Image width currently visible in image pixels
     _visH = 0;    // Image height currently visible in image pixels
     _scImW = 0;   // Image width in viewport scaled pixels
@@ -260,139 +1523,842 @@ ffmpegWidget::ffmpegWidget (QWidget* parent)
     _scVisW = 0;  // Image width visible in viewport scaled pixels
     _scVisH = 0;  // Image height visible in viewport scaled pixels
     _fps = 0.0;   // Frames per second displayed
+    _onScreen = false; // Widget is visible and not minimised
+    _maxPlayhead = 0; // Last frame in replay mode
+    _recordDropped = 0; // Packets dropped while recording
+    _framesDropped = 0; // Decoded frames never displayed
+    _decodeTime = 0.0; // Smoothed ms to decode a frame
+    _convertTime = 0.0; // Smoothed ms to convert a frame
+    _latency = 0.0; // Smoothed ms from packet arrival to display
+    _poolUsage = 0.0; // Percentage of the memory budget in use
+    _renderTime = 0.0; // Smoothed ms to draw a frame
+    _renderCount = 0; // Frames taken by the null backend
+    _renderChecksum = 0; // Adler-32 of the last of them
+    _threadInfo = QString(""); // Thread settings that took effect
+    _roiMin = 0;  // Min luma in the stats region
+    _roiMax = 0;  // Max luma in the stats region
+    _roiMean = 0.0; // Mean luma in the stats region
+    _centroidX = 0.0; // Centroid x in image pixels
+    _centroidY = 0.0; // Centroid y in image pixels
+    _sigmaX = 0.0; // Beam rms width in image pixels
+    _sigmaY = 0.0; // Beam rms height in image pixels
     // other
     this->sfx = 1.0;
     this->sfy = 1.0;    
     this->rawbuf = NULL;
     this->fullbuf = NULL;
+    this->fullMs = 0;
     this->lastFrameTime = new QTime();
     this->ff = NULL;
     this->widgetW = 0;
     this->widgetH = 0;
     this->ctx = NULL;    
+    this->reduceCtx = NULL;
+    // conversion
+    qRegisterMetaType<FFBuffer *>("FFBuffer*");
+    this->converting = false;
+    this->convertAgain = false;
+    this->frameSeq = 0;
+    this->jobMutex = new QMutex();
+    this->jobDone = new QWaitCondition();
+    this->jobRunning = false;
+    this->converted = NULL;
+    this->convertedSeq = 0;
+    this->convertedUs = 0;
+    this->convertedMs = 0;
+    this->convertedXv = false;
+    this->rawConverted = false;
+    this->snapshotsRunning = 0;
+    this->background = NULL;
+    this->levels = new FFLevels();
+    qRegisterMetaType<QVector<int> >("QVector<int>");
+    this->statsRunning = false;
+    this->statsResult = NULL;
+    // replay
+    this->replayCtx = NULL;
+    this->replayFrame = NULL;
+    this->replayDecoded = -1;
+    this->replayOrientCtx = NULL;
+    this->panValid = false;
+    this->overlayValid = false;
+    this->overlay_gc = 0;
     // fps calculation
     this->tickindex = 0;
     this->ticksum = 0;
     for (int i=0; i<MAXTICKS; i++) {
         this->ticklist[i] = 0;
     }
-    this->timer = new QTimer(this);
-    connect(this->timer, SIGNAL(timeout()), this, SLOT(calcFps()));
-    this->timer->start(100);
+    this->timer = new QTimer(this);
+    connect(this->timer, SIGNAL(timeout()), this, SLOT(calcFps()));
+    // minimising and obscuring don't always give us events, so poll too
+    connect(this->timer, SIGNAL(timeout()), this, SLOT(updateOnScreen()));
+    connect(this->timer, SIGNAL(timeout()), this, SLOT(updateRecordDropped()));
+    this->timer->start(100);
+    // visibility tracking
+    this->hiddenDisconnect = false;
+    this->hideTimer = new QTimer(this);
+    this->hideTimer->setSingleShot(true);
+    connect(this->hideTimer, SIGNAL(timeout()), this, SLOT(hideTimeoutExpired()));
+    // draw with the best backend we have
+    _backend = BACKEND_AUTO;
+    pickRenderer();
+    updateThreadInfo();
+}
+
+// destroy widget
+ffmpegWidget::~ffmpegWidget() {
+    ffQuit();
+    closeReplay();
+    // let any recorders finish writing their files
+    QList<FFRecorder *> recorders = findChildren<FFRecorder *>();
+    for (int i = 0; i < recorders.size(); i++) {
+        recorders[i]->stopGracefully();
+        recorders[i]->wait();
+    }
+    // wait for any conversion or snapshot on the pools to finish with us
+    this->jobMutex->lock();
+    while (this->jobRunning || this->snapshotsRunning || this->statsRunning) {
+        this->jobDone->wait(this->jobMutex);
+    }
+    delete this->statsResult;
+    this->statsResult = NULL;
+    if (this->converted) this->converted->release();
+    this->converted = NULL;
+    this->jobMutex->unlock();
+    if (this->rawbuf) this->rawbuf->release();
+    if (this->fullbuf) this->fullbuf->release();
+    if (this->background) this->background->release();
+    if (this->ctx) sws_freeContext(this->ctx);
+    if (this->reduceCtx) sws_freeContext(this->reduceCtx);
+    if (this->replayOrientCtx) sws_freeContext(this->replayOrientCtx);
+    xvFree();
+    delete this->renderer;
+    delete this->levels;
+    delete this->jobDone;
+    delete this->jobMutex;
+}
+
+// the conversion pool is shared by all widgets in the process
+QThreadPool * ffmpegWidget::conversionPool() {
+    static QThreadPool *pool = NULL;
+    if (pool == NULL) pool = new QThreadPool();
+    return pool;
+}
+
+// snapshots are written one at a time so they don't hold up conversions
+QThreadPool * ffmpegWidget::snapshotPool() {
+    static QThreadPool *pool = NULL;
+    if (pool == NULL) {
+        pool = new QThreadPool();
+        pool->setMaxThreadCount(1);
+    }
+    return pool;
+}
+
+// setup x or xvideo
+void ffmpegWidget::xvSetup() {
+    XvAdaptorInfo * ainfo;
+    XvEncodingInfo *encodings;
+    unsigned int adaptors, nencode;
+    unsigned int ver, rel, extmaj, extev, exterr;
+    // get display number
+    this->dpy = x11Info().display();
+    // Grab the window id and setup a graphics context
+    this->w = this->winId();
+    this->gc = XCreateGC(this->dpy, this->w, 0, 0);
+    this->overlay_gc = XCreateGC(this->dpy, this->w, 0, 0);
+    // we can scale into shared images ourselves if the server can use our
+    // shared memory and the screen is 32-bit true colour like a QImage
+    bool shm = shmUsable(this->dpy);
+    if (XShmQueryExtension(this->dpy) && !shm) {
+        printf("The display can't attach our shared memory, not using it\n");
+    }
+    Visual *visual = (Visual *) x11Info().visual();
+    this->xshm = shm && visual->c_class == TrueColor &&
+        visual->red_mask == 0xff0000 && visual->green_mask == 0xff00 &&
+        visual->blue_mask == 0xff;
+    // Now try and setup xv
+    // return version and release of extension
+    if (XvQueryExtension(this->dpy, &ver, &rel, &extmaj, &extev, &exterr) != Success) {
+        printf("XvQueryExtension failed, using QImage fallback mode\n");
+        return;
+    }
+    //printf("Ver: %d, Rel: %d, ExtMajor: %d, ExtEvent: %d, ExtError: %d\n", ver, rel, extmaj, extev, exterr);
+    //Ver: 2, Rel: 2, ExtMajor: 140, ExtEvent: 75, ExtError: 150
+    // return adaptor information for the screen
+    if (XvQueryAdaptors(this->dpy, QX11Info::appRootWindow(),
+            &adaptors, &ainfo) != Success) {
+        printf("XvQueryAdaptors failed, using QImage fallback mode\n");
+        return;
+    }
+    // see if we have any adapters
+    if (adaptors <= 0) {
+        printf("No xv adaptors found, using QImage fallback mode\n");
+        return;
+    }
+    // grab the port from the first adaptor
+    int gotPort = 0;
+    for(int p = 0; p < (int) ainfo[0].num_ports; p++) {
+        if(XvGrabPort(this->dpy, ainfo[0].base_id + p, CurrentTime) == Success) {
+            this->xv_port = ainfo[0].base_id + p;
+            gotPort = 1;
+            break;
+        }
+    }
+    // if we didn't find a port
+    if (!gotPort) {
+        printf("No xv ports free, using QImage fallback mode\n");
+        return;
+    }
+    // get max XV Image size
+    int gotEncodings = 0;
+    XvQueryEncodings(this->dpy, ainfo[0].base_id, &nencode, &encodings);
+    if (encodings && nencode && (ainfo[0].type & XvImageMask)) {
+        for(unsigned int n = 0; n < nencode; n++) {
+            if(!strcmp(encodings[n].name, "XV_IMAGE")) {
+                this->maxW = encodings[n].width;
+                this->maxH = encodings[n].height;
+                gotEncodings = 1;
+                break;
+            }
+        }
+    }
+    // if we didn't find a list of encodings
+    if (!gotEncodings) {
+        printf("No encodings information, using QImage fallback mode\n");
+        return;
+    }
+    // only support I420 mode for now
+    int num_formats = 0;
+    XvImageFormatValues * vals = XvListImageFormats(this->dpy,
+        this->xv_port, &num_formats);
+    for (int i=0; i<num_formats; i++) {
+        if (strcmp(vals->guid, "I420") == 0) {
+            this->xv_format = vals->id;
+            // let the server read frames straight out of our memory if it can
+            this->xv_shm = shm;
+            return;
+        }
+        vals++;
+    }
+    printf("Display doesn't support I420 mode, using QImage fallback mode\n");
+    return;
+}
+
+// true for mono formats with more than 8 bits per sample
+static bool isDeepGray(PixelFormat pix_fmt) {
+    return pix_fmt == PIX_FMT_GRAY16LE || pix_fmt == PIX_FMT_GRAY16BE;
+}
+
+// true if the samples of a deep mono format need byte swapping for us
+static bool isSwappedGray(PixelFormat pix_fmt) {
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    return pix_fmt == PIX_FMT_GRAY16BE;
+#else
+    return pix_fmt == PIX_FMT_GRAY16LE;
+#endif
+}
+
+// dest = (src - bg) * gain / 256 + offset, with the subtraction saturating
+// at 0 and the result at 0 and 255. gain must be less than 32768
+static void subtractRow(const unsigned char *src, const unsigned char *bg,
+        unsigned char *dest, int n, int gain, int offset) {
+    int i = 0;
+    if (gain == 256 && offset == 0) {
+        // plain saturating subtract
+#ifdef __AVX2__
+        for (; i + 32 <= n; i += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i *) (src + i));
+            __m256i b = _mm256_loadu_si256((const __m256i *) (bg + i));
+            _mm256_storeu_si256((__m256i *) (dest + i), _mm256_subs_epu8(a, b));
+        }
+#endif
+#ifdef __SSE2__
+        for (; i + 16 <= n; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *) (src + i));
+            __m128i b = _mm_loadu_si128((const __m128i *) (bg + i));
+            _mm_storeu_si128((__m128i *) (dest + i), _mm_subs_epu8(a, b));
+        }
+#endif
+        for (; i < n; i++) dest[i] = src[i] > bg[i] ? src[i] - bg[i] : 0;
+        return;
+    }
+    // (d << 8) * gain >> 16 is d * gain / 256, then add the offset and
+    // let the pack saturate it back to bytes
+#ifdef __AVX2__
+    const __m256i zero256 = _mm256_setzero_si256();
+    const __m256i g256 = _mm256_set1_epi16((short) gain);
+    const __m256i o256 = _mm256_set1_epi16((short) offset);
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (bg + i));
+        __m256i d = _mm256_subs_epu8(a, b);
+        __m256i lo = _mm256_mulhi_epu16(_mm256_unpacklo_epi8(zero256, d), g256);
+        __m256i hi = _mm256_mulhi_epu16(_mm256_unpackhi_epi8(zero256, d), g256);
+        lo = _mm256_adds_epi16(lo, o256);
+        hi = _mm256_adds_epi16(hi, o256);
+        _mm256_storeu_si256((__m256i *) (dest + i), _mm256_packus_epi16(lo, hi));
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i g = _mm_set1_epi16((short) gain);
+    const __m128i o = _mm_set1_epi16((short) offset);
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (bg + i));
+        __m128i d = _mm_subs_epu8(a, b);
+        __m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, d), g);
+        __m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, d), g);
+        lo = _mm_adds_epi16(lo, o);
+        hi = _mm_adds_epi16(hi, o);
+        _mm_storeu_si128((__m128i *) (dest + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < n; i++) {
+        int d = src[i] > bg[i] ? src[i] - bg[i] : 0;
+        int v = ((d << 8) * gain >> 16) + offset;
+        dest[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+    }
+}
+
+// the same for n 16-bit samples, swapping src and bg first if swap is set
+// and saturating the result at 0 and 65535. offset is in 16-bit levels
+static void subtractRow16(const quint16 *src, const quint16 *bg, quint16 *dest,
+        int n, bool swap, int gain, int offset) {
+    int i = 0;
+#ifdef __SSE2__
+    // d * gain / 256 from the two halves of the 32-bit product, saturating
+    // when the high half has more than 8 bits. gain < 32768 keeps that
+    // half positive for the signed compare
+    const __m128i g = _mm_set1_epi16((short) gain);
+    const __m128i top = _mm_set1_epi16(255);
+    const __m128i up = _mm_set1_epi16((short) qMax(offset, 0));
+    const __m128i down = _mm_set1_epi16((short) qMax(-offset, 0));
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (bg + i));
+        if (swap) {
+            a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+            b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+        }
+        __m128i d = _mm_subs_epu16(a, b);
+        __m128i hi = _mm_mulhi_epu16(d, g);
+        __m128i lo = _mm_mullo_epi16(d, g);
+        d = _mm_or_si128(_mm_slli_epi16(hi, 8), _mm_srli_epi16(lo, 8));
+        d = _mm_or_si128(d, _mm_cmpgt_epi16(hi, top));
+        d = _mm_subs_epu16(_mm_adds_epu16(d, up), down);
+        _mm_storeu_si128((__m128i *) (dest + i), d);
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned int a = swap ? (quint16) ((src[i] << 8) | (src[i] >> 8)) : src[i];
+        unsigned int b = swap ? (quint16) ((bg[i] << 8) | (bg[i] >> 8)) : bg[i];
+        unsigned int d = a > b ? a - b : 0;
+        int v = (int) qMin((d * gain) >> 8, 65535u) + offset;
+        dest[i] = (quint16) qBound(0, v, 65535);
+    }
+}
+
+// make a buffer for a new luma plane for src. The result shares the other
+// planes of src, so src must outlive it
+static FFBuffer * newLumaPlane(FFBuffer *src) {
+    const int linesize = FFALIGN(src->width, FRAMEALIGN);
+    FFBuffer *dest = outbuffers.findFree(linesize * src->height);
+    if (dest == NULL) return NULL;
+    dest->width = src->width;
+    dest->height = src->height;
+    dest->pix_fmt = src->pix_fmt;
+    dest->lowres = src->lowres;
+    for (int i = 1; i < AV_NUM_DATA_POINTERS; i++) {
+        dest->pFrame->data[i] = src->pFrame->data[i];
+        dest->pFrame->linesize[i] = src->pFrame->linesize[i];
+    }
+    dest->pFrame->data[0] = dest->mem;
+    dest->pFrame->linesize[0] = linesize;
+    return dest;
+}
+
+// subtract a background from the luma plane of src. Deep mono frames are
+// subtracted at their own depth into a native 16-bit frame, with the offset
+// scaled up to match
+static FFBuffer * subtractBackground(FFBuffer *src, FFBuffer *bg, int gain, int offset) {
+    const bool deep = isDeepGray(src->pix_fmt);
+    if (!(hasLumaPlane(src->pix_fmt) || deep) || bg->pix_fmt != src->pix_fmt ||
+            bg->width != src->width || bg->height != src->height) {
+        return NULL;
+    }
+    if (deep) {
+        FFBuffer *dest = outbuffers.findFree(ffFrameSize(PIX_FMT_GRAY16, src->width, src->height));
+        if (dest == NULL) return NULL;
+        dest->width = src->width;
+        dest->height = src->height;
+        dest->pix_fmt = PIX_FMT_GRAY16;
+        dest->lowres = src->lowres;
+        ffFrameFill(dest->pFrame, dest->mem,
+            dest->pix_fmt, dest->width, dest->height);
+        for (int y = 0; y < src->height; y++) {
+            subtractRow16((const quint16 *) (src->pFrame->data[0] + y * src->pFrame->linesize[0]),
+                (const quint16 *) (bg->pFrame->data[0] + y * bg->pFrame->linesize[0]),
+                (quint16 *) (dest->pFrame->data[0] + y * dest->pFrame->linesize[0]),
+                src->width, isSwappedGray(src->pix_fmt), gain, offset * 257);
+        }
+        return dest;
+    }
+    FFBuffer *dest = newLumaPlane(src);
+    if (dest == NULL) return NULL;
+    for (int y = 0; y < src->height; y++) {
+        subtractRow(src->pFrame->data[0] + y * src->pFrame->linesize[0],
+            bg->pFrame->data[0] + y * bg->pFrame->linesize[0],
+            dest->pFrame->data[0] + y * dest->pFrame->linesize[0],
+            src->width, gain, offset);
+    }
+    return dest;
+}
+
+// out = offset + min(in - low, span) * scale for n 16-bit samples, where
+// in is first byte swapped if swap is set. The difference is shifted left
+// by shift and multiplied by scale = 255 / (width << shift) in 0.16 fixed
+// point, so narrow windows keep their precision, and the result saturates
+// at 255
+static void windowRow(const quint16 *in, unsigned char *out, int n, bool swap,
+        quint16 low, quint16 span, int shift, quint16 scale, quint16 offset) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i l = _mm_set1_epi16((short) low);
+    const __m128i w = _mm_set1_epi16((short) span);
+    const __m128i s = _mm_set1_epi16((short) scale);
+    const __m128i o = _mm_set1_epi16((short) offset);
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (in + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (in + i + 8));
+        if (swap) {
+            a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+            b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+        }
+        // min(a - low, span) with saturating subtracts, SSE2 has no min_epu16
+        a = _mm_subs_epu16(a, l);
+        b = _mm_subs_epu16(b, l);
+        a = _mm_sub_epi16(a, _mm_subs_epu16(a, w));
+        b = _mm_sub_epi16(b, _mm_subs_epu16(b, w));
+        a = _mm_add_epi16(_mm_mulhi_epu16(_mm_sll_epi16(a, sh), s), o);
+        b = _mm_add_epi16(_mm_mulhi_epu16(_mm_sll_epi16(b, sh), s), o);
+        _mm_storeu_si128((__m128i *) (out + i), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned int v = swap ? (quint16) ((in[i] << 8) | (in[i] >> 8)) : in[i];
+        v = v > low ? qMin(v - low, (unsigned int) span) : 0;
+        out[i] = (unsigned char) qMin(((v << shift) * scale >> 16) + offset, 255u);
+    }
+}
+
+// map a deep mono frame to 8-bits through the window [low, low + width]
+static FFBuffer * windowFrame(FFBuffer *src, int low, int width) {
+    FFBuffer *dest = outbuffers.findFree(ffFrameSize(PIX_FMT_GRAY8, src->width, src->height));
+    if (dest == NULL) return NULL;
+    dest->width = src->width;
+    dest->height = src->height;
+    dest->pix_fmt = PIX_FMT_GRAY8;
+    dest->lowres = src->lowres;
+    ffFrameFill(dest->pFrame, dest->mem,
+        dest->pix_fmt, dest->width, dest->height);
+    // the window may stick out of the range of the samples, but its slope
+    // must stay 255 / width, so only map the part of it they can reach and
+    // start from the output level at its low end
+    width = qMax(width, 1);
+    const qint64 from = qBound((qint64) 0, (qint64) low, (qint64) 65535);
+    const qint64 to = qBound((qint64) 0, (qint64) low + width, (qint64) 65535);
+    const quint16 offset = (quint16) qBound((qint64) 0, (from - low) * 255 / width, (qint64) 255);
+    int shift = 0;
+    while (((qint64) width << shift) < 256) shift++;
+    quint16 scale = (quint16) qMin((((qint64) 255 << 16) + ((qint64) width << shift) - 1) /
+        ((qint64) width << shift), (qint64) 65535);
+    const bool swap = isSwappedGray(src->pix_fmt);
+    for (int y = 0; y < src->height; y++) {
+        windowRow((const quint16 *) (src->pFrame->data[0] + y * src->pFrame->linesize[0]),
+            dest->pFrame->data[0] + y * dest->pFrame->linesize[0],
+            src->width, swap, (quint16) from, (quint16) (to - from), shift, scale, offset);
+    }
+    return dest;
+}
+
+// pass the luma plane of src through a lookup table
+static FFBuffer * mapLuma(FFBuffer *src, const unsigned char *lut) {
+    FFBuffer *dest = newLumaPlane(src);
+    if (dest == NULL) return NULL;
+    for (int y = 0; y < src->height; y++) {
+        const unsigned char *in = src->pFrame->data[0] + y * src->pFrame->linesize[0];
+        unsigned char *out = dest->pFrame->data[0] + y * dest->pFrame->linesize[0];
+        for (int x = 0; x < src->width; x++) out[x] = lut[in[x]];
+    }
+    return dest;
+}
+
+// histogram of the luma plane of src, sampling at most LEVELSAMPLES pixels.
+// Counting into 4 histograms in turn stops runs of the same level stalling
+// on a single counter
+static void lumaHistogram(FFBuffer *src, unsigned int *hist) {
+    unsigned int sub[4][256];
+    memset(sub, 0, sizeof(sub));
+    int step = 1;
+    while ((qint64) src->width * src->height > (qint64) LEVELSAMPLES * step * step) step++;
+    for (int y = 0; y < src->height; y += step) {
+        const unsigned char *row = src->pFrame->data[0] + y * src->pFrame->linesize[0];
+        int x = 0;
+        for (; x + 3 * step < src->width; x += 4 * step) {
+            sub[0][row[x]]++;
+            sub[1][row[x + step]]++;
+            sub[2][row[x + 2 * step]]++;
+            sub[3][row[x + 3 * step]]++;
+        }
+        for (; x < src->width; x += step) sub[0][row[x]]++;
+    }
+    for (int i = 0; i < 256; i++) {
+        hist[i] = sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+    }
+}
+
+// FFLevels picks black, white and gamma from a histogram and keeps a
+// lookup table for them
+FFLevels::FFLevels() {
+    this->mutex = new QMutex();
+    reset();
+}
+
+FFLevels::~FFLevels() {
+    delete this->mutex;
+}
+
+void FFLevels::reset() {
+    QMutexLocker locker(this->mutex);
+    this->valid = false;
+    this->black = 0;
+    this->white = 255;
+    this->gamma = 1.0;
+    for (int i = 0; i < 256; i++) this->lut[i] = i;
+}
+
+// look at the histogram of buf, and rebuild the table if the levels have
+// moved far enough
+void FFLevels::update(FFBuffer *buf) {
+    unsigned int hist[256];
+    lumaHistogram(buf, hist);
+    qint64 total = 0;
+    for (int i = 0; i < 256; i++) total += hist[i];
+    if (total == 0) return;
+
+    // clip LEVELCLIP percent at each end
+    qint64 clip = (qint64) (total * LEVELCLIP / 100);
+    qint64 cum = 0;
+    int black = 0;
+    while (black < 255 && cum + hist[black] <= clip) cum += hist[black++];
+    cum = 0;
+    int white = 255;
+    while (white > 0 && cum + hist[white] <= clip) cum += hist[white--];
+    if (white <= black) {
+        white = qMin(black + 1, 255);
+        black = white - 1;
+    }
+
+    // pick a gamma that puts the mean level in the middle
+    qint64 sum = 0, n = 0;
+    for (int i = black; i <= white; i++) {
+        sum += (qint64) i * hist[i];
+        n += hist[i];
+    }
+    double gamma = 1.0;
+    if (n > 0) {
+        double mean = (sum / (double) n - black) / (white - black);
+        if (mean > 0.0 && mean < 1.0) gamma = qBound(0.25, log(0.5) / log(mean), 4.0);
+    }
+
+    // only rebuild the table if they've moved, so the picture doesn't flicker
+    QMutexLocker locker(this->mutex);
+    if (this->valid && abs(black - this->black) <= LEVELHYSTERESIS &&
+            abs(white - this->white) <= LEVELHYSTERESIS &&
+            fabs(log(gamma / this->gamma)) <= 0.1) {
+        return;
+    }
+    this->valid = true;
+    this->black = black;
+    this->white = white;
+    this->gamma = gamma;
+    for (int i = 0; i < 256; i++) {
+        if (i <= black) {
+            this->lut[i] = 0;
+        } else if (i >= white) {
+            this->lut[i] = 255;
+        } else {
+            this->lut[i] = (unsigned char) (255 * pow((i - black) / (double) (white - black), gamma) + 0.5);
+        }
+    }
 }
 
-// destroy widget
-ffmpegWidget::~ffmpegWidget() {
-    ffQuit();
+// copy out the current table
+void FFLevels::copyLut(unsigned char *lut) {
+    QMutexLocker locker(this->mutex);
+    memcpy(lut, this->lut, 256);
 }
 
-// setup x or xvideo
-void ffmpegWidget::xvSetup() {
-    XvAdaptorInfo * ainfo;
-    XvEncodingInfo *encodings;
-    unsigned int adaptors, nencode;
-    unsigned int ver, rel, extmaj, extev, exterr;
-    // get display number
-    this->dpy = x11Info().display();
-    // Grab the window id and setup a graphics context
-    this->w = this->winId();
-    this->gc = XCreateGC(this->dpy, this->w, 0, 0);
-    // Now try and setup xv
-    // return version and release of extension
-    if (XvQueryExtension(this->dpy, &ver, &rel, &extmaj, &extev, &exterr) != Success) {
-        printf("XvQueryExtension failed, using QImage fallback mode\n");
-        return;
+// return the sum of n bytes, adding them to colSum and keeping track of
+// the min and max
+static unsigned int statsRow(const unsigned char *row, int n, unsigned int *colSum,
+        unsigned char *rmin, unsigned char *rmax) {
+    unsigned int sum = 0;
+    unsigned char lo = *rmin, hi = *rmax;
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vsum = zero;
+    __m128i vmin = _mm_set1_epi8((char) lo);
+    __m128i vmax = _mm_set1_epi8((char) hi);
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (row + i));
+        vsum = _mm_add_epi64(vsum, _mm_sad_epu8(a, zero));
+        vmin = _mm_min_epu8(vmin, a);
+        vmax = _mm_max_epu8(vmax, a);
+        // widen to 32 bits for the column sums
+        __m128i a0 = _mm_unpacklo_epi8(a, zero);
+        __m128i a1 = _mm_unpackhi_epi8(a, zero);
+        __m128i *c = (__m128i *) (colSum + i);
+        _mm_storeu_si128(c, _mm_add_epi32(_mm_loadu_si128(c), _mm_unpacklo_epi16(a0, zero)));
+        _mm_storeu_si128(c + 1, _mm_add_epi32(_mm_loadu_si128(c + 1), _mm_unpackhi_epi16(a0, zero)));
+        _mm_storeu_si128(c + 2, _mm_add_epi32(_mm_loadu_si128(c + 2), _mm_unpacklo_epi16(a1, zero)));
+        _mm_storeu_si128(c + 3, _mm_add_epi32(_mm_loadu_si128(c + 3), _mm_unpackhi_epi16(a1, zero)));
     }
-    //printf("Ver: %d, Rel: %d, ExtMajor: %d, ExtEvent: %d, ExtError: %d\n", ver, rel, extmaj, extev, exterr);
-    //Ver: 2, Rel: 2, ExtMajor: 140, ExtEvent: 75, ExtError: 150
-    // return adaptor information for the screen
-    if (XvQueryAdaptors(this->dpy, QX11Info::appRootWindow(),
-            &adaptors, &ainfo) != Success) {
-        printf("XvQueryAdaptors failed, using QImage fallback mode\n");
-        return;
+    sum = _mm_cvtsi128_si32(vsum) + _mm_cvtsi128_si32(_mm_srli_si128(vsum, 8));
+    unsigned char mins[16], maxs[16];
+    _mm_storeu_si128((__m128i *) mins, vmin);
+    _mm_storeu_si128((__m128i *) maxs, vmax);
+    for (int j = 0; j < 16; j++) {
+        lo = qMin(lo, mins[j]);
+        hi = qMax(hi, maxs[j]);
     }
-    // see if we have any adapters
-    if (adaptors <= 0) {
-        printf("No xv adaptors found, using QImage fallback mode\n");
-        return;
+#endif
+    for (; i < n; i++) {
+        unsigned char v = row[i];
+        sum += v;
+        colSum[i] += v;
+        lo = qMin(lo, v);
+        hi = qMax(hi, v);
     }
-    // grab the port from the first adaptor
-    int gotPort = 0;
-    for(int p = 0; p < (int) ainfo[0].num_ports; p++) {
-        if(XvGrabPort(this->dpy, ainfo[0].base_id + p, CurrentTime) == Success) {
-            this->xv_port = ainfo[0].base_id + p;
-            gotPort = 1;
-            break;
+    *rmin = lo;
+    *rmax = hi;
+    return sum;
+}
+
+// return the sum of n bytes less threshold, adding them to colSum
+static unsigned int weightRow(const unsigned char *row, int n, unsigned char threshold,
+        unsigned int *colSum) {
+    unsigned int sum = 0;
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i t = _mm_set1_epi8((char) threshold);
+    __m128i vsum = zero;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_subs_epu8(_mm_loadu_si128((const __m128i *) (row + i)), t);
+        vsum = _mm_add_epi64(vsum, _mm_sad_epu8(a, zero));
+        __m128i a0 = _mm_unpacklo_epi8(a, zero);
+        __m128i a1 = _mm_unpackhi_epi8(a, zero);
+        __m128i *c = (__m128i *) (colSum + i);
+        _mm_storeu_si128(c, _mm_add_epi32(_mm_loadu_si128(c), _mm_unpacklo_epi16(a0, zero)));
+        _mm_storeu_si128(c + 1, _mm_add_epi32(_mm_loadu_si128(c + 1), _mm_unpackhi_epi16(a0, zero)));
+        _mm_storeu_si128(c + 2, _mm_add_epi32(_mm_loadu_si128(c + 2), _mm_unpacklo_epi16(a1, zero)));
+        _mm_storeu_si128(c + 3, _mm_add_epi32(_mm_loadu_si128(c + 3), _mm_unpackhi_epi16(a1, zero)));
+    }
+    sum = _mm_cvtsi128_si32(vsum) + _mm_cvtsi128_si32(_mm_srli_si128(vsum, 8));
+#endif
+    for (; i < n; i++) {
+        unsigned char v = row[i] > threshold ? row[i] - threshold : 0;
+        sum += v;
+        colSum[i] += v;
+    }
+    return sum;
+}
+
+/* the same as statsRow and weightRow together for every step'th of n deep
+ * mono samples, swapping them first if swap is set, and adding each to the
+ * histogram by its top 8 bits. Stats are sub-sampled to a bounded size, so
+ * this doesn't need to be vectorised
+ */
+static unsigned int statsRowDeep(const quint16 *row, int n, int step, bool swap,
+        unsigned int threshold, unsigned int *colSum, unsigned int *colWeight,
+        unsigned int *weight, int *rmin, int *rmax, int *histogram) {
+    unsigned int sum = 0, wsum = 0;
+    int lo = *rmin, hi = *rmax;
+    for (int i = 0; i < n; i++) {
+        int v = row[i * step];
+        if (swap) v = (quint16) ((v << 8) | (v >> 8));
+        sum += v;
+        colSum[i] += v;
+        if (threshold) {
+            unsigned int t = (unsigned int) v > threshold ? v - threshold : 0;
+            wsum += t;
+            colWeight[i] += t;
         }
+        lo = qMin(lo, v);
+        hi = qMax(hi, v);
+        histogram[v >> 8]++;
     }
-    // if we didn't find a port
-    if (!gotPort) {
-        printf("No xv ports free, using QImage fallback mode\n");
+    *rmin = lo;
+    *rmax = hi;
+    *weight = wsum;
+    return sum;
+}
+
+// sample x, y of the luma plane of src, at its own depth
+static int lumaAt(FFBuffer *src, int x, int y) {
+    const unsigned char *row = src->pFrame->data[0] + y * src->pFrame->linesize[0];
+    if (!isDeepGray(src->pix_fmt)) return row[x];
+    quint16 v = ((const quint16 *) row)[x];
+    return isSwappedGray(src->pix_fmt) ? (quint16) ((v << 8) | (v >> 8)) : v;
+}
+
+// centroid and rms width of a projection, in units of its samples
+static void projectionMoments(const QVector<unsigned int> &proj, double *mean, double *sigma) {
+    double s0 = 0, s1 = 0, s2 = 0;
+    for (int i = 0; i < proj.size(); i++) {
+        s0 += proj[i];
+        s1 += (double) i * proj[i];
+        s2 += (double) i * i * proj[i];
+    }
+    if (s0 <= 0) {
+        *mean = (proj.size() - 1) / 2.0;
+        *sigma = 0;
         return;
     }
-    // get max XV Image size
-    int gotEncodings = 0;
-    XvQueryEncodings(this->dpy, ainfo[0].base_id, &nencode, &encodings);
-    if (encodings && nencode && (ainfo[0].type & XvImageMask)) {
-        for(unsigned int n = 0; n < nencode; n++) {
-            if(!strcmp(encodings[n].name, "XV_IMAGE")) {
-                this->maxW = encodings[n].width;
-                this->maxH = encodings[n].height;
-                gotEncodings = 1;
-                break;
-            }
-        }
+    *mean = s1 / s0;
+    *sigma = sqrt(qMax(s2 / s0 - *mean * *mean, 0.0));
+}
+
+// copy a converted frame into a shared memory I420 image of the same size
+static bool copyToXvImage(FFBuffer *src, XvImage *img) {
+    if (img == NULL || src->pix_fmt != PIX_FMT_YUVJ420P ||
+            img->width != src->width || img->height != src->height) {
+        return false;
     }
-    // if we didn't find a list of encodings
-    if (!gotEncodings) {
-        printf("No encodings information, using QImage fallback mode\n");
+    for (int p = 0; p < 3; p++) {
+        av_image_copy_plane((uint8_t *) img->data + img->offsets[p], img->pitches[p],
+            src->pFrame->data[p], src->pFrame->linesize[p],
+            p ? src->width / 2 : src->width, p ? src->height / 2 : src->height);
+    }
+    return true;
+}
+
+// true if a pix_fmt frame of width x height goes in layout
+static bool inXvLayout(const FFXvLayout *layout, PixelFormat pix_fmt, int width, int height) {
+    return layout && pix_fmt == PIX_FMT_YUVJ420P &&
+        layout->width == width && layout->height == height;
+}
+
+// ffFrameSize, or the size of layout if the frame goes in it
+static int outFrameSize(PixelFormat pix_fmt, int width, int height, const FFXvLayout *layout) {
+    if (inXvLayout(layout, pix_fmt, width, height)) return layout->size;
+    return ffFrameSize(pix_fmt, width, height);
+}
+
+// ffFrameFill, or point the planes where layout says if the frame goes in it
+static void outFrameFill(AVFrame *frame, unsigned char *mem, PixelFormat pix_fmt,
+        int width, int height, const FFXvLayout *layout) {
+    if (!inXvLayout(layout, pix_fmt, width, height)) {
+        ffFrameFill(frame, mem, pix_fmt, width, height);
         return;
     }
-    // only support I420 mode for now
-    int num_formats = 0;
-    XvImageFormatValues * vals = XvListImageFormats(this->dpy,
-        this->xv_port, &num_formats);
-    for (int i=0; i<num_formats; i++) {
-        if (strcmp(vals->guid, "I420") == 0) {
-            this->xv_format = vals->id;
-            this->ff_fmt = PIX_FMT_YUVJ420P;
-            // Widget is responsible for painting all its pixels with an opaque color
-            setAttribute(Qt::WA_OpaquePaintEvent);
-            setAttribute(Qt::WA_PaintOnScreen);
-            return;
-        }
-        vals++;
+    for (int p = 0; p < 3; p++) {
+        frame->data[p] = mem + layout->offsets[p];
+        frame->linesize[p] = layout->pitches[p];
     }
-    printf("Display doesn't support I420 mode, using QImage fallback mode\n");
-    return;
+    frame->data[3] = NULL;
+    frame->linesize[3] = 0;
+}
+
+// true if we can point into the middle of a frame of this format
+static bool canCrop(PixelFormat pix_fmt) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    return desc && !(desc->flags & (PIX_FMT_PAL | PIX_FMT_BITSTREAM | PIX_FMT_HWACCEL));
 }
 
-// take a buffer and swscale it to the requested dimensions
-FFBuffer * ffmpegWidget::formatFrame(FFBuffer *src, PixelFormat pix_fmt) {
-    FFBuffer *dest = findFreeBuffer(outbuffers);
+// point data at pixel (x, y) of src, x and y must be multiples of 4
+static void cropPlanes(FFBuffer *src, int x, int y, uint8_t *data[4]) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src->pix_fmt);
+    int step[4] = {0, 0, 0, 0};
+    for (int c = 0; c < desc->nb_components; c++) {
+        const AVComponentDescriptor &comp = desc->comp[c];
+        step[comp.plane] = qMax(step[comp.plane], comp.step_minus1 + 1);
+    }
+    for (int p = 0; p < 4; p++) {
+        data[p] = src->pFrame->data[p];
+        if (data[p] == NULL) continue;
+        bool chroma = (p == 1 || p == 2) && !(desc->flags & PIX_FMT_RGB);
+        int px = chroma ? x >> desc->log2_chroma_w : x;
+        int py = chroma ? y >> desc->log2_chroma_h : y;
+        data[p] += py * src->pFrame->linesize[p] + px * step[p];
+    }
+}
+
+// take a buffer and swscale it to the requested dimensions, in layout if it
+// is for frames like the result
+FFBuffer * ffmpegWidget::formatFrame(FFBuffer *src, PixelFormat pix_fmt, struct SwsContext **sws,
+        const FFXvLayout *layout) {
+    // fill in multiples of 8 that we can cope with
+    int width = src->width - src->width % 8;
+    int height = src->height - src->height % 2;
+    FFBuffer *dest = outbuffers.findFree(outFrameSize(pix_fmt, width, height, layout));
     // make sure we got a buffer
     if (dest == NULL) return NULL;
-    // fill in multiples of 8 that we can cope with
-    dest->width = src->width - src->width % 8;
-    dest->height = src->height - src->height % 2;
+    dest->width = width;
+    dest->height = height;
     dest->pix_fmt = pix_fmt;
     // see if we have a suitable cached context
     // note that we use the original values of width and height
-    this->ctx = sws_getCachedContext(this->ctx,
+    *sws = sws_getCachedContext(*sws,
         dest->width, dest->height, src->pix_fmt,
         dest->width, dest->height, dest->pix_fmt,
         SWS_BICUBIC, NULL, NULL, NULL);
     // Assign appropriate parts of buffer->mem to planes in buffer->pFrame    
-    avpicture_fill((AVPicture *) dest->pFrame, dest->mem,
-        dest->pix_fmt, dest->width, dest->height);
+    outFrameFill(dest->pFrame, dest->mem,
+        dest->pix_fmt, dest->width, dest->height, layout);
     // do the software scale
-    sws_scale(this->ctx, src->pFrame->data, src->pFrame->linesize, 0,
+    sws_scale(*sws, src->pFrame->data, src->pFrame->linesize, 0,
         src->height, dest->pFrame->data, dest->pFrame->linesize);
     return dest;
 }
 
-// take a buffer and swscale it to the requested dimensions
-FFBuffer * ffmpegWidget::falseFrame(FFBuffer *src, PixelFormat pix_fmt) {
+// crop and bin src to the region in params, keeping a luma plane so false
+// colour and levels still work
+FFBuffer * ffmpegWidget::reduceFrame(FFBuffer *src, const FFConvertParams &params) {
+    const int w = params.viewW;
+    const int h = params.viewH;
+    const int dw = w / params.bin;
+    const int dh = h / params.bin;
+    PixelFormat pix_fmt = PIX_FMT_YUVJ420P;
+    if (hasLumaPlane(src->pix_fmt) && sws_isSupportedOutput(src->pix_fmt)) pix_fmt = src->pix_fmt;
+    FFBuffer *dest = outbuffers.findFree(ffFrameSize(pix_fmt, dw, dh));
+    if (dest == NULL) return NULL;
+    dest->width = dw;
+    dest->height = dh;
+    dest->pix_fmt = pix_fmt;
+    dest->lowres = src->lowres;
+    uint8_t *data[4];
+    cropPlanes(src, params.viewX, params.viewY, data);
+    // average the pixels we bin, a crop is just a copy
+    this->reduceCtx = sws_getCachedContext(this->reduceCtx,
+        w, h, src->pix_fmt, dw, dh, pix_fmt,
+        params.bin > 1 ? SWS_AREA : SWS_POINT, NULL, NULL, NULL);
+    ffFrameFill(dest->pFrame, dest->mem,
+        dest->pix_fmt, dest->width, dest->height);
+    sws_scale(this->reduceCtx, data, src->pFrame->linesize, 0, h,
+        dest->pFrame->data, dest->pFrame->linesize);
+    return dest;
+}
+
+// take a buffer and false colour it into the requested format, in layout if
+// it is for frames like the result
+FFBuffer * ffmpegWidget::falseFrame(FFBuffer *src, PixelFormat pix_fmt, int fcol, const unsigned char *lut,
+        struct SwsContext **sws, const FFXvLayout *layout) {
     FFBuffer *yuv = NULL;
     switch (src->pix_fmt) {
         case PIX_FMT_YUV420P:   //< planar YUV 4:2:0, 12bpp, (1 Cr & Cb sample per 2x2 Y samples)
@@ -406,42 +2372,50 @@ FFBuffer * ffmpegWidget::falseFrame(FFBuffer *src, PixelFormat pix_fmt) {
         case PIX_FMT_YUVJ440P:  //< planar YUV 4:4:0 full scale (JPEG), deprecated in favor of PIX_FMT_YUV440P and setting color_range
         case PIX_FMT_YUV444P:   //< planar YUV 4:4:4, 24bpp, (1 Cr & Cb sample per 1x1 Y samples)
         case PIX_FMT_YUVJ444P:  //< planar YUV 4:4:4, 24bpp, full scale (JPEG), deprecated in favor of PIX_FMT_YUV444P and setting color_range
+        case PIX_FMT_GRAY8:     //<        Y        ,  8bpp
             yuv = src;
             break;
         default:
-            yuv = formatFrame(src, PIX_FMT_YUVJ420P);
+            yuv = formatFrame(src, PIX_FMT_YUVJ420P, sws);
+            if (yuv == NULL) return NULL;
     }
     /* Now we have our YUV frame, generate YUV data */
-    FFBuffer *dest = findFreeBuffer(outbuffers);
+    // fill in multiples of 8 that we can cope with
+    int width = src->width - src->width % 8;
+    int height = src->height - src->height % 2;
+    FFBuffer *dest = outbuffers.findFree(outFrameSize(pix_fmt, width, height, layout));
     // make sure we got a buffer
     if (dest == NULL) {
         // get rid of the original
         if (yuv != src) yuv->release();
         return NULL;
     }
-    // fill in multiples of 8 that we can cope with
-    dest->width = src->width - src->width % 8;
-    dest->height = src->height - src->height % 2;
+    dest->width = width;
+    dest->height = height;
     dest->pix_fmt = pix_fmt;
+    // Assign appropriate parts of buffer->mem to planes in buffer->pFrame    
+    outFrameFill(dest->pFrame, dest->mem,
+        dest->pix_fmt, dest->width, dest->height, layout);
     unsigned char *yuvdata = (unsigned char *) yuv->pFrame->data[0];
-    unsigned char *destdata = (unsigned char *) dest->pFrame->data[0];
+    const FFColorMap *map = FFColorMap::get(fcol);
     if (pix_fmt == PIX_FMT_YUVJ420P) {
-        const unsigned char * colorMapY, * colorMapU, * colorMapV;
-        switch(_fcol) {
-            case 2:
-                colorMapY = IronColorY;
-                colorMapU = IronColorU;
-                colorMapV = IronColorV;
-                break;
-            default:
-                colorMapY = RainbowColorY;
-                colorMapU = RainbowColorU;
-                colorMapV = RainbowColorV;
-                break;
+        const unsigned char * colorMapY = map->y, * colorMapU = map->u, * colorMapV = map->v;
+        // fold the levels into the colour map
+        unsigned char mapY[256], mapU[256], mapV[256];
+        if (lut) {
+            for (int i = 0; i < 256; i++) {
+                mapY[i] = colorMapY[lut[i]];
+                mapU[i] = colorMapU[lut[i]];
+                mapV[i] = colorMapV[lut[i]];
+            }
+            colorMapY = mapY;
+            colorMapU = mapU;
+            colorMapV = mapV;
         }
         // Y planar data
         for (int h=0; h<dest->height; h++) {
             unsigned int line_start = yuv->pFrame->linesize[0] * h;
+            unsigned char *destdata = dest->pFrame->data[0] + dest->pFrame->linesize[0] * h;
             for (int w=0; w<dest->width; w++) {
                 *destdata++ = colorMapY[yuvdata[line_start + w]];
             }
@@ -449,30 +2423,33 @@ FFBuffer * ffmpegWidget::falseFrame(FFBuffer *src, PixelFormat pix_fmt) {
         // UV planar data
         for (int h=0; h<dest->height; h+=2) {
             unsigned int line_start = yuv->pFrame->linesize[0] * h;
+            unsigned char *destu = dest->pFrame->data[1] + dest->pFrame->linesize[1] * (h/2);
+            unsigned char *destv = dest->pFrame->data[2] + dest->pFrame->linesize[2] * (h/2);
             for (int w=0; w<dest->width; w+=2) {
                 unsigned char y = yuvdata[line_start + w];
-                destdata[h*dest->width/4 + w/2] = colorMapU[y];
-                destdata[dest->height*dest->width/4 + h*dest->width/4 + w/2] = colorMapV[y];
+                destu[w/2] = colorMapU[y];
+                destv[w/2] = colorMapV[y];
             }
         }
     } else {
         // fill in RGB data
-        const unsigned char * colorMapR, * colorMapG, * colorMapB;
-        switch(this->_fcol) {
-            case 2:
-                colorMapR = IronColorR;
-                colorMapG = IronColorG;
-                colorMapB = IronColorB;
-                break;
-            default:
-                colorMapR = RainbowColorR;
-                colorMapG = RainbowColorG;
-                colorMapB = RainbowColorB;
-                break;
+        const unsigned char * colorMapR = map->r, * colorMapG = map->g, * colorMapB = map->b;
+        // fold the levels into the colour map
+        unsigned char mapR[256], mapG[256], mapB[256];
+        if (lut) {
+            for (int i = 0; i < 256; i++) {
+                mapR[i] = colorMapR[lut[i]];
+                mapG[i] = colorMapG[lut[i]];
+                mapB[i] = colorMapB[lut[i]];
+            }
+            colorMapR = mapR;
+            colorMapG = mapG;
+            colorMapB = mapB;
         }
         // RGB packed data
         for (int h=0; h<dest->height; h++) {
             unsigned int line_start = yuv->pFrame->linesize[0] * h;
+            unsigned char *destdata = dest->pFrame->data[0] + dest->pFrame->linesize[0] * h;
             for (int w=0; w<dest->width; w++) {
                 *destdata++ = colorMapR[yuvdata[line_start + w]];
                 *destdata++ = colorMapG[yuvdata[line_start + w]];
@@ -487,12 +2464,24 @@ FFBuffer * ffmpegWidget::falseFrame(FFBuffer *src, PixelFormat pix_fmt) {
 }
 
 void ffmpegWidget::updateImage(FFBuffer *newbuf) {
+    // don't bother converting frames that nobody will see, these are just
+    // the stragglers that were decoded before the thread was paused
+    if (!_onScreen && newbuf) {
+        newbuf->release();
+        return;
+    }
+    // in replay mode the playhead decides what we show
+    if (_replay) {
+        if (newbuf) newbuf->release();
+        return;
+    }
     // calculate fps
     int elapsed = this->lastFrameTime->elapsed();
     // limit framerate in fallback mode
-    if (this->rawbuf && newbuf && this->xv_format < 0 && elapsed < 100) {
+    if (this->rawbuf && newbuf && this->renderer->backend() == BACKEND_QIMAGE && elapsed < 100) {
         this->limited = QString(" (limited)");
         if (newbuf) newbuf->release();
+        emit framesDroppedChanged(++_framesDropped);
         return;
     }
     this->lastFrameTime->start();
@@ -504,29 +2493,106 @@ void ffmpegWidget::updateImage(FFBuffer *newbuf) {
     emit fpsChanged(_fps);
     emit fpsChanged(QString("%1%2").arg(_fps, 0, 'f', 1).arg(this->limited));
     this->limited = QString("");
+    if (newbuf && newbuf->decodeUs > 0) {
+        _decodeTime += METRICSMOOTHING * (newbuf->decodeUs / 1000.0 - _decodeTime);
+        emit decodeTimeChanged(_decodeTime);
+    }
+    // the frame waiting to be converted will be replaced without being shown
+    if (newbuf && this->rawbuf && !this->rawConverted) {
+        emit framesDroppedChanged(++_framesDropped);
+    }
 
     // store the buffer
     if (this->rawbuf) this->rawbuf->release();    
     this->rawbuf = newbuf;
+    this->rawConverted = false;
     
     // if blank then just do an update
     if (newbuf == NULL) {
         // release any full frame we might have
         if (this->fullbuf) this->fullbuf->release();        
         this->fullbuf = NULL;
+        this->xv_front_valid = false;
+        // and throw away any conversion in progress
+        this->frameSeq++;
         // update the screen to blank it
         update();
         return;
     }    
+
+    // pick a decode resolution to suit our size
+    updateLowres();
     
-    // make the frame the right format
+    // make the frame the right format on the conversion pool
     makeFullFrame();            
+    makeStats();
+}
+
+// called in the GUI thread when the conversion pool has finished a frame
+void ffmpegWidget::frameConverted() {
+    this->jobMutex->lock();
+    FFBuffer *newfull = this->converted;
+    int seq = this->convertedSeq;
+    int us = this->convertedUs;
+    qint64 ms = this->convertedMs;
+    bool filled = this->convertedXv;
+    this->converted = NULL;
+    this->jobMutex->unlock();
+    this->converting = false;
+
+    // keep the metrics up to date
+    _convertTime += METRICSMOOTHING * (us / 1000.0 - _convertTime);
+    emit convertTimeChanged(_convertTime);
+    _poolUsage = memoryUsage();
+    emit poolUsageChanged(_poolUsage);
+
+    if (newfull == NULL) {
+        printf("Couldn't get a free buffer, skipping frame\n");
+    } else if (seq != this->frameSeq) {
+        // stream was blanked while we were converting
+        newfull->release();
+        newfull = NULL;
+    } else {
+        // release any full frame we might have
+        if (this->fullbuf) this->fullbuf->release();
+        this->fullbuf = newfull;
+        this->fullMs = ms;
+        this->panValid = false;
+        // the back image has it too, so put it on screen, unless we've
+        // changed backend since and freed them
+        filled = filled && this->xv_shm_images[0];
+        if (filled) this->xv_front = 1 - this->xv_front;
+        this->xv_front_valid = filled;
+        // the null backend takes it now, there's nothing to paint
+        this->renderer->frame(newfull);
+        if (this->renderer->backend() == BACKEND_NULL) frameShown();
+    }
+
+    // make the shared images match the frames we are getting, the next
+    // conversion will fill one in
+    if (this->renderer->backend() == BACKEND_XVSHM && this->fullbuf && !filled && this->fullbuf->pix_fmt == PIX_FMT_YUVJ420P &&
+            (this->xv_shm_images[0] == NULL ||
+             this->xv_shm_images[0]->width != this->fullbuf->width ||
+             this->xv_shm_images[0]->height != this->fullbuf->height)) {
+        xvAlloc(this->fullbuf->width, this->fullbuf->height);
+    }
+
+    // a newer frame or different settings arrived while we were busy
+    if (this->convertAgain) {
+        this->convertAgain = false;
+        makeFullFrame();
+    }
+    if (newfull == NULL) return;
+
+    // frames turned before the orientation last changed may still arrive,
+    // so keep track of which way up the image size is
+    _imOrient = this->fullbuf->orient;
 
     // if width and height changes then make sure we zoom onto it
-    if (this->fullbuf && (_imW != this->fullbuf->width || _imH != this->fullbuf->height)) {
-        _imW = this->fullbuf->width;
+    if (this->fullbuf && (_imW != this->fullbuf->fullW || _imH != this->fullbuf->fullH)) {
+        _imW = this->fullbuf->fullW;
         emit imWChanged(_imW);
-        _imH = this->fullbuf->height;
+        _imH = this->fullbuf->fullH;
         emit imHChanged(_imH);
         /* Zoom so it fills the viewport */
         disableUpdates = true;
@@ -580,6 +2646,7 @@ void ffmpegWidget::updateScalefactor() {
     /* Now work out our real scale factors */
     this->sfx = _scVisW / (double) _visW;
     this->sfy = _scVisH / (double) _visH;      
+    this->panValid = false;
     /* Now work out max x and y */;
     int maxX = qMax(_imW - _visW, 0);
     int maxY = qMax(_imH - _visH, 0);
@@ -595,13 +2662,8 @@ void ffmpegWidget::updateScalefactor() {
         setY(qMin(_y, _maxY));
     }
     disableUpdates = false;
-    /* Now make an image */
-    if (this->xv_format >= 0) {
-        // xvideo supported
-        if (this->xv_image) XFree(this->xv_image);
-        this->xv_image = XvCreateImage(this->dpy, this->xv_port,
-            this->xv_format, 0, _imW, _imH);
-        assert(this->xv_image);
+    /* The image is made to suit each frame in paintEvent */
+    if (this->renderer->onWindow()) {
         /* Clear area not filled by image */
         if (_scVisW < this->widgetW) {
             XClearArea(dpy, w, _scVisW, 0, this->widgetW-_scVisW, this->widgetH, 0);
@@ -612,182 +2674,895 @@ void ffmpegWidget::updateScalefactor() {
     }
 }
 
+// make a front and back shared memory image for frames of this size
+void ffmpegWidget::xvAlloc(int width, int height) {
+    xvFree();
+    for (int i = 0; i < 2; i++) {
+        XvImage *img = XvShmCreateImage(this->dpy, this->xv_port, this->xv_format,
+            NULL, width, height, &this->xv_shminfo[i]);
+        if (img == NULL) break;
+        this->xv_shminfo[i].shmid = shmget(IPC_PRIVATE, img->data_size, IPC_CREAT | 0600);
+        if (this->xv_shminfo[i].shmid < 0) {
+            XFree(img);
+            break;
+        }
+        img->data = (char *) shmat(this->xv_shminfo[i].shmid, NULL, 0);
+        // it goes away when both we and the server have detached
+        shmctl(this->xv_shminfo[i].shmid, IPC_RMID, NULL);
+        if (img->data == (char *) -1) {
+            XFree(img);
+            break;
+        }
+        this->xv_shminfo[i].shmaddr = img->data;
+        this->xv_shminfo[i].readOnly = False;
+        if (!attachShm(this->dpy, &this->xv_shminfo[i])) {
+            shmdt(img->data);
+            XFree(img);
+            break;
+        }
+        this->xv_shm_images[i] = img;
+    }
+    if (this->xv_shm_images[1] == NULL) {
+        printf("Couldn't make shared memory xv images, not using them\n");
+        xvFree();
+        this->xv_shm = false;
+        pickRenderer();
+    }
+}
+
+// free the shared memory images, the conversion must not be using them
+void ffmpegWidget::xvFree() {
+    for (int i = 0; i < 2; i++) {
+        if (this->xv_shm_images[i] == NULL) continue;
+        XShmDetach(this->dpy, &this->xv_shminfo[i]);
+        XFree(this->xv_shm_images[i]);
+        shmdt(this->xv_shminfo[i].shmaddr);
+        this->xv_shm_images[i] = NULL;
+    }
+    this->xv_front = 0;
+    this->xv_front_valid = false;
+}
+
+// queue a conversion of rawbuf on the shared pool
 void ffmpegWidget::makeFullFrame() {
-    PixelFormat pix_fmt;    
+    FFConvertParams params;
 
     // make sure we have a raw buffer    
     if (this->rawbuf == NULL || this->rawbuf->width <= 0 || this->rawbuf->height <= 0) {
         return;
     }
 
-    // if we have a raw buffer then decompress it
+    // only one conversion at a time, we'll do the latest frame afterwards
+    if (this->converting) {
+        this->convertAgain = true;
+        return;
+    }
+
+    // if we've got an image that's too big, bin or crop it to fit
+    params.pix_fmt = renderFormat();
+    pickView(params);
+
+    // fill in the back shared image while the front one is on screen,
+    // making sure the server has finished reading it since the last swap
+    params.xvback = NULL;
+    if (this->renderer->backend() == BACKEND_XVSHM && this->xv_shm_images[0]) {
+        XSync(this->dpy, False);
+        params.xvback = this->xv_shm_images[1 - this->xv_front];
+    }
+    // plain xvideo can take the frame without repacking it if it is laid
+    // out like xv_image, which paintXv makes to suit the last frame
+    params.xvLayout.width = 0;
+    params.xvLayout.height = 0;
+    if (this->renderer->backend() == BACKEND_XV && this->xv_image) {
+        params.xvLayout.width = this->xv_image->width;
+        params.xvLayout.height = this->xv_image->height;
+        params.xvLayout.size = this->xv_image->data_size;
+        for (int p = 0; p < 3; p++) {
+            params.xvLayout.pitches[p] = p < this->xv_image->num_planes ? this->xv_image->pitches[p] : 0;
+            params.xvLayout.offsets[p] = p < this->xv_image->num_planes ? this->xv_image->offsets[p] : 0;
+        }
+    }
+
+    // take a copy of everything the conversion needs
+    params.fcol = _fcol;
+    // the grid is drawn over the frame when it is painted
+    params.grid = false;
+    params.gx = _gx;
+    params.gy = _gy;
+    params.gs = _gs;
+    params.gcol = _gcol;
+    params.sfx = this->sfx;
+    params.cpus = _convertCpus;
+    params.seq = this->frameSeq;
+    params.background = NULL;
+    params.bgGain = (int) (_subtractGain * 256 + 0.5);
+    params.bgOffset = _subtractOffset;
+    params.autoLevel = _autoLevel;
+    params.updateLevels = true;
+    params.windowLow = _level - _window / 2;
+    params.windowWidth = _window;
+    if (_subtract && this->background) {
+        params.background = this->background;
+        params.background->reserve();
+    }
+
+    // the job holds a reference to the raw buffer until it is done
     this->rawbuf->reserve();
+    this->rawConverted = true;
+    this->converting = true;
+    this->jobMutex->lock();
+    this->jobRunning = true;
+    this->jobMutex->unlock();
+    conversionPool()->start(new FFConvertJob(this, this->rawbuf, params));
+}
 
-    // if we've got an image that's too big, force RGB
-    if (this->ff_fmt == PIX_FMT_YUVJ420P && (this->rawbuf->width > maxW || this->rawbuf->height > maxH)) {
-        printf("Image too big, using QImage fallback mode\n");
-        pix_fmt = PIX_FMT_RGB24;
+/* Pick the part of rawbuf to show when it is bigger than the xvideo adaptor
+ * can take. If the visible region fits we crop the frame around it at full
+ * resolution, otherwise we bin the whole frame by a power of 2 until it fits
+ */
+void ffmpegWidget::pickView(FFConvertParams &params) {
+    params.viewX = 0;
+    params.viewY = 0;
+    params.viewW = 0;
+    params.viewH = 0;
+    params.bin = 1;
+    const int w = this->rawbuf->width - this->rawbuf->width % 8;
+    const int h = this->rawbuf->height - this->rawbuf->height % 2;
+    if (!usingXv() || (w <= maxW && h <= maxH)) return;
+    if (_visW > 0 && _visH > 0 && _visW <= maxW && _visH <= maxH && canCrop(this->rawbuf->pix_fmt)) {
+        // as big a crop as we can, centred on the visible region
+        params.viewW = qMin(w, maxW - maxW % 8);
+        params.viewH = qMin(h, maxH - maxH % 2);
+        params.viewX = qBound(0, _x + _visW / 2 - params.viewW / 2, w - params.viewW) & ~3;
+        params.viewY = qBound(0, _y + _visH / 2 - params.viewH / 2, h - params.viewH) & ~3;
     } else {
-        pix_fmt = this->ff_fmt;
+        params.viewW = w;
+        params.viewH = h;
+        params.bin = 2;
+        while (w / params.bin > maxW || h / params.bin > maxH) params.bin *= 2;
     }
+}
 
-    // release any full frame we might have
-    if (this->fullbuf) this->fullbuf->release();
+// runs on the conversion pool, hands the result back to the GUI thread
+void ffmpegWidget::runConversion(FFBuffer *src, const FFConvertParams &params) {
+    int64_t start = av_gettime();
+    FFBuffer *dest = this->convertFrame(src, params, &this->ctx);
+    if (params.background) params.background->release();
+    this->jobMutex->lock();
+    if (this->converted) this->converted->release();
+    this->converted = dest;
+    this->convertedSeq = params.seq;
+    this->convertedXv = dest && copyToXvImage(dest, params.xvback);
+    this->convertedUs = (int) (av_gettime() - start);
+    this->convertedMs = src->ms;
+    src->release();
+    QMetaObject::invokeMethod(this, "frameConverted", Qt::QueuedConnection);
+    this->jobRunning = false;
+    this->jobDone->wakeAll();
+    this->jobMutex->unlock();
+}
+
+// runs on the snapshot pool, writes src to filename in the requested format
+void ffmpegWidget::runSnapshot(FFBuffer *src, const QString &filename,
+        const QString &format, bool processed, const FFConvertParams &params) {
+    FFBuffer *img = src;
+    struct SwsContext *sws = NULL;
+    bool ok = false;
+    if (processed) {
+        // false colour it and burn in the grid just like the display does
+        img = this->convertFrame(src, params, &sws);
+        if (sws) sws_freeContext(sws);
+    }
+    if (img) {
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(img->pix_fmt);
+        bool grey = desc && desc->nb_components == 1;
+        bool deep = desc && desc->comp[0].depth_minus1 >= 8;
+        if (format == "raw") {
+            ok = writeRaw(img, filename);
+        } else if (format == "tiff") {
+            ok = writeEncoded(img, AV_CODEC_ID_TIFF,
+                grey ? PIX_FMT_GRAY16LE : PIX_FMT_RGB48LE, filename);
+        } else {
+            ok = writeEncoded(img, AV_CODEC_ID_PNG, grey ?
+                (deep ? PIX_FMT_GRAY16BE : PIX_FMT_GRAY8) :
+                (deep ? PIX_FMT_RGB48BE : PIX_FMT_RGB24), filename);
+        }
+    }
+    if (ok) {
+        printf("Saved snapshot to %s\n", filename.toLocal8Bit().data());
+        emit snapshotSaved(filename);
+    } else {
+        printf("Couldn't save snapshot to %s\n", filename.toLocal8Bit().data());
+    }
+    if (img && img != src) img->release();
+    src->release();
+    if (params.background) params.background->release();
+    this->jobMutex->lock();
+    this->snapshotsRunning--;
+    this->jobDone->wakeAll();
+    this->jobMutex->unlock();
+}
+
+// queue stats on rawbuf on the shared pool, skipping frames while it's busy
+void ffmpegWidget::makeStats() {
+    if (!_stats || this->rawbuf == NULL || this->statsRunning) return;
+    FFStatsParams params;
+    params.x = _roiX;
+    params.y = _roiY;
+    params.w = _roiW;
+    params.h = _roiH;
+    params.gx = _gx;
+    params.gy = _gy;
+    params.threshold = _threshold;
+    params.cpus = _convertCpus;
+    this->rawbuf->reserve();
+    this->jobMutex->lock();
+    this->statsRunning = true;
+    this->jobMutex->unlock();
+    conversionPool()->start(new FFStatsJob(this, this->rawbuf, params));
+}
+
+// runs on the conversion pool, hands the stats back to the GUI thread
+void ffmpegWidget::runStats(FFBuffer *src, const FFStatsParams &params) {
+    FFStats *s = NULL;
+    // deep mono frames give stats in the units of their samples, with the
+    // threshold scaled from 0-255 to their range
+    const bool deep = isDeepGray(src->pix_fmt);
+    if ((hasLumaPlane(src->pix_fmt) || deep) && src->width > 0 && src->height > 0) {
+        s = new FFStats;
+        const int ls = src->pFrame->linesize[0];
+        const unsigned char *luma = src->pFrame->data[0];
+        // clip the roi to the frame
+        int x0 = qBound(0, params.x, src->width - 1);
+        int y0 = qBound(0, params.y, src->height - 1);
+        int w = (params.w > 0) ? qMin(params.w, src->width - x0) : src->width - x0;
+        int h = (params.h > 0) ? qMin(params.h, src->height - y0) : src->height - y0;
+        // sub-sample big regions so the cost is bounded
+        int step = 1;
+        while ((qint64) w * h > (qint64) STATSSAMPLES * step * step) step++;
+        int nx = (w + step - 1) / step;
+        int ny = (h + step - 1) / step;
+        QVector<unsigned int> colSum(nx, 0);
+        QVector<unsigned int> rowSum(ny, 0);
+        QVector<unsigned int> colWeight(nx, 0);
+        QVector<unsigned int> rowWeight(ny, 0);
+        unsigned char threshold = qBound(0, params.threshold, 255);
+        QVector<unsigned char> tmp(nx);
+        s->histogram = QVector<int>(256, 0);
+        s->projY.resize(ny);
+        unsigned char lo = 255, hi = 0;
+        int deepLo = 65535, deepHi = 0;
+        qint64 total = 0;
+        for (int j = 0; j < ny; j++) {
+            if (deep) {
+                rowSum[j] = statsRowDeep((const quint16 *) (luma + (y0 + j * step) * ls) + x0,
+                    nx, step, isSwappedGray(src->pix_fmt), threshold * 257u, colSum.data(),
+                    colWeight.data(), &rowWeight[j], &deepLo, &deepHi, s->histogram.data());
+                s->projY[j] = rowSum[j];
+                total += rowSum[j];
+                continue;
+            }
+            const unsigned char *row = luma + (y0 + j * step) * ls + x0;
+            if (step > 1) {
+                for (int i = 0; i < nx; i++) tmp[i] = row[i * step];
+                row = tmp.constData();
+            }
+            rowSum[j] = statsRow(row, nx, colSum.data(), &lo, &hi);
+            if (threshold) rowWeight[j] = weightRow(row, nx, threshold, colWeight.data());
+            for (int i = 0; i < nx; i++) s->histogram[row[i]]++;
+            s->projY[j] = rowSum[j];
+            total += rowSum[j];
+        }
+        s->projX.resize(nx);
+        for (int i = 0; i < nx; i++) s->projX[i] = colSum[i];
+        s->min = deep ? deepLo : lo;
+        s->max = deep ? deepHi : hi;
+        s->mean = total / (double) nx / ny;
+        // centroid and rms size from the thresholded projections
+        double mx, my, sx, sy;
+        projectionMoments(threshold ? colWeight : colSum, &mx, &sx);
+        projectionMoments(threshold ? rowWeight : rowSum, &my, &sy);
+        s->cx = x0 + step * mx;
+        s->cy = y0 + step * my;
+        s->sx = step * sx;
+        s->sy = step * sy;
+        s->step = step;
+        // line profiles through the crosshair at full resolution
+        int gx = qBound(0, params.gx, src->width - 1);
+        int gy = qBound(0, params.gy, src->height - 1);
+        s->profileX.resize(src->width);
+        for (int i = 0; i < src->width; i++) s->profileX[i] = lumaAt(src, i, gy);
+        s->profileY.resize(src->height);
+        for (int j = 0; j < src->height; j++) s->profileY[j] = lumaAt(src, gx, j);
+    }
+    src->release();
+    this->jobMutex->lock();
+    delete this->statsResult;
+    this->statsResult = s;
+    QMetaObject::invokeMethod(this, "statsDone", Qt::QueuedConnection);
+    this->statsRunning = false;
+    this->jobDone->wakeAll();
+    this->jobMutex->unlock();
+}
+
+// called in the GUI thread when the pool has finished the stats
+void ffmpegWidget::statsDone() {
+    this->jobMutex->lock();
+    FFStats *s = this->statsResult;
+    this->statsResult = NULL;
+    this->jobMutex->unlock();
+    if (s == NULL) return;
+    if (_roiMin != s->min) {
+        _roiMin = s->min;
+        emit roiMinChanged(_roiMin);
+        emit roiMinChanged(QString("%1").arg(_roiMin));
+    }
+    if (_roiMax != s->max) {
+        _roiMax = s->max;
+        emit roiMaxChanged(_roiMax);
+        emit roiMaxChanged(QString("%1").arg(_roiMax));
+    }
+    _roiMean = s->mean;
+    emit roiMeanChanged(_roiMean);
+    emit roiMeanChanged(QString("%1").arg(_roiMean, 0, 'f', 1));
+    _centroidX = s->cx;
+    emit centroidXChanged(_centroidX);
+    emit centroidXChanged(QString("%1").arg(_centroidX, 0, 'f', 1));
+    _centroidY = s->cy;
+    emit centroidYChanged(_centroidY);
+    emit centroidYChanged(QString("%1").arg(_centroidY, 0, 'f', 1));
+    _sigmaX = s->sx;
+    emit sigmaXChanged(_sigmaX);
+    emit sigmaXChanged(QString("%1").arg(_sigmaX, 0, 'f', 1));
+    _sigmaY = s->sy;
+    emit sigmaYChanged(_sigmaY);
+    emit sigmaYChanged(QString("%1").arg(_sigmaY, 0, 'f', 1));
+    if (_followCentroid) {
+        // move the crosshair onto the beam
+        setGx((int) (_centroidX + 0.5));
+        setGy((int) (_centroidY + 0.5));
+    }
+    emit projectionXChanged(s->projX);
+    emit projectionYChanged(s->projY);
+    emit profileXChanged(s->profileX);
+    emit profileYChanged(s->profileY);
+    emit histogramChanged(s->histogram);
+    delete s;
+}
+
+// convert a raw frame into something we can display, runs on the pool
+FFBuffer * ffmpegWidget::convertFrame(FFBuffer *src, const FFConvertParams &params, struct SwsContext **sws) {
+    FFBuffer *dest;
+    const int fullW = src->width - src->width % 8;
+    const int fullH = src->height - src->height % 2;
+    const int orient = src->orient;
+
+    // Subtract the background into a buffer of our own, as the raw frame
+    // may be converted again. Deep mono frames are subtracted before the
+    // window so none of their range is lost
+    FFBuffer *sub = NULL;
+    if (params.background) {
+        sub = subtractBackground(src, params.background, params.bgGain, params.bgOffset);
+        if (sub) src = sub;
+    }
+
+    // Map deep mono frames to 8-bits through the window, everything after
+    // this works on an 8-bit luma plane
+    FFBuffer *windowed = NULL;
+    if (isDeepGray(src->pix_fmt)) {
+        windowed = windowFrame(src, params.windowLow, params.windowWidth);
+        if (windowed) src = windowed;
+    }
+
+    // Cut an oversize frame down to what the xvideo adaptor can show
+    FFBuffer *reduced = NULL;
+    if (params.viewW > 0) {
+        reduced = reduceFrame(src, params);
+        if (reduced) src = reduced;
+    }
+
+    // Pick the levels from this frame, they only go into the lookup tables
+    unsigned char lutData[256];
+    const unsigned char *lut = NULL;
+    if (params.autoLevel && hasLumaPlane(src->pix_fmt)) {
+        if (params.updateLevels) this->levels->update(src);
+        this->levels->copyLut(lutData);
+        lut = lutData;
+    }
 
     // Format the decoded frame as we've been asked        
-    if (_fcol) {
+    if (params.fcol) {
         // make it false colour
-        this->fullbuf = this->falseFrame(this->rawbuf, pix_fmt);
+        dest = this->falseFrame(src, params.pix_fmt, params.fcol, lut, sws, &params.xvLayout);
     } else {
+        // there's no colour map to fold the levels into, so map the luma
+        FFBuffer *mapped = lut ? mapLuma(src, lut) : NULL;
         // pass out frame through sw_scale
-        this->fullbuf = this->formatFrame(this->rawbuf, pix_fmt);
+        dest = this->formatFrame(mapped ? mapped : src, params.pix_fmt, sws, &params.xvLayout);
+        if (mapped) mapped->release();
     }
-    this->rawbuf->release();  
+    if (windowed) windowed->release();
+    if (sub) sub->release();
+    if (reduced) reduced->release();
 
     // Check we got a buffer
-    if (this->fullbuf == NULL) {
-        printf("Couldn't get a free buffer, skipping frame\n");
-        return;
-    }    
+    if (dest == NULL) return NULL;
+    dest->bin = reduced ? params.bin : 1;
+    dest->offX = reduced ? params.viewX : 0;
+    dest->offY = reduced ? params.viewY : 0;
+    dest->fullW = reduced ? fullW : dest->width;
+    dest->fullH = reduced ? fullH : dest->height;
+    dest->orient = orient;
       
     // draw the grid if asked to
-#define overlayYPixel                 i = gsy * _imW + gsx; \
+#define overlayYPixel                 i = gsy * yls + gsx; \
                 yFrame[i] = (yFrame[i] * 4 + Y)/5
-#define overlayUVPixel                 i = gsy * _imW/4 + gsx/2; \
+#define overlayUVPixel                 i = (gsy/2) * uvls + gsx/2; \
                 uFrame[i] = (uFrame[i] * 4 + U)/5; \
                 vFrame[i] = (vFrame[i] * 4 + V)/5   
 
-    // draw grid straight on image if xvideo
-    if (_grid && this->xv_format >= 0 && _gs > 0) {
-        unsigned char Y = (unsigned char) (0.299 * _gcol.red() + 0.587 * _gcol.green() + 0.114 * _gcol.blue());
-        unsigned char U = (unsigned char) (-0.169 * _gcol.red() - 0.331 * _gcol.green() + 0.499 * _gcol.blue() + 128);
-        unsigned char V = (unsigned char) (0.499 * _gcol.red() - 0.418 * _gcol.green() - 0.0813 * _gcol.blue() + 128);
-        unsigned char *yFrame = this->fullbuf->pFrame->data[0];        
-        unsigned char *uFrame = this->fullbuf->pFrame->data[0] + _imW * _imH;
-        unsigned char *vFrame = this->fullbuf->pFrame->data[0] + _imW * _imH * 5 / 4; 
+    // burn the grid into snapshots, in the pixels of dest which may be a
+    // binned or cropped part of the frame
+    const int bin = dest->bin;
+    if (params.grid && dest->pix_fmt == PIX_FMT_YUVJ420P && params.gs >= bin) {
+        const int imW = dest->width;
+        const int imH = dest->height;
+        const int gx = (params.gx - dest->offX) / bin;
+        const int gy = (params.gy - dest->offY) / bin;
+        const int gs = params.gs / bin;
+        const QColor &gcol = params.gcol;
+        const int yls = dest->pFrame->linesize[0];
+        const int uvls = dest->pFrame->linesize[1];
+        unsigned char Y = (unsigned char) (0.299 * gcol.red() + 0.587 * gcol.green() + 0.114 * gcol.blue());
+        unsigned char U = (unsigned char) (-0.169 * gcol.red() - 0.331 * gcol.green() + 0.499 * gcol.blue() + 128);
+        unsigned char V = (unsigned char) (0.499 * gcol.red() - 0.418 * gcol.green() - 0.0813 * gcol.blue() + 128);
+        unsigned char *yFrame = dest->pFrame->data[0];        
+        unsigned char *uFrame = dest->pFrame->data[1];
+        unsigned char *vFrame = dest->pFrame->data[2]; 
         int i;                  
         int gridw = 1;
-        if (this->sfx > 0) gridw = qMax((int) (0.5 + 1 / this->sfx), 1);
+        if (params.sfx > 0) gridw = qMax((int) (0.5 + 1 / (params.sfx * bin)), 1);
+        // the crosshair may be off a cropped image, so start the minor
+        // lines and clip the major ones to what is on it
+        int xl = gx - gs, xr = gx + gs, yu = gy - gs, yd = gy + gs;
+        if (xl >= imW) xl -= ((xl - imW) / gs + 1) * gs;
+        if (xr < 0) xr += ((-xr - 1) / gs + 1) * gs;
+        if (yu >= imH) yu -= ((yu - imH) / gs + 1) * gs;
+        if (yd < 0) yd += ((-yd - 1) / gs + 1) * gs;
+        const int gx0 = qMax((int) (gx + 0.5 - gridw/2.0), 0);
+        const int gx1 = qMin((int) ceil(gx - 0.1 + gridw/2.0), imW);
+        const int gy0 = qMax((int) (gy + 0.5 - gridw/2.0), 0);
+        const int gy1 = qMin((int) ceil(gy - 0.1 + gridw/2.0), imH);
         // X Lines           
         // Intensity data
-        for (int gsy = 0; gsy < _imH; gsy += 1) {
+        for (int gsy = 0; gsy < imH; gsy += 1) {
             // X Minors
-            for (int gsx = _gx - _gs; gsx > 0; gsx -= _gs) {
+            for (int gsx = xl; gsx > 0; gsx -= gs) {
                 overlayYPixel;
             }
-            for (int gsx = _gx + _gs; gsx < _imW; gsx += _gs) {
+            for (int gsx = xr; gsx < imW; gsx += gs) {
                 overlayYPixel;
             }
             // X Major
-            for (int gsx = (int) (_gx + 0.5 - gridw/2.0); gsx < _gx - 0.1 + gridw/2.0; gsx++) {
-                yFrame[gsy * _imW + gsx] = Y;            
+            for (int gsx = gx0; gsx < gx1; gsx++) {
+                yFrame[gsy * yls + gsx] = Y;            
             }
         }             
         // UV data
-        for (int gsy = 0; gsy < _imH; gsy += 2) {
+        for (int gsy = 0; gsy < imH; gsy += 2) {
             // X Minors
-            for (int gsx = _gx - _gs; gsx > 0; gsx -= _gs) {
+            for (int gsx = xl; gsx > 0; gsx -= gs) {
                 overlayUVPixel;
             }
-            for (int gsx = _gx + _gs; gsx < _imW; gsx += _gs) {
+            for (int gsx = xr; gsx < imW; gsx += gs) {
                 overlayUVPixel;
             }
             // X Major
-            i = gsy * _imW/4 + _gx/2;            
-            uFrame[i] = (uFrame[i] + U)/2;
-            vFrame[i] = (vFrame[i] + V)/2;                                    
+            if (gx >= 0 && gx < imW) {
+                i = (gsy/2) * uvls + gx/2;            
+                uFrame[i] = (uFrame[i] + U)/2;
+                vFrame[i] = (vFrame[i] + V)/2;                                    
+            }
         }    
         // Y Lines        
         // Intensity data
-        for (int gsx = 0; gsx < _imW; gsx += 1) {
-            for (int gsy = _gy - _gs; gsy > 0; gsy -= _gs) {
+        for (int gsx = 0; gsx < imW; gsx += 1) {
+            for (int gsy = yu; gsy > 0; gsy -= gs) {
                 overlayYPixel;
             }
-            for (int gsy = _gy + _gs; gsy < _imH; gsy += _gs) {
+            for (int gsy = yd; gsy < imH; gsy += gs) {
                 overlayYPixel;
             }
-            for (int gsy = (int) (_gy + 0.5 - gridw/2.0); gsy < _gy - 0.1 + gridw/2.0; gsy++) {
-                yFrame[gsy * _imW + gsx] = Y;            
+            for (int gsy = gy0; gsy < gy1; gsy++) {
+                yFrame[gsy * yls + gsx] = Y;            
             }                    
         }             
         // UV data
-        for (int gsx = 0; gsx < _imW; gsx += 2) {
-            for (int gsy = _gy - _gs; gsy > 0; gsy -= _gs) {
+        for (int gsx = 0; gsx < imW; gsx += 2) {
+            for (int gsy = yu; gsy > 0; gsy -= gs) {
                 overlayUVPixel;
             }
-            for (int gsy = _gy + _gs; gsy < _imH; gsy += _gs) {
+            for (int gsy = yd; gsy < imH; gsy += gs) {
                 overlayUVPixel;
             }
-            i = ((int)(_gy/2)) * _imW/2 + gsx/2;
-            uFrame[i] = (uFrame[i] + U)/2;
-            vFrame[i] = (vFrame[i] + V)/2;                                    
+            if (gy >= 0 && gy < imH) {
+                i = (gy/2) * uvls + gsx/2;
+                uFrame[i] = (uFrame[i] + U)/2;
+                vFrame[i] = (vFrame[i] + V)/2;                                    
+            }
         }             
-    }    
+    }
+    return dest;
+}
+
+void ffmpegWidget::paintEvent(QPaintEvent *event) {
+    // the null backend takes frames as they are converted
+    if (this->renderer->backend() == BACKEND_NULL) return;
+    // check we have a full buffer
+    if (this->fullbuf == NULL || this->fullbuf->width <= 0 || this->fullbuf->height <= 0) {
+        if (this->renderer->onWindow()) {
+            // nothing else will clear the window
+            XClearArea(this->dpy, this->w, 0, 0, this->widgetW, this->widgetH, 0);
+        }
+        return;
+    }
+    // If scale factors have changed
+    if (this->widgetW != width() || this->widgetH != height()) {
+        updateScalefactor();
+    }
+    FFBuffer * cachedFull = this->fullbuf;
+    cachedFull->reserve();    
+    if (cachedFull->pix_fmt != renderFormat()) {
+        // converted for a different backend, wait for the next one
+        if (!this->converting) makeFullFrame();
+    } else {
+        int64_t start = av_gettime();
+        bool ok = this->renderer->paint(cachedFull, event->rect());
+        _renderTime += METRICSMOOTHING * ((av_gettime() - start) / 1000.0 - _renderTime);
+        emit renderTimeChanged(_renderTime);
+        // it doesn't work on this display after all, so use another
+        if (!ok) pickRenderer();
+        else frameShown();
+    }
+    cachedFull->release();
+}
+
+// fullbuf has just been drawn, the first time this happens for a frame
+// is how long it took from its packet arriving to the screen
+void ffmpegWidget::frameShown() {
+    if (this->fullMs <= 0) return;
+    _latency += METRICSMOOTHING * (QDateTime::currentMSecsSinceEpoch() - this->fullMs - _latency);
+    emit latencyChanged(_latency);
+    this->fullMs = 0;
+}
+
+// put buf on screen with xvideo, from a shared image if it is in one
+void ffmpegWidget::paintXv(FFBuffer *buf) {
+    // xvideo supported, the frame may be a binned or cropped part of
+    // the image so work out which bit of it we can see
+    const int bin = buf->bin;
+    const int srcX = qBound(0, (_x - buf->offX) / bin, buf->width);
+    const int srcY = qBound(0, (_y - buf->offY) / bin, buf->height);
+    const int srcW = qMin(_visW / bin, buf->width - srcX);
+    const int srcH = qMin(_visH / bin, buf->height - srcY);
+    // if we've zoomed or panned off what we converted, convert again
+    if (this->rawbuf && !this->converting) {
+        FFConvertParams want;
+        want.pix_fmt = buf->pix_fmt;
+        pickView(want);
+        bool stale = want.bin != bin;
+        if (!stale && bin == 1) {
+            stale = _x < buf->offX || _y < buf->offY ||
+                _x + _visW > buf->offX + buf->width ||
+                _y + _visH > buf->offY + buf->height;
+        }
+        if (stale) makeFullFrame();
+    }
+    if (this->xv_front_valid) {
+        /* Draw the image the server can read straight from memory */
+        XvShmPutImage(this->dpy, this->xv_port, this->w, this->gc,
+            this->xv_shm_images[this->xv_front],
+            srcX, srcY, srcW, srcH, 0, 0, _scVisW, _scVisH, False);
+    } else {
+        if (this->xv_image == NULL || this->xv_image->width != buf->width ||
+                this->xv_image->height != buf->height) {
+            if (this->xv_image) XFree(this->xv_image);
+            this->xv_image = XvCreateImage(this->dpy, this->xv_port,
+                this->xv_format, 0, buf->width, buf->height);
+            assert(this->xv_image);
+        }
+        // makeFullFrame asks for frames laid out like xv_image, so only the
+        // first after a size change should need packing the way it expects
+        bool packed = true;
+        for (int p = 0; p < this->xv_image->num_planes && p < 3; p++) {
+            packed = packed && buf->pFrame->linesize[p] == this->xv_image->pitches[p] &&
+                buf->pFrame->data[p] == buf->pFrame->data[0] + this->xv_image->offsets[p];
+        }
+        if (packed) {
+            this->xv_image->data = (char *) buf->pFrame->data[0];
+        } else {
+            this->xv_packed.resize(this->xv_image->data_size);
+            this->xv_image->data = this->xv_packed.data();
+            copyToXvImage(buf, this->xv_image);
+        }
+        /* Draw the image */
+        XvPutImage(this->dpy, this->xv_port, this->w, this->gc, this->xv_image,
+            srcX, srcY, srcW, srcH, 0, 0, _scVisW, _scVisH);
+    }
+    /* Draw the grid over it, at the scale the server stretched it to */
+    if (srcW > 0 && srcH > 0) {
+        const double sx = _scVisW / (double) (srcW * bin);
+        const double sy = _scVisH / (double) (srcH * bin);
+        paintXvOverlay(sx, sy, (buf->offX + srcX * bin) * sx, (buf->offY + srcY * bin) * sy);
+    }
+}
+
+// positions of the minor lines spaced s apart either side of the crosshair
+// at c that are on a screen n pixels across, skipping any off it
+static void minorPositions(double c, double s, int n, QVector<int> &pos) {
+    for (int k = qMax(1, (int) ceil((c - n) / s)); c - k * s > 0; k++) {
+        pos.append((int) (c - k * s + 0.5));
+    }
+    for (int k = qMax(1, (int) ceil(-c / s)); c + k * s < n; k++) {
+        pos.append((int) (c + k * s + 0.5));
+    }
+}
+
+void ffmpegWidget::overlayLines(double sx, double sy, double ox, double oy,
+        QVector<QLine> &major, QVector<QLine> &minor) {
+    // note the 0.5 gives us the middle of the pixel
+    const double scGx = (_gx + 0.5) * sx - ox;
+    const double scGy = (_gy + 0.5) * sy - oy;
+    const double scGsx = _gs * sx;
+    const double scGsy = _gs * sy;
+    // minor lines, unless they're so close they'd wash out the picture
+    if (scGsx >= OVERLAYMINSPACING && scGsy >= OVERLAYMINSPACING) {
+        QVector<int> pos;
+        minorPositions(scGx, scGsx, _scVisW, pos);
+        for (int i = 0; i < pos.size(); i++) {
+            minor.append(QLine(pos[i], 0, pos[i], _scVisH));
+        }
+        pos.clear();
+        minorPositions(scGy, scGsy, _scVisH, pos);
+        for (int i = 0; i < pos.size(); i++) {
+            minor.append(QLine(0, pos[i], _scVisW, pos[i]));
+        }
+    }
+    // crosshairs, one screen pixel wide however far we zoom in
+    const int x = (int) floor(scGx), y = (int) floor(scGy);
+    if (x >= 0 && x < _scVisW) major.append(QLine(x, 0, x, _scVisH));
+    if (y >= 0 && y < _scVisH) major.append(QLine(0, y, _scVisW, y));
+}
+
+/* The core protocol has no blending, so the minor lines are dotted to keep
+ * them light. All the lines of each kind go in one request
+ */
+void ffmpegWidget::paintXvOverlay(double sx, double sy, double ox, double oy) {
+    if (!_grid || !_gcol.isValid()) return;
+    QVector<QLine> major, minor;
+    overlayLines(sx, sy, ox, oy, major, minor);
+    if (this->overlay_col != _gcol) {
+        XColor xc;
+        xc.red = _gcol.red() * 257;
+        xc.green = _gcol.green() * 257;
+        xc.blue = _gcol.blue() * 257;
+        xc.flags = DoRed | DoGreen | DoBlue;
+        if (!XAllocColor(this->dpy, x11Info().colormap(), &xc)) {
+            xc.pixel = WhitePixel(this->dpy, x11Info().screen());
+        }
+        this->overlay_pixel = xc.pixel;
+        this->overlay_col = _gcol;
+        XSetForeground(this->dpy, this->overlay_gc, this->overlay_pixel);
+    }
+    QVector<XSegment> segs;
+    for (int pass = 0; pass < 2; pass++) {
+        const QVector<QLine> &lines = pass ? major : minor;
+        if (lines.isEmpty()) continue;
+        segs.resize(lines.size());
+        for (int i = 0; i < lines.size(); i++) {
+            segs[i].x1 = lines[i].x1();
+            segs[i].y1 = lines[i].y1();
+            segs[i].x2 = lines[i].x2();
+            segs[i].y2 = lines[i].y2();
+        }
+        if (pass) {
+            XSetLineAttributes(this->dpy, this->overlay_gc, 0, LineSolid, CapButt, JoinMiter);
+        } else {
+            static char dots[] = { 1, 3 };
+            XSetLineAttributes(this->dpy, this->overlay_gc, 0, LineOnOffDash, CapButt, JoinMiter);
+            XSetDashes(this->dpy, this->overlay_gc, 0, dots, 2);
+        }
+        XDrawSegments(this->dpy, this->w, this->overlay_gc, segs.data(), segs.size());
+    }
 }
 
-void ffmpegWidget::paintEvent(QPaintEvent *) {
-    // check we have a full buffer
-    if (this->fullbuf == NULL || this->fullbuf->width <= 0 || this->fullbuf->height <= 0) {
-        if (this->xv_format >= 0) {
-            // xvideo supported    
-            XClearArea(this->dpy, this->w, 0, 0, this->widgetW, this->widgetH, 0);
+// position of image pixel x on the scaled image, panning moves the view by
+// whole screen pixels between these so scrolled and fresh pixels line up
+static int scaledOrigin(int x, double sf) {
+    return (int) (x * sf + 0.5);
+}
+
+/* Nearest neighbour scale the RGB24 frame src onto rect of dest, where dest
+ * pixel (X, Y) shows frame pixel ((X + ox) / sfx, (Y + oy) / sfy). This is
+ * what QImage::scaled does for the whole view, but it can do just a strip
+ */
+static void scaleRGBRect(FFBuffer *src, QImage &dest, const QRect &rect,
+        int ox, int oy, double sfx, double sfy) {
+    const int w = rect.width();
+    QVector<int> cols(w);
+    for (int i = 0; i < w; i++) {
+        cols[i] = qMin((int) ((rect.x() + i + ox) / sfx), src->width - 1) * 3;
+    }
+    const unsigned char *data = src->pFrame->data[0];
+    const int ls = src->pFrame->linesize[0];
+    int lastY = -1;
+    QRgb *last = NULL;
+    for (int Y = rect.top(); Y <= rect.bottom(); Y++) {
+        const int y = qMin((int) ((Y + oy) / sfy), src->height - 1);
+        QRgb *out = (QRgb *) dest.scanLine(Y) + rect.x();
+        if (y == lastY) {
+            // zoomed in, this row is the same as the last one
+            memcpy(out, last, w * sizeof(QRgb));
+            continue;
         }
-        return;
+        const unsigned char *row = data + y * ls;
+        for (int i = 0; i < w; i++) {
+            const unsigned char *p = row + cols[i];
+            out[i] = qRgb(p[0], p[1], p[2]);
+        }
+        lastY = y;
+        last = out;
     }
-    // If scale factors have changed
-    if (this->widgetW != width() || this->widgetH != height()) {
-        updateScalefactor();
+}
+
+// move the pixels of image by -dx, -dy, what is left uncovered is garbage
+static void shiftImage(QImage &image, int dx, int dy) {
+    const int w = image.width() - qAbs(dx);
+    const int h = image.height() - qAbs(dy);
+    const int srcX = qMax(dx, 0), destX = qMax(-dx, 0);
+    // work away from the rows we are writing to
+    for (int i = 0; i < h; i++) {
+        const int destY = dy >= 0 ? i : image.height() - 1 - i;
+        QRgb *dest = (QRgb *) image.scanLine(destY);
+        const QRgb *src = (const QRgb *) image.scanLine(destY + dy);
+        memmove(dest + destX, src + srcX, w * sizeof(QRgb));
     }
-    FFBuffer * cachedFull = this->fullbuf;
-    cachedFull->reserve();    
-    if (cachedFull->pix_fmt == PIX_FMT_YUVJ420P) {
-        // xvideo supported
-        this->xv_image->data = (char *) cachedFull->pFrame->data[0];
-        /* Draw the image */
-        XvPutImage(this->dpy, this->xv_port, this->w, this->gc, this->xv_image,
-            _x, _y, _visW, _visH, 0, 0, _scVisW, _scVisH);
-   } else {
-        // QImage fallback
-        QPainter painter(this);
-        QImage image(cachedFull->pFrame->data[0], cachedFull->width, cachedFull->height, QImage::Format_RGB888);
-        painter.drawImage(QPoint(0, 0), image.copy(QRect(_x, _y, _visW, _visH)).scaled(_scVisW, _scVisH));
-        /* Draw the grid */
-        if (_grid) {
-            QPainter painter(this);
-            // note the 0.5 gives us the middle of the pixel
-            double scGx = (_gx-_x+0.5)*this->sfx;
-            double scGy = (_gy-_y+0.5)*this->sfy;
-            double scGsx = _gs*this->sfx;
-            double scGsy = _gs*this->sfy;        
-            if (scGsx > 0.1 && scGsy > 0.1) {
-                // Draw minor lines
-                QColor gscol = QColor(_gcol);
-                gscol.setAlpha(35);
-                painter.setPen(gscol);
-                // X lines to the left of crosshair
-                for (double scx = scGx - scGsx; scx > 0; scx -= scGsx) {
-                    painter.drawLine((int)(scx+0.5), 0, (int)(scx+0.5), _scVisH);
-                }
-                // X lines to the right of crosshair
-                for (double scx = scGx + scGsx; scx < _scVisW; scx += scGsx) {
-                    painter.drawLine((int)(scx+0.5), 0, (int)(scx+0.5), _scVisH);
-                }
-                // Y lines above the crosshair
-                for (double scy = scGy - scGsy; scy > 0; scy -= scGsy) {
-                    painter.drawLine(0, (int)(scy+0.5), _scVisW, (int)(scy+0.5));
-                }
-                // Y lines below the crosshair
-                for (double scy = scGy + scGsy; scy < _scVisH; scy += scGsy) {
-                    painter.drawLine(0, (int)(scy+0.5), _scVisW, (int)(scy+0.5));
-                }
-            }
-            // Draw crosshairs
-            painter.setPen(_gcol);
-            painter.drawLine((int)(scGx+0.5), 0, (int)(scGx+0.5), _scVisH);
-            painter.drawLine(0, (int)(scGy+0.5), _scVisW, (int)(scGy+0.5));
+}
+
+// bring panImage up to date with buf and the current view, only scaling what
+// we didn't have before
+void ffmpegWidget::updatePanImage(FFBuffer *buf) {
+    const int originX = scaledOrigin(_x, this->sfx);
+    const int originY = scaledOrigin(_y, this->sfy);
+    const int w = _scVisW, h = _scVisH;
+    const int dx = originX - this->panOriginX;
+    const int dy = originY - this->panOriginY;
+    if (!this->panValid || this->panImage.width() != w || this->panImage.height() != h ||
+            qAbs(dx) >= w || qAbs(dy) >= h) {
+        // nothing we can reuse
+        if (this->panImage.width() != w || this->panImage.height() != h) {
+            this->panImage = QImage(w, h, QImage::Format_RGB32);
+        }
+        scaleRGBRect(buf, this->panImage, QRect(0, 0, w, h), originX, originY, this->sfx, this->sfy);
+    } else if (dx != 0 || dy != 0) {
+        // keep what is still in view, then fill in the columns and rows
+        // that have come into it
+        shiftImage(this->panImage, dx, dy);
+        if (dx != 0) {
+            QRect cols(dx > 0 ? w - dx : 0, 0, qAbs(dx), h);
+            scaleRGBRect(buf, this->panImage, cols, originX, originY, this->sfx, this->sfy);
+        }
+        if (dy != 0) {
+            QRect rows(0, dy > 0 ? h - dy : 0, w, qAbs(dy));
+            scaleRGBRect(buf, this->panImage, rows, originX, originY, this->sfx, this->sfy);
         }
     }
-    cachedFull->release();
+    this->panOriginX = originX;
+    this->panOriginY = originY;
+    this->panValid = true;
+}
+
+// draw buf and the grid with a QPainter, rect is the part that needs it
+void ffmpegWidget::paintQImage(FFBuffer *buf, const QRect &rect) {
+    // QImage fallback
+    updatePanImage(buf);
+    QPainter painter(this);
+    QRect area = rect & this->panImage.rect();
+    painter.drawImage(area.topLeft(), this->panImage, area);
+    /* Draw the grid */
+    paintQImageOverlay(painter, area);
+}
+
+// the overlay is drawn into a pixmap that is kept until the grid, zoom or
+// pan changes, so a new frame only has to blend it over the picture
+void ffmpegWidget::paintQImageOverlay(QPainter &painter, const QRect &rect) {
+    if (!_grid) return;
+    if (!this->overlayValid || this->overlayPixmap.width() != _scVisW ||
+            this->overlayPixmap.height() != _scVisH ||
+            this->overlayOriginX != this->panOriginX || this->overlayOriginY != this->panOriginY ||
+            this->overlaySfx != this->sfx || this->overlaySfy != this->sfy) {
+        // measured from the same origin as the pixels so it scrolls with them
+        QVector<QLine> major, minor;
+        overlayLines(this->sfx, this->sfy, this->panOriginX, this->panOriginY, major, minor);
+        this->overlayPixmap = QPixmap(qMax(_scVisW, 1), qMax(_scVisH, 1));
+        this->overlayPixmap.fill(Qt::transparent);
+        QPainter overlay(&this->overlayPixmap);
+        QColor gscol = QColor(_gcol);
+        gscol.setAlpha(35);
+        overlay.setPen(gscol);
+        overlay.drawLines(minor);
+        overlay.setPen(_gcol);
+        overlay.drawLines(major);
+        this->overlayValid = true;
+        this->overlayOriginX = this->panOriginX;
+        this->overlayOriginY = this->panOriginY;
+        this->overlaySfx = this->sfx;
+        this->overlaySfy = this->sfy;
+    }
+    painter.drawPixmap(rect.topLeft(), this->overlayPixmap, rect);
+}
+
+// count and checksum buf in place of drawing it, so the rest of the pipeline
+// can be run and timed without a display
+void ffmpegWidget::renderNull(FFBuffer *buf) {
+    int64_t start = av_gettime();
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(buf->pix_fmt);
+    unsigned long sum = 1;
+    for (int p = 0; p < 4 && buf->pFrame->data[p]; p++) {
+        int bytes = av_image_get_linesize(buf->pix_fmt, buf->width, p);
+        int rows = (p == 1 || p == 2) ? -((-buf->height) >> desc->log2_chroma_h) : buf->height;
+        if (bytes <= 0) break;
+        for (int y = 0; y < rows; y++) {
+            sum = av_adler32_update(sum, buf->pFrame->data[p] + y * buf->pFrame->linesize[p], bytes);
+        }
+    }
+    _renderChecksum = (uint) sum;
+    emit renderChecksumChanged(_renderChecksum);
+    emit renderCountChanged(++_renderCount);
+    _renderTime += METRICSMOOTHING * ((av_gettime() - start) / 1000.0 - _renderTime);
+    emit renderTimeChanged(_renderTime);
+}
+
+// the format frames are converted to for the backend we're using
+PixelFormat ffmpegWidget::renderFormat() const {
+    return this->renderer->format();
+}
+
+// resolve _backend to one we can actually use
+void ffmpegWidget::pickRenderer() {
+    int renderer = _backend;
+    if (renderer == BACKEND_AUTO) renderer = BACKEND_XVSHM;
+    if (renderer == BACKEND_XVSHM && !this->xv_shm) renderer = BACKEND_XV;
+    if (renderer == BACKEND_XV && this->xv_format < 0) renderer = BACKEND_XSHM;
+    if (renderer == BACKEND_XSHM && !this->xshm) renderer = BACKEND_QIMAGE;
+    if (renderer != _backend && _backend != BACKEND_AUTO) {
+        printf("Backend %s not available, using %s\n", ffBackendName(_backend),
+            ffBackendName(renderer));
+    }
+    if (renderer == this->renderer->backend()) return;
+    if (this->renderer->backend() == BACKEND_XVSHM) {
+        // the conversion may be filling a shared image, so wait for it
+        this->jobMutex->lock();
+        while (this->jobRunning) this->jobDone->wait(this->jobMutex);
+        this->jobMutex->unlock();
+        xvFree();
+    }
+    delete this->renderer;
+    switch (renderer) {
+        case BACKEND_XVSHM: this->renderer = new FFXvRenderer(this, true); break;
+        case BACKEND_XV:    this->renderer = new FFXvRenderer(this, false); break;
+        case BACKEND_XSHM:  this->renderer = new FFXShmRenderer(this); break;
+        case BACKEND_NULL:  this->renderer = new FFNullRenderer(this); break;
+        default:            this->renderer = new FFQImageRenderer(this); break;
+    }
+    // xvideo and xshm paint all of their pixels straight onto the window
+    setAttribute(Qt::WA_OpaquePaintEvent, this->renderer->onWindow());
+    setAttribute(Qt::WA_PaintOnScreen, this->renderer->onWindow());
+    // the frames need converting for the new backend
+    if (!disableUpdates) {
+        makeFullFrame();
+        update();
+    }
 }
 
 void ffmpegWidget::ffQuit() {
@@ -801,6 +3576,8 @@ void ffmpegWidget::ffQuit() {
     }
     delete ff;
     ff = NULL;
+    this->readerInfo = QString();
+    updateThreadInfo();
 }
 
 // update grid centre
@@ -831,11 +3608,21 @@ void ffmpegWidget::mousePressEvent (QMouseEvent* event) {
 void ffmpegWidget::mouseMoveEvent (QMouseEvent* event) {
 	// drag the screen around so the pixel "grabbed" stays under the cursor
 	if (event->buttons() & Qt::LeftButton) {
+        int originX = scaledOrigin(_x, this->sfx);
+        int originY = scaledOrigin(_y, this->sfy);
         // disable automatic updates
         disableUpdates = true;
         setX(oldx + (int)((clickx - event->x())/this->sfx));
-        disableUpdates = false;        
         setY(oldy + (int)((clicky - event->y())/this->sfy));
+        disableUpdates = false;        
+        if (this->renderer->backend() == BACKEND_QIMAGE) {
+            // move what is already on screen, then only the strips that
+            // come into view are painted
+            scroll(originX - scaledOrigin(_x, this->sfx), originY - scaledOrigin(_y, this->sfy),
+                QRect(0, 0, _scVisW, _scVisH));
+        } else {
+            update();
+        }
         event->accept();
     }
 	// drag the grid around so the pixel "grabbed" stays under the cursor
@@ -886,11 +3673,23 @@ void ffmpegWidget::setReset() {
     // first make sure we don't update anything too quickly
     disableUpdates = true;
 
-    /* create the ffmpeg thread */
+    /* create the ffmpeg thread, only decoding if we can be seen */
+    this->hiddenDisconnect = false;
     ff = new FFThread(_url, this);
+    updatePaused();
+    ff->setLowres(_lowres);
+    ff->setAccumulate(_accumulate);
+    ff->setAccumulateMode(_accumulateMode);
+    ff->setOrient(orientation());
+    ff->setReplaySeconds(_replaySeconds);
+    ff->setThreadSettings(_cpus, _niceness, _rtPriority);
+    ff->setShmName(_shmName);
+    if (this->recorder) ff->setRecorder(this->recorder);
     
     QObject::connect( ff, SIGNAL(updateSignal(FFBuffer *)),
                       this, SLOT(updateImage(FFBuffer *)) );
+    QObject::connect( ff, SIGNAL(settingsApplied(QString)),
+                      this, SLOT(threadSettingsApplied(QString)) );
     QObject::connect( this, SIGNAL(aboutToQuit()),
                       ff, SLOT(stopGracefully()) );
     // allow updates, and start the image thread
@@ -899,6 +3698,67 @@ void ffmpegWidget::setReset() {
     ff->start();
 }
 
+// work out if anyone can see us, and pause decoding if they can't
+void ffmpegWidget::updateOnScreen() {
+    // the null backend doesn't need to be seen, so it can run headless
+    bool onScreen = this->renderer->backend() == BACKEND_NULL || (isVisible() &&
+        !window()->isMinimized() && width() > 0 && height() > 0 &&
+        !visibleRegion().isEmpty());
+    if (_onScreen == onScreen) return;
+    _onScreen = onScreen;
+    emit onScreenChanged(_onScreen);
+    if (_onScreen) {
+        this->hideTimer->stop();
+        if (this->hiddenDisconnect) {
+            // we were disconnected while hidden, so reconnect
+            setReset();
+        } else {
+            updatePaused();
+        }
+    } else {
+        updatePaused();
+        if (_hideTimeout > 0) this->hideTimer->start(_hideTimeout);
+    }
+}
+
+// only decode the live stream if it is going to be shown
+void ffmpegWidget::updatePaused() {
+    if (ff) ff->setPaused(!_onScreen || _replay);
+}
+
+// we've been hidden long enough, so drop the connection
+void ffmpegWidget::hideTimeoutExpired() {
+    if (_onScreen || ff == NULL) return;
+    ffQuit();
+    this->hiddenDisconnect = true;
+}
+
+void ffmpegWidget::showEvent(QShowEvent *) {
+    updateOnScreen();
+}
+
+void ffmpegWidget::hideEvent(QHideEvent *) {
+    updateOnScreen();
+}
+
+void ffmpegWidget::resizeEvent(QResizeEvent *) {
+    updateOnScreen();
+    updateLowres();
+}
+
+// in autoLowres mode, decode at the smallest size that still fills the widget
+void ffmpegWidget::updateLowres() {
+    if (!_autoLowres || this->rawbuf == NULL) return;
+    int fullW = this->rawbuf->width << this->rawbuf->lowres;
+    int fullH = this->rawbuf->height << this->rawbuf->lowres;
+    if (fullW <= 0 || fullH <= 0) return;
+    // this is the scale the full size image is displayed at when zoom is 0
+    double sf = qMin(width() / (double) fullW, height() / (double) fullH);
+    int lowres = 0;
+    while (lowres < MAXLOWRES && (1 << (lowres + 1)) * sf <= 1.0) lowres++;
+    setLowres(lowres);
+}
+
 // set fps to 0 if we've waited 1.5 times the time we should for a frame
 void ffmpegWidget::calcFps() {
     if (this->lastFrameTime->elapsed() > 1500.0 / _fps) {
@@ -906,11 +3766,92 @@ void ffmpegWidget::calcFps() {
     }
 }
 
+// BACKEND_ to draw frames with
+void ffmpegWidget::setBackend(int backend) {
+    backend = (backend < BACKEND_AUTO || backend > BACKEND_XSHM) ? BACKEND_AUTO : backend;
+    if (_backend != backend) {
+        _backend = backend;
+        emit backendChanged(_backend);
+        pickRenderer();
+        updateOnScreen();
+    }
+}
+
+// cpus to read and decode on, "" = any
+void ffmpegWidget::setCpus(QString cpus) {
+    if (_cpus != cpus) {
+        _cpus = cpus;
+        emit cpusChanged(_cpus);
+        if (ff) ff->setThreadSettings(_cpus, _niceness, _rtPriority);
+    }
+}
+
+// cpus to convert on, "" = any, the next conversion picks them up
+void ffmpegWidget::setConvertCpus(QString convertCpus) {
+    if (_convertCpus != convertCpus) {
+        _convertCpus = convertCpus;
+        emit convertCpusChanged(_convertCpus);
+        updateThreadInfo();
+    }
+}
+
+// nice value of the decode thread, NICE_UNSET = as inherited
+void ffmpegWidget::setNiceness(int niceness) {
+    if (niceness != NICE_UNSET) niceness = qBound(-20, niceness, 19);
+    if (_niceness != niceness) {
+        _niceness = niceness;
+        emit nicenessChanged(_niceness);
+        if (ff) ff->setThreadSettings(_cpus, _niceness, _rtPriority);
+    }
+}
+
+// SCHED_FIFO priority of the decode thread, 0 = off, -1 = as inherited
+void ffmpegWidget::setRtPriority(int rtPriority) {
+    rtPriority = qBound(RTPRIORITY_UNSET, rtPriority, 99);
+    if (_rtPriority != rtPriority) {
+        _rtPriority = rtPriority;
+        emit rtPriorityChanged(_rtPriority);
+        if (ff) ff->setThreadSettings(_cpus, _niceness, _rtPriority);
+    }
+}
+
+// POSIX shared memory to publish frames to, "" = off
+void ffmpegWidget::setShmName(QString shmName) {
+    if (_shmName != shmName) {
+        _shmName = shmName;
+        emit shmNameChanged(_shmName);
+        if (ff) ff->setShmName(_shmName);
+    }
+}
+
+// the decode thread has applied its settings, info says what took effect
+void ffmpegWidget::threadSettingsApplied(QString info) {
+    this->readerInfo = info;
+    updateThreadInfo();
+}
+
+// conversions only pin their pool thread when they run, so just check
+// the cpu list makes sense
+void ffmpegWidget::updateThreadInfo() {
+    QString convert("any cpu");
+    if (!_convertCpus.trimmed().isEmpty()) {
+        cpu_set_t set;
+        convert = parseCpus(_convertCpus, &set) ? QString("cpus %1").arg(_convertCpus) :
+            QString("bad cpu list '%1'").arg(_convertCpus);
+    }
+    QString info = QString("decode: %1; convert: %2").arg(
+        this->readerInfo.isEmpty() ? QString("not running") : this->readerInfo, convert);
+    if (_threadInfo != info) {
+        _threadInfo = info;
+        emit threadInfoChanged(_threadInfo);
+    }
+}
+
 // x offset in image pixels
 void ffmpegWidget::setX(int x) {
     x = x < 0 ? 0 : (x > _maxX) ? _maxX : x;
     // xvideo only accepts multiple of 2 offsets    
-    if (this->xv_format >= 0) x = x - x % 2;    
+    if (usingXv()) x = x - x % 2;    
     if (_x != x) {
         _x = x;
         emit xChanged(x);
@@ -924,7 +3865,7 @@ void ffmpegWidget::setX(int x) {
 void ffmpegWidget::setY(int y) {
     y = y < 0 ? 0 : (y > _maxY) ? _maxY : y;
     // xvideo only accepts multiple of 2 offsets
-    if (this->xv_format >= 0) y = y - y % 2;        
+    if (usingXv()) y = y - y % 2;        
     if (_y != y) {
         _y = y;
         emit yChanged(y);
@@ -953,9 +3894,9 @@ void ffmpegWidget::setGx(int gx) {
     if (_gx != gx) {
         _gx = gx;
         emit gxChanged(gx);
+        this->overlayValid = false;
         if (!disableUpdates) {
-            // Grid changed, so redraw it on current image
-            if (this->xv_format >= 0) makeFullFrame();
+            // Grid changed, only the overlay needs redrawing
             update();
         }
     }
@@ -967,9 +3908,9 @@ void ffmpegWidget::setGy(int gy) {
     if (_gy != gy) {
         _gy = gy;
         emit gyChanged(gy);
+        this->overlayValid = false;
         if (!disableUpdates) {
-            // Grid changed, so redraw it on current image
-            if (this->xv_format >= 0) makeFullFrame();
+            // Grid changed, only the overlay needs redrawing
             update();
         }
     }
@@ -981,9 +3922,9 @@ void ffmpegWidget::setGs(int gs) {
     if (_gs != gs) {
         _gs = gs;
         emit gsChanged(gs);
+        this->overlayValid = false;
         if (!disableUpdates) {
-            // Grid changed, so redraw it on current image
-            if (this->xv_format >= 0) makeFullFrame();        
+            // Grid changed, only the overlay needs redrawing
             update();
         }
     }
@@ -994,9 +3935,9 @@ void ffmpegWidget::setGrid(bool grid) {
     if (_grid != grid) {
         _grid = grid;
         emit gridChanged(grid);
+        this->overlayValid = false;
         if (!disableUpdates) {
-            // Grid changed, so redraw it on current image
-            if (this->xv_format >= 0) makeFullFrame();        
+            // Grid changed, only the overlay needs redrawing
             update();
         }
     }
@@ -1007,9 +3948,9 @@ void ffmpegWidget::setGcol(QColor gcol) {
     if (gcol.isValid() && (!_gcol.isValid() || _gcol != gcol)) {
         _gcol = gcol;
         emit gcolChanged(_gcol);
+        this->overlayValid = false;
         if (!disableUpdates) {
-            // Grid changed, so redraw it on current image
-            if (this->xv_format >= 0) makeFullFrame();
+            // Grid changed, only the overlay needs redrawing
             update();
         }
     }
@@ -1027,6 +3968,613 @@ void ffmpegWidget::setFcol(int fcol) {
     }
 }
 
+// ms hidden before disconnect, 0 = never
+void ffmpegWidget::setHideTimeout(int hideTimeout) {
+    hideTimeout = (hideTimeout < 0) ? 0 : hideTimeout;
+    if (_hideTimeout != hideTimeout) {
+        _hideTimeout = hideTimeout;
+        emit hideTimeoutChanged(_hideTimeout);
+        if (!_onScreen && ff) {
+            if (_hideTimeout > 0) {
+                this->hideTimer->start(_hideTimeout);
+            } else {
+                this->hideTimer->stop();
+            }
+        }
+    }
+}
+
+// decode at 1/2^lowres resolution
+void ffmpegWidget::setLowres(int lowres) {
+    lowres = (lowres < 0) ? 0 : (lowres > MAXLOWRES) ? MAXLOWRES : lowres;
+    if (_lowres != lowres) {
+        _lowres = lowres;
+        emit lowresChanged(_lowres);
+        if (ff) ff->setLowres(_lowres);
+    }
+}
+
+// pick lowres from widget size
+void ffmpegWidget::setAutoLowres(bool autoLowres) {
+    if (_autoLowres != autoLowres) {
+        _autoLowres = autoLowres;
+        emit autoLowresChanged(_autoLowres);
+        if (_autoLowres) {
+            updateLowres();
+        } else {
+            setLowres(0);
+        }
+    }
+}
+
+// number of frames averaged, 1 = off
+void ffmpegWidget::setAccumulate(int accumulate) {
+    accumulate = (accumulate < 1) ? 1 : (accumulate > MAXACCUMULATE) ? MAXACCUMULATE : accumulate;
+    if (_accumulate != accumulate) {
+        _accumulate = accumulate;
+        emit accumulateChanged(_accumulate);
+        if (ff) ff->setAccumulate(_accumulate);
+    }
+}
+
+// 0 = boxcar, 1 = exponential decay
+void ffmpegWidget::setAccumulateMode(int accumulateMode) {
+    accumulateMode = (accumulateMode == 1) ? 1 : 0;
+    if (_accumulateMode != accumulateMode) {
+        _accumulateMode = accumulateMode;
+        emit accumulateModeChanged(_accumulateMode);
+        if (ff) ff->setAccumulateMode(_accumulateMode);
+    }
+}
+
+// degrees clockwise, 0, 90, 180 or 270
+void ffmpegWidget::setRotate(int rotate) {
+    rotate = (rotate / 90 % 4 + 4) % 4 * 90;
+    if (_rotate != rotate) {
+        int old = orientation();
+        _rotate = rotate;
+        emit rotateChanged(_rotate);
+        updateOrientation(old);
+    }
+}
+
+// mirror left to right, before rotating
+void ffmpegWidget::setFlipH(bool flipH) {
+    if (_flipH != flipH) {
+        int old = orientation();
+        _flipH = flipH;
+        emit flipHChanged(_flipH);
+        updateOrientation(old);
+    }
+}
+
+// mirror top to bottom, before rotating
+void ffmpegWidget::setFlipV(bool flipV) {
+    if (_flipV != flipV) {
+        int old = orientation();
+        _flipV = flipV;
+        emit flipVChanged(_flipV);
+        updateOrientation(old);
+    }
+}
+
+// ORIENT_ flags for the current rotate and flips
+int ffmpegWidget::orientation() {
+    return orientFlags(_rotate, _flipH, _flipV);
+}
+
+/* Frames are turned as they are copied from the decoder, so tell the thread
+ * and keep the grid and stats region on the same part of the picture. The
+ * image size follows when the next frame is converted, so it may still be
+ * from before an earlier change: the grid and region are already in the old
+ * orientation, but _imW and _imH are in _imOrient
+ */
+void ffmpegWidget::updateOrientation(int old) {
+    int orient = orientation();
+    if (ff) ff->setOrient(orient);
+    if (_imW > 0 && _imH > 0) {
+        // size of the raw frame, and turned the old and new ways
+        int rawW = (_imOrient & ORIENT_TRANSPOSE) ? _imH : _imW;
+        int rawH = (_imOrient & ORIENT_TRANSPOSE) ? _imW : _imH;
+        int oldW = (old & ORIENT_TRANSPOSE) ? rawH : rawW;
+        int oldH = (old & ORIENT_TRANSPOSE) ? rawW : rawH;
+        int newW = (orient & ORIENT_TRANSPOSE) ? rawH : rawW;
+        int newH = (orient & ORIENT_TRANSPOSE) ? rawW : rawH;
+        int gx = _gx, gy = _gy;
+        unorientPoint(old, oldW, oldH, &gx, &gy);
+        orientPoint(orient, rawW, rawH, &gx, &gy);
+        _gx = qBound(1, gx, newW - 1);
+        emit gxChanged(_gx);
+        _gy = qBound(1, gy, newH - 1);
+        emit gyChanged(_gy);
+        if (_roiW > 0 && _roiH > 0) {
+            // opposite corners of the region
+            int x0 = _roiX, y0 = _roiY;
+            int x1 = _roiX + _roiW - 1, y1 = _roiY + _roiH - 1;
+            unorientPoint(old, oldW, oldH, &x0, &y0);
+            unorientPoint(old, oldW, oldH, &x1, &y1);
+            orientPoint(orient, rawW, rawH, &x0, &y0);
+            orientPoint(orient, rawW, rawH, &x1, &y1);
+            setRoiX(qMin(x0, x1));
+            setRoiY(qMin(y0, y1));
+            setRoiW(qAbs(x1 - x0) + 1);
+            setRoiH(qAbs(y1 - y0) + 1);
+        }
+    }
+    // the background was captured the old way up
+    if (this->background) {
+        this->background->release();
+        this->background = NULL;
+        if (_subtract) printf("Orientation changed, capture the background again\n");
+    }
+    if (_replay) {
+        // decode the frame on show again, the cache is the old way up
+        QMap<int, FFBuffer *>::iterator it;
+        for (it = this->replayCache.begin(); it != this->replayCache.end(); ++it) {
+            it.value()->release();
+        }
+        this->replayCache.clear();
+        this->replayDecoded = -1;
+        int playhead = _playhead;
+        _playhead = -1;
+        setPlayhead(playhead);
+    }
+}
+
+// subtract the captured background
+void ffmpegWidget::setSubtract(bool subtract) {
+    if (_subtract != subtract) {
+        _subtract = subtract;
+        emit subtractChanged(_subtract);
+        if (_subtract && this->background == NULL) captureBackground();
+        if (!disableUpdates) makeFullFrame();
+    }
+}
+
+// gain after background subtraction
+void ffmpegWidget::setSubtractGain(double subtractGain) {
+    // the gain is applied as 8.8 fixed point in 16 bits
+    subtractGain = qBound(0.0, subtractGain, 127.0);
+    if (_subtractGain != subtractGain) {
+        _subtractGain = subtractGain;
+        emit subtractGainChanged(_subtractGain);
+        if (_subtract && !disableUpdates) makeFullFrame();
+    }
+}
+
+// offset after background subtraction
+void ffmpegWidget::setSubtractOffset(int subtractOffset) {
+    subtractOffset = qBound(-255, subtractOffset, 255);
+    if (_subtractOffset != subtractOffset) {
+        _subtractOffset = subtractOffset;
+        emit subtractOffsetChanged(_subtractOffset);
+        if (_subtract && !disableUpdates) makeFullFrame();
+    }
+}
+
+// centre of the window for 16-bit mono streams
+void ffmpegWidget::setLevel(int level) {
+    level = qBound(0, level, 65535);
+    if (_level != level) {
+        _level = level;
+        emit levelChanged(_level);
+        if (!disableUpdates) makeFullFrame();
+    }
+}
+
+// width of the window for 16-bit mono streams
+void ffmpegWidget::setWindow(int window) {
+    window = qBound(1, window, 65535);
+    if (_window != window) {
+        _window = window;
+        emit windowChanged(_window);
+        if (!disableUpdates) makeFullFrame();
+    }
+}
+
+// stretch black, white and gamma to suit the frame
+void ffmpegWidget::setAutoLevel(bool autoLevel) {
+    if (_autoLevel != autoLevel) {
+        _autoLevel = autoLevel;
+        emit autoLevelChanged(_autoLevel);
+        // start again from the next frame
+        if (_autoLevel) this->levels->reset();
+        if (!disableUpdates) makeFullFrame();
+    }
+}
+
+// compute projections, profiles and histogram
+void ffmpegWidget::setStats(bool stats) {
+    if (_stats != stats) {
+        _stats = stats;
+        emit statsChanged(_stats);
+        makeStats();
+    }
+}
+
+// stats region x in image pixels
+void ffmpegWidget::setRoiX(int roiX) {
+    roiX = qMax(roiX, 0);
+    if (_roiX != roiX) {
+        _roiX = roiX;
+        emit roiXChanged(_roiX);
+    }
+}
+
+// stats region y in image pixels
+void ffmpegWidget::setRoiY(int roiY) {
+    roiY = qMax(roiY, 0);
+    if (_roiY != roiY) {
+        _roiY = roiY;
+        emit roiYChanged(_roiY);
+    }
+}
+
+// stats region width, 0 = to the edge
+void ffmpegWidget::setRoiW(int roiW) {
+    roiW = qMax(roiW, 0);
+    if (_roiW != roiW) {
+        _roiW = roiW;
+        emit roiWChanged(_roiW);
+    }
+}
+
+// stats region height, 0 = to the edge
+void ffmpegWidget::setRoiH(int roiH) {
+    roiH = qMax(roiH, 0);
+    if (_roiH != roiH) {
+        _roiH = roiH;
+        emit roiHChanged(_roiH);
+    }
+}
+
+// background level for the centroid
+void ffmpegWidget::setThreshold(int threshold) {
+    threshold = qBound(0, threshold, 255);
+    if (_threshold != threshold) {
+        _threshold = threshold;
+        emit thresholdChanged(_threshold);
+    }
+}
+
+// move the grid to the centroid
+void ffmpegWidget::setFollowCentroid(bool followCentroid) {
+    if (_followCentroid != followCentroid) {
+        _followCentroid = followCentroid;
+        emit followCentroidChanged(_followCentroid);
+        // we need the stats to follow the centroid
+        if (_followCentroid) setStats(true);
+    }
+}
+
+// keep the current raw frame to subtract from the ones that follow
+void ffmpegWidget::captureBackground() {
+    if (this->rawbuf == NULL) {
+        printf("No frame to capture as background\n");
+        return;
+    }
+    if (!hasLumaPlane(this->rawbuf->pix_fmt) && !isDeepGray(this->rawbuf->pix_fmt)) {
+        printf("Can't subtract a background from %s frames\n",
+            av_get_pix_fmt_name(this->rawbuf->pix_fmt));
+        return;
+    }
+    // raw frames aren't changed once they're decoded, so just keep a ref
+    if (this->background) this->background->release();
+    this->background = this->rawbuf;
+    this->background->reserve();
+    if (_subtract && !disableUpdates) makeFullFrame();
+}
+
+// seconds of packets kept for replay
+void ffmpegWidget::setReplaySeconds(int replaySeconds) {
+    replaySeconds = (replaySeconds < 0) ? 0 : replaySeconds;
+    if (_replaySeconds != replaySeconds) {
+        _replaySeconds = replaySeconds;
+        emit replaySecondsChanged(_replaySeconds);
+        if (ff) ff->setReplaySeconds(_replaySeconds);
+    }
+}
+
+// pause on a copy of the packet ring, or go back to the live stream
+void ffmpegWidget::setReplay(bool replay) {
+    if (_replay == replay) return;
+    if (replay) {
+        // take a copy of the ring, live capture carries on filling it
+        if (ff == NULL) return;
+        enum AVCodecID codec_id;
+        QByteArray extradata;
+        this->replayPackets = ff->packetRing()->snapshot(&codec_id, &extradata);
+        AVCodec *codec = avcodec_find_decoder(codec_id);
+        if (this->replayPackets.isEmpty() || codec == NULL) {
+            this->replayPackets.clear();
+            return;
+        }
+        // make a decoder of our own for the packets, at the live resolution
+        this->replayCtx = avcodec_alloc_context3(codec);
+        this->replayCtx->lowres = qMin(_lowres, (int) codec->max_lowres);
+        if (extradata.size() > 0) {
+            this->replayCtx->extradata = (uint8_t *) av_mallocz(
+                extradata.size() + FF_INPUT_BUFFER_PADDING_SIZE);
+            memcpy(this->replayCtx->extradata, extradata.constData(), extradata.size());
+            this->replayCtx->extradata_size = extradata.size();
+        }
+        ffmutex->lock();
+        int ret = avcodec_open2(this->replayCtx, codec, NULL);
+        ffmutex->unlock();
+        if (ret < 0) {
+            printf("Could not open replay codec for '%s'\n", _url.toAscii().data());
+            closeReplay();
+            return;
+        }
+        this->replayFrame = avcodec_alloc_frame();
+        this->replayDecoded = -1;
+    } else {
+        closeReplay();
+    }
+    _replay = replay;
+    emit replayChanged(_replay);
+    updatePaused();
+    if (_replay) {
+        _maxPlayhead = this->replayPackets.size() - 1;
+        emit maxPlayheadChanged(_maxPlayhead);
+        // start from the most recent frame
+        _playhead = -1;
+        setPlayhead(_maxPlayhead);
+    }
+}
+
+// show a frame from the replay snapshot
+void ffmpegWidget::setPlayhead(int playhead) {
+    if (!_replay) return;
+    playhead = (playhead < 0) ? 0 : (playhead > _maxPlayhead) ? _maxPlayhead : playhead;
+    if (_playhead == playhead) return;
+    _playhead = playhead;
+    emit playheadChanged(_playhead);
+    emit playheadChanged(QString("%1 s").arg((this->replayPackets[_playhead].ms -
+        this->replayPackets.last().ms) / 1000.0, 0, 'f', 2));
+    FFBuffer *buf = decodeReplayFrame(_playhead);
+    if (buf == NULL) return;
+    // display it just like a live frame
+    if (this->rawbuf) this->rawbuf->release();
+    this->rawbuf = buf;
+    makeFullFrame();
+    makeStats();
+}
+
+void ffmpegWidget::stepForward() {
+    setPlayhead(_playhead + 1);
+}
+
+void ffmpegWidget::stepBack() {
+    setPlayhead(_playhead - 1);
+}
+
+// decode a replay packet, using and filling the cache around the playhead
+FFBuffer * ffmpegWidget::decodeReplayFrame(int index) {
+    FFBuffer *result = NULL;
+    int frameFinished;
+    AVPacket packet;
+
+    // throw away cached frames that have fallen out of the window
+    QMap<int, FFBuffer *>::iterator it = this->replayCache.begin();
+    while (it != this->replayCache.end()) {
+        if (qAbs(it.key() - index) > REPLAYCACHE) {
+            it.value()->release();
+            it = this->replayCache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (this->replayCache.contains(index)) {
+        result = this->replayCache.value(index);
+        result->reserve();
+        return result;
+    }
+
+    // decoding has to start at a key frame, unless the decoder is already
+    // part of the way there. Note that this assumes the codec has no delay,
+    // which is true of MJPEG and the low latency H.264 we get from ffmpegServer
+    int start = index;
+    while (start > 0 && !(this->replayPackets[start].flags & AV_PKT_FLAG_KEY)) start--;
+    if (this->replayDecoded >= start && this->replayDecoded < index) {
+        start = this->replayDecoded + 1;
+    } else {
+        avcodec_flush_buffers(this->replayCtx);
+    }
+    for (int i = start; i <= index; i++) {
+        const FFPacket &p = this->replayPackets[i];
+        av_init_packet(&packet);
+        packet.data = (uint8_t *) p.data.constData();
+        packet.size = p.size;
+        packet.flags = p.flags;
+        this->replayDecoded = i;
+        if (avcodec_decode_video2(this->replayCtx, this->replayFrame,
+                &frameFinished, &packet) < 0 || !frameFinished) continue;
+        // keep the frames near the playhead, we'll probably step onto them
+        if (i < index - REPLAYCACHE) continue;
+        FFBuffer *raw = copyRawFrame(this->replayCtx, this->replayFrame, orientation(),
+            &this->replayOrientCtx);
+        if (raw == NULL) {
+            printf("Couldn't get a free buffer, skipping frame\n");
+            continue;
+        }
+        if (this->replayCache.contains(i)) this->replayCache.value(i)->release();
+        this->replayCache.insert(i, raw);
+        if (i == index) {
+            raw->reserve();
+            result = raw;
+        }
+    }
+    return result;
+}
+
+// free everything to do with replay mode
+void ffmpegWidget::closeReplay() {
+    QMap<int, FFBuffer *>::iterator it;
+    for (it = this->replayCache.begin(); it != this->replayCache.end(); ++it) {
+        it.value()->release();
+    }
+    this->replayCache.clear();
+    this->replayPackets.clear();
+    if (this->replayCtx) {
+        ffmutex->lock();
+        avcodec_close(this->replayCtx);
+        ffmutex->unlock();
+        av_freep(&this->replayCtx->extradata);
+        av_free(this->replayCtx);
+        this->replayCtx = NULL;
+    }
+    if (this->replayFrame) {
+        av_free(this->replayFrame);
+        this->replayFrame = NULL;
+    }
+    this->replayDecoded = -1;
+}
+
+// start or stop remuxing the stream to a file
+void ffmpegWidget::setRecording(bool recording) {
+    if (_recording == recording) return;
+    if (recording) {
+        // the recorder adds an extension to suit the codec if there isn't one
+        QString filename = _recordFile;
+        if (filename.isEmpty()) {
+            filename = QDateTime::currentDateTime().toString("'ffmpegViewer_'yyyyMMdd_hhmmss");
+        }
+        this->recorder = new FFRecorder(filename, this);
+        connect(this->recorder, SIGNAL(opened(QString)), this, SIGNAL(recordStarted(QString)));
+        connect(this->recorder, SIGNAL(failed(QString)), this, SLOT(recorderFailed(QString)));
+        connect(this->recorder, SIGNAL(finished()), this->recorder, SLOT(deleteLater()));
+        this->recorder->start();
+        if (ff) ff->setRecorder(this->recorder);
+    } else if (this->recorder) {
+        // the recorder finishes writing its queue in its own time
+        if (ff) ff->setRecorder(NULL);
+        this->recorder->stopGracefully();
+        this->recorder = NULL;
+    }
+    _recording = recording;
+    emit recordingChanged(_recording);
+    _recordDropped = 0;
+    emit recordDroppedChanged(_recordDropped);
+    emit recordDroppedChanged(QString("0"));
+}
+
+// file to record to, "" = auto
+void ffmpegWidget::setRecordFile(QString recordFile) {
+    if (_recordFile != recordFile) {
+        _recordFile = recordFile;
+        emit recordFileChanged(_recordFile);
+    }
+}
+
+// the recorder has given up, so stop recording
+void ffmpegWidget::recorderFailed(QString message) {
+    printf("%s\n", message.toAscii().data());
+    if (sender() == this->recorder) setRecording(false);
+}
+
+// keep the dropped packet count up to date while recording
+void ffmpegWidget::updateRecordDropped() {
+    if (this->recorder == NULL) return;
+    int dropped = this->recorder->dropped();
+    if (_recordDropped != dropped) {
+        _recordDropped = dropped;
+        emit recordDroppedChanged(_recordDropped);
+        emit recordDroppedChanged(QString("%1").arg(_recordDropped));
+    }
+}
+
+// "png", "tiff" or "raw"
+void ffmpegWidget::setSnapshotFormat(QString snapshotFormat) {
+    snapshotFormat = snapshotFormat.toLower();
+    if (snapshotFormat == "tif") snapshotFormat = "tiff";
+    if (snapshotFormat != "png" && snapshotFormat != "tiff" && snapshotFormat != "raw") {
+        printf("Unknown snapshot format '%s'\n", snapshotFormat.toAscii().data());
+        return;
+    }
+    if (_snapshotFormat != snapshotFormat) {
+        _snapshotFormat = snapshotFormat;
+        emit snapshotFormatChanged(_snapshotFormat);
+    }
+}
+
+// burn false colour and grid into snapshots
+void ffmpegWidget::setSnapshotProcessed(bool snapshotProcessed) {
+    if (_snapshotProcessed != snapshotProcessed) {
+        _snapshotProcessed = snapshotProcessed;
+        emit snapshotProcessedChanged(_snapshotProcessed);
+    }
+}
+
+// snapshot the current frame to an automatically named file
+void ffmpegWidget::snapshot() {
+    snapshot(QString(""));
+}
+
+// snapshot the current frame, the extension of filename picks the format
+void ffmpegWidget::snapshot(QString filename) {
+    if (this->rawbuf == NULL || this->rawbuf->width <= 0 || this->rawbuf->height <= 0) {
+        printf("No frame to snapshot\n");
+        return;
+    }
+    QString format = _snapshotFormat;
+    QString suffix = QFileInfo(filename).suffix().toLower();
+    if (suffix == "png") {
+        format = "png";
+    } else if (suffix == "tif" || suffix == "tiff") {
+        format = "tiff";
+    } else if (suffix == "raw") {
+        format = "raw";
+    } else if (filename.isEmpty()) {
+        filename = QDateTime::currentDateTime().toString("'ffmpegViewer_'yyyyMMdd_hhmmss_zzz");
+        if (format == "raw") {
+            // there's no header, so put what we need to read it in the name
+            filename += QString("_%1x%2_%3").arg(this->rawbuf->width)
+                .arg(this->rawbuf->height).arg(av_get_pix_fmt_name(this->rawbuf->pix_fmt));
+        }
+        filename += (format == "tiff") ? ".tif" : "." + format;
+    }
+
+    // take a copy of the display settings in case we're burning them in
+    FFConvertParams params;
+    params.pix_fmt = PIX_FMT_YUVJ420P;
+    params.fcol = _fcol;
+    params.grid = _grid;
+    params.gx = _gx;
+    params.gy = _gy;
+    params.gs = _gs;
+    params.gcol = _gcol;
+    params.sfx = 1.0;
+    params.seq = this->frameSeq;
+    params.background = NULL;
+    params.bgGain = (int) (_subtractGain * 256 + 0.5);
+    params.bgOffset = _subtractOffset;
+    params.autoLevel = _autoLevel;
+    params.updateLevels = false;
+    params.windowLow = _level - _window / 2;
+    params.windowWidth = _window;
+    params.xvback = NULL;
+    params.xvLayout.width = 0;
+    params.xvLayout.height = 0;
+    params.viewX = 0;
+    params.viewY = 0;
+    params.viewW = 0;
+    params.viewH = 0;
+    params.bin = 1;
+    if (_snapshotProcessed && format != "raw" && _subtract && this->background) {
+        params.background = this->background;
+        params.background->reserve();
+    }
+
+    // the job holds a reference to the raw buffer, so no copy is needed
+    this->rawbuf->reserve();
+    this->jobMutex->lock();
+    this->snapshotsRunning++;
+    this->jobMutex->unlock();
+    snapshotPool()->start(new FFSnapshotJob(this, this->rawbuf, filename,
+        format, _snapshotProcessed && format != "raw", params));
+}
+
 // set the URL to connect to
 void ffmpegWidget::setUrl(QString url) {
     QString copiedUrl(url);
@@ -6,14 +6,29 @@
 #include <QtDesigner/QDesignerExportWidget>
 #include <QWidget>
 #include <QMutex>
+#include <QWaitCondition>
+#include <QList>
+#include <QMap>
+#include <QByteArray>
+#include <QVector>
+#include <QPointer>
+#include <QThreadPool>
 #include <QTime>
 #include <QTimer>
+#include <QImage>
+#include <QPixmap>
+#include <QLine>
+#include <QPainter>
 #include <X11/Xlib.h>
 #include <X11/extensions/Xvlib.h>
+#include <X11/extensions/XShm.h>
 
 /* global switch for fallback mode */
 extern int fallback;
 
+/* global memory budget for all frame buffers in the process in MB */
+extern int memoryBudget;
+
 /* ffmpeg includes */
 extern "C" {
 #include "libavformat/avformat.h"
@@ -21,16 +36,56 @@ extern "C" {
 #include "libavutil/avutil.h"
 }
 
-// max width of any input image
-#define MAXWIDTH 4000
-// max height of any input image
-#define MAXHEIGHT 3000
-// number of MAXWIDTH*MAXHEIGHT*3 buffers to create
-#define NBUFFERS 20
+// default memory budget for all frame buffers in MB
+#define DEFAULTBUDGET 1024
+// max lowres level, the decoder scales down by 2^lowres
+#define MAXLOWRES 3
+// default number of seconds of compressed packets to keep for replay
+#define DEFAULTREPLAY 10
+// max size of the replay packet ring of each stream in MB
+#define REPLAYMAXMB 256
+// number of decoded frames to cache either side of the replay playhead
+#define REPLAYCACHE 4
+// percentage of pixels clipped at each end by auto levels
+#define LEVELCLIP 0.5
+// grey levels the black or white point must move before auto levels changes
+#define LEVELHYSTERESIS 4
+// max pixels sampled for the auto levels histogram
+#define LEVELSAMPLES 262144
+// max pixels sampled for the stats
+#define STATSSAMPLES 1048576
 // number of frames to calc fps from
 #define MAXTICKS 10
+// weight of each new frame in the smoothed decode, convert and latency times
+#define METRICSMOOTHING 0.1
 // size of URL string
 #define MAXSTRING 1024
+// frame memory and every plane in it start on this boundary, and rows are
+// padded to a multiple of it, so SIMD kernels can use aligned loads
+#define FRAMEALIGN 64
+// frame memory at least this big is backed by huge pages where possible
+#define HUGEPAGESIZE (2 * 1024 * 1024)
+// minor grid lines closer than this many screen pixels aren't drawn
+#define OVERLAYMINSPACING 3
+// niceness and rtPriority values that leave the decode thread scheduled as it
+// was inherited, e.g. from nice or chrt
+#define NICE_UNSET -100
+#define RTPRIORITY_UNSET -1
+// how raw frames are turned as they are copied from the decoder: transposed,
+// then mirrored left to right and top to bottom
+#define ORIENT_TRANSPOSE 1
+#define ORIENT_MIRRORX 2
+#define ORIENT_MIRRORY 4
+// ways of putting converted frames on the screen, see setBackend
+#define BACKEND_AUTO 0      // the best of the ones below that the display supports
+#define BACKEND_XVSHM 1     // xvideo from shared memory images
+#define BACKEND_XV 2        // xvideo, sending each frame down the socket
+#define BACKEND_QIMAGE 3    // QPainter, no xvideo needed
+#define BACKEND_NULL 4      // nothing drawn, frames are only counted and checksummed
+#define BACKEND_XSHM 5      // scaled by us into shared memory images, no xvideo needed
+// side of the square tiles the planes are transposed in, so that a tile and
+// its destination fit in L1 cache
+#define ORIENTTILE 64
 
 class FFBuffer
 {
@@ -40,15 +95,208 @@ public:
 	void reserve();
 	void release();
 	bool grabFree();
+    bool alloc(int size);
     QMutex *mutex;
     unsigned char *mem;
+    int size;
     AVFrame *pFrame;
     PixelFormat pix_fmt;
     int width;
     int height;
+    int lowres;
     int refs;
+    qint64 ms;          // wall clock time the packet arrived, 0 if not live
+    int decodeUs;       // time spent decoding it
+    // where a converted frame came from, it may be a binned or cropped part
+    int bin;            // each pixel covers bin x bin pixels of the frame
+    int offX, offY;     // position of the top left pixel in the frame
+    int fullW, fullH;   // size of the frame
+    int orient;         // ORIENT_ flags the frame was turned with
+};
+
+// true if the first plane of pix_fmt is 8-bit luma, one byte per pixel
+bool hasLumaPlane(PixelFormat pix_fmt);
+
+// name of a BACKEND_, as ffmpegViewer -b takes it, NULL if there's no such backend
+const char * ffBackendName(int backend);
+
+// all frame memory comes from here, FRAMEALIGN aligned and on huge pages if
+// it is big enough. Free it with the size it was allocated with
+void * ffAllocFrameMem(int size);
+void ffFreeFrameMem(void *mem, int size);
+// bytes needed for a frame with FRAMEALIGN aligned planes and padded rows
+int ffFrameSize(PixelFormat pix_fmt, int width, int height);
+// point the planes of frame into mem, which holds ffFrameSize bytes
+void ffFrameFill(AVFrame *frame, unsigned char *mem, PixelFormat pix_fmt, int width, int height);
+
+// percentage of the memory budget allocated to frame buffers
+double memoryUsage();
+
+// name the calling thread so it shows up in top -H and perf
+void ffNameThread(const QString &name);
+// pin the calling thread to a cpu list like "0-3,6", "" = any cpu, and say
+// what took effect
+QString ffSetThreadCpus(const QString &cpus);
+// set the calling thread's nice value, or make it SCHED_FIFO if rtPriority
+// > 0, and say what took effect. NICE_UNSET and RTPRIORITY_UNSET leave them
+// as they are
+QString ffSetThreadPriority(int nice, int rtPriority);
+
+// A compressed packet, the data is implicitly shared so copies are cheap
+struct FFPacket
+{
+    QByteArray data;    // packet data followed by zeroed decoder padding
+    int size;           // size of the packet data without the padding
+    int flags;          // AV_PKT_FLAG_KEY etc.
+    qint64 ms;          // wall clock time the packet arrived
+};
+
+// Ring of the last few seconds of compressed packets from a stream
+class FFPacketRing
+{
+public:
+    FFPacketRing ();
+    ~FFPacketRing ();
+    void setSeconds(int seconds);
+    void setCodec(AVCodecContext *codecCtx);
+    void push(const FFPacket &packet);
+    void clear();
+    QList<FFPacket> snapshot(enum AVCodecID *codec_id, QByteArray *extradata);
+    int seconds() const { return _seconds; }
+
+private:
+    QMutex *mutex;
+    QList<FFPacket> packets;
+    qint64 bytes;
+    int _seconds;
+    enum AVCodecID codec_id;
+    QByteArray extradata;
+};
+
+// Black point, white point and gamma picked from the histogram of a stream
+class FFLevels
+{
+public:
+    FFLevels ();
+    ~FFLevels ();
+    void update(FFBuffer *buf);
+    void copyLut(unsigned char *lut);
+    void reset();
+
+private:
+    QMutex *mutex;
+    bool valid;
+    int black;
+    int white;
+    double gamma;
+    unsigned char lut[256];
 };
 
+class FFBufferPool
+{
+public:
+    FFBufferPool ();
+    ~FFBufferPool ();
+    FFBuffer * findFree(int size);
+
+private:
+    QMutex *mutex;
+    QList<FFBuffer *> buffers;
+};
+
+// Conversion settings, copied from the widget when a conversion is queued
+// Where the planes of a YUVJ420P frame go when plain xvideo is to take it as
+// it is, rather than in our padded layout
+struct FFXvLayout
+{
+    int width, height;      // size of frame it is for, 0 = none
+    int size;               // bytes for all the planes
+    int pitches[3];         // bytes per row of Y, U and V
+    int offsets[3];         // start of each plane
+};
+
+struct FFConvertParams
+{
+    PixelFormat pix_fmt;    // format to convert to
+    int fcol;               // false colour
+    bool grid;              // burn in the grid, only for snapshots
+    int gx, gy, gs;         // grid position and spacing in image pixels
+    QColor gcol;            // grid colour
+    double sfx;             // x scale factor, for the grid width
+    QString cpus;           // pin the pool thread to these first, "" = any
+    int seq;                // frame sequence this conversion belongs to
+    FFBuffer *background;   // subtract this luma plane first, at its own depth, holds a ref
+    int bgGain;             // gain after subtraction, 256 = 1.0
+    int bgOffset;           // offset added after the gain
+    bool autoLevel;         // stretch the levels to suit the frame
+    bool updateLevels;      // let this frame move the levels
+    int windowLow;          // deep mono frames map [windowLow, windowLow + windowWidth]
+    int windowWidth;        // onto 0-255
+    int viewX, viewY;       // top left of the region to convert
+    int viewW, viewH;       // size of the region to convert, 0 = whole frame
+    int bin;                // shrink the region by this factor
+    XvImage *xvback;        // copy the result into this shared image too, NULL if none
+    FFXvLayout xvLayout;    // lay a result of its size out like this
+};
+
+// Region and crosshair to do stats on, copied from the widget
+struct FFStatsParams
+{
+    int x, y, w, h;         // region of interest in image pixels
+    int gx, gy;             // crosshair for the line profiles
+    int threshold;          // levels at or below this don't count to the centroid
+    QString cpus;           // pin the pool thread to these first, "" = any
+};
+
+// Stats of a frame, sub-sampled by step in each direction
+struct FFStats
+{
+    QVector<int> projX;     // column sums over the roi, one per sampled column
+    QVector<int> projY;     // row sums over the roi, one per sampled row
+    QVector<int> profileX;  // luma along row gy
+    QVector<int> profileY;  // luma along column gx
+    QVector<int> histogram; // 256 bins over the roi, by the top 8 bits of deep mono samples
+    int min, max;           // luma range in the roi, 0-65535 for deep mono frames
+    double mean;            // mean luma in the roi
+    double cx, cy;          // intensity weighted centroid in image pixels
+    double sx, sy;          // rms width about the centroid in image pixels
+    int step;               // sub-sampling used
+};
+
+class ffmpegWidget;
+
+/* Puts converted frames on the screen for an ffmpegWidget, there is one of
+ * these for each BACKEND_. The widget keeps the view, which part of the
+ * image is shown and how big, and the backend draws it
+ */
+class FFRenderer
+{
+public:
+    FFRenderer (ffmpegWidget *widget) : widget(widget) {}
+    virtual ~FFRenderer () {}
+    // the BACKEND_ this is
+    virtual int backend() const = 0;
+    // format frames are converted to for it
+    virtual PixelFormat format() const = 0;
+    // true if it draws straight onto the window rather than with a QPainter
+    virtual bool onWindow() const { return false; }
+    // a frame has just been converted
+    virtual void frame(FFBuffer *) {}
+    // draw buf, rect is the part of the widget that needs it. false if it
+    // turns out not to work on this display, so another should be picked
+    virtual bool paint(FFBuffer *buf, const QRect &rect) = 0;
+
+protected:
+    ffmpegWidget *widget;
+};
+
+class FFConvertJob;
+class FFStatsJob;
+class FFRecorder;
+class FFSnapshotJob;
+class FFAccumulator;
+class FFShmWriter;
+
 class FFThread : public QThread
 {
     Q_OBJECT
@@ -60,13 +308,55 @@ public:
 
 public slots:
     void stopGracefully() { stopping = 1; }
+    void setPaused(bool p) { paused = p; }
+    void setLowres(int l) { lowres = l; }
+    void setAccumulate(int n) { accumulate = n; }
+    void setAccumulateMode(int m) { accumulateMode = m; }
+    void setOrient(int o) { orient = o; }
+    void setReplaySeconds(int s) { ring->setSeconds(s); }
+    void setThreadSettings(const QString &cpus, int nice, int rtPriority);
+    void setShmName(const QString &name);
+
+public:
+    FFPacketRing * packetRing() { return ring; }
+    void setRecorder(FFRecorder *r);
 
 signals:
     void updateSignal(FFBuffer * buf);
+    void settingsApplied(QString info);
 
 private:
     char url[MAXSTRING];
     int stopping;
+    // set this to 1 to keep reading packets without decoding them
+    int paused;
+    // decode at 1/2^lowres of the full resolution
+    int lowres;
+    // average the luma of this many frames, 0 = boxcar, 1 = exponential decay
+    int accumulate;
+    int accumulateMode;
+    FFAccumulator *accumulator;
+    // ORIENT_ flags to turn the frames with, and a context for formats that
+    // have to be made planar first
+    int orient;
+    struct SwsContext *orientCtx;
+    // last few seconds of packets for replay
+    FFPacketRing *ring;
+    // packets are also passed to this if we're recording
+    QMutex *recordMutex;
+    FFRecorder *recorder;
+    // cpus and priority to run at, applied by the thread itself
+    void applySettings();
+    QMutex *settingsMutex;      // protects the variables below
+    QString cpus;
+    int nice;
+    int rtPriority;
+    int settingsChanged;        // set to 1 to apply them at the next packet
+    // shared memory to publish frames to, the thread opens it itself
+    void openShm();
+    QString shmName;            // protected by settingsMutex, "" = off
+    int shmChanged;             // set to 1 to open it at the next frame
+    FFShmWriter *shm;
 };
 
 class QDESIGNER_WIDGET_EXPORT ffmpegWidget : public QWidget
@@ -82,6 +372,40 @@ class QDESIGNER_WIDGET_EXPORT ffmpegWidget : public QWidget
     Q_PROPERTY( QColor gcol READ gcol WRITE setGcol) // grid colour
     Q_PROPERTY( int fcol READ fcol WRITE setFcol)    // false colour
     Q_PROPERTY( QString url READ url WRITE setUrl)   // ffmpeg url
+    Q_PROPERTY( int hideTimeout READ hideTimeout WRITE setHideTimeout) // ms hidden before disconnect, 0 = never
+    Q_PROPERTY( int lowres READ lowres WRITE setLowres)  // decode at 1/2^lowres resolution
+    Q_PROPERTY( bool autoLowres READ autoLowres WRITE setAutoLowres) // pick lowres from widget size
+    Q_PROPERTY( int accumulate READ accumulate WRITE setAccumulate) // number of frames averaged, 1 = off
+    Q_PROPERTY( int accumulateMode READ accumulateMode WRITE setAccumulateMode) // 0 = boxcar, 1 = exponential decay
+    Q_PROPERTY( int rotate READ rotate WRITE setRotate) // degrees clockwise, 0, 90, 180 or 270
+    Q_PROPERTY( bool flipH READ flipH WRITE setFlipH) // mirror left to right, before rotating
+    Q_PROPERTY( bool flipV READ flipV WRITE setFlipV) // mirror top to bottom, before rotating
+    Q_PROPERTY( bool subtract READ subtract WRITE setSubtract) // subtract the captured background
+    Q_PROPERTY( double subtractGain READ subtractGain WRITE setSubtractGain) // gain after background subtraction
+    Q_PROPERTY( int subtractOffset READ subtractOffset WRITE setSubtractOffset) // offset after background subtraction
+    Q_PROPERTY( bool autoLevel READ autoLevel WRITE setAutoLevel) // stretch black, white and gamma to suit the frame
+    Q_PROPERTY( int level READ level WRITE setLevel) // centre of the window for 16-bit mono streams
+    Q_PROPERTY( int window READ window WRITE setWindow) // width of the window for 16-bit mono streams
+    Q_PROPERTY( bool stats READ stats WRITE setStats) // compute projections, profiles and histogram
+    Q_PROPERTY( int roiX READ roiX WRITE setRoiX)    // stats region x in image pixels
+    Q_PROPERTY( int roiY READ roiY WRITE setRoiY)    // stats region y in image pixels
+    Q_PROPERTY( int roiW READ roiW WRITE setRoiW)    // stats region width, 0 = to the edge
+    Q_PROPERTY( int roiH READ roiH WRITE setRoiH)    // stats region height, 0 = to the edge
+    Q_PROPERTY( int threshold READ threshold WRITE setThreshold) // background level for the centroid
+    Q_PROPERTY( bool followCentroid READ followCentroid WRITE setFollowCentroid) // move the grid to the centroid
+    Q_PROPERTY( int replaySeconds READ replaySeconds WRITE setReplaySeconds) // seconds of packets kept for replay
+    Q_PROPERTY( bool replay READ replay WRITE setReplay) // paused, showing frames from the replay ring
+    Q_PROPERTY( int playhead READ playhead WRITE setPlayhead) // frame shown in replay mode
+    Q_PROPERTY( bool recording READ recording WRITE setRecording) // remuxing the stream to a file
+    Q_PROPERTY( QString recordFile READ recordFile WRITE setRecordFile) // file to record to, "" = auto
+    Q_PROPERTY( QString snapshotFormat READ snapshotFormat WRITE setSnapshotFormat) // "png", "tiff" or "raw"
+    Q_PROPERTY( bool snapshotProcessed READ snapshotProcessed WRITE setSnapshotProcessed) // burn false colour and grid into snapshots
+    Q_PROPERTY( int backend READ backend WRITE setBackend) // BACKEND_ to draw frames with
+    Q_PROPERTY( QString cpus READ cpus WRITE setCpus) // cpus to read and decode on, "" = any
+    Q_PROPERTY( QString convertCpus READ convertCpus WRITE setConvertCpus) // cpus to convert on, "" = any
+    Q_PROPERTY( int niceness READ niceness WRITE setNiceness) // nice value of the decode thread, NICE_UNSET = as inherited
+    Q_PROPERTY( int rtPriority READ rtPriority WRITE setRtPriority) // SCHED_FIFO priority of the decode thread, 0 = off, -1 = as inherited
+    Q_PROPERTY( QString shmName READ shmName WRITE setShmName) // POSIX shared memory to publish frames to, "" = off
 
 
 public:
@@ -100,6 +424,40 @@ public:
     QColor gcol() const     { return _gcol; }   // grid colour
     int fcol() const        { return _fcol; }   // false colour
     QString url() const     { return _url; }    // ffmpeg url
+    int hideTimeout() const { return _hideTimeout; } // ms hidden before disconnect, 0 = never
+    int lowres() const      { return _lowres; } // decode at 1/2^lowres resolution
+    bool autoLowres() const { return _autoLowres; } // pick lowres from widget size
+    int accumulate() const  { return _accumulate; } // number of frames averaged, 1 = off
+    int accumulateMode() const { return _accumulateMode; } // 0 = boxcar, 1 = exponential decay
+    int rotate() const      { return _rotate; } // degrees clockwise, 0, 90, 180 or 270
+    bool flipH() const      { return _flipH; }  // mirror left to right, before rotating
+    bool flipV() const      { return _flipV; }  // mirror top to bottom, before rotating
+    bool subtract() const   { return _subtract; } // subtract the captured background
+    double subtractGain() const { return _subtractGain; } // gain after background subtraction
+    int subtractOffset() const { return _subtractOffset; } // offset after background subtraction
+    bool autoLevel() const  { return _autoLevel; } // stretch black, white and gamma to suit the frame
+    int level() const       { return _level; }  // centre of the window for 16-bit mono streams
+    int window() const      { return _window; } // width of the window for 16-bit mono streams
+    bool stats() const      { return _stats; }  // compute projections, profiles and histogram
+    int roiX() const        { return _roiX; }   // stats region x in image pixels
+    int roiY() const        { return _roiY; }   // stats region y in image pixels
+    int roiW() const        { return _roiW; }   // stats region width, 0 = to the edge
+    int roiH() const        { return _roiH; }   // stats region height, 0 = to the edge
+    int threshold() const   { return _threshold; } // background level for the centroid
+    bool followCentroid() const { return _followCentroid; } // move the grid to the centroid
+    int replaySeconds() const { return _replaySeconds; } // seconds of packets kept for replay
+    bool replay() const     { return _replay; } // paused, showing frames from the replay ring
+    int playhead() const    { return _playhead; } // frame shown in replay mode
+    bool recording() const  { return _recording; } // remuxing the stream to a file
+    QString recordFile() const { return _recordFile; } // file to record to, "" = auto
+    QString snapshotFormat() const { return _snapshotFormat; } // "png", "tiff" or "raw"
+    bool snapshotProcessed() const { return _snapshotProcessed; } // burn false colour and grid into snapshots
+    int backend() const     { return _backend; } // BACKEND_ to draw frames with
+    QString cpus() const    { return _cpus; }   // cpus to read and decode on, "" = any
+    QString convertCpus() const { return _convertCpus; } // cpus to convert on, "" = any
+    int niceness() const    { return _niceness; } // nice value of the decode thread, NICE_UNSET = as inherited
+    int rtPriority() const  { return _rtPriority; } // SCHED_FIFO priority of the decode thread, 0 = off, -1 = as inherited
+    QString shmName() const { return _shmName; } // POSIX shared memory to publish frames to, "" = off
 
     /* Getters: read only */
     int maxX() const        { return _maxX; }   // Max x offset in image pixels
@@ -115,6 +473,25 @@ public:
     int scVisW() const      { return _scVisW; } // Image width visible in viewport scaled pixels
     int scVisH() const      { return _scVisH; } // Image height visible in viewport scaled pixels
     double fps() const      { return _fps; }    // Frames per second displayed
+    bool onScreen() const   { return _onScreen; } // Widget is visible and not minimised
+    int maxPlayhead() const { return _maxPlayhead; } // Last frame in replay mode
+    int recordDropped() const { return _recordDropped; } // Packets dropped while recording
+    int framesDropped() const { return _framesDropped; } // Decoded frames never displayed
+    double decodeTime() const { return _decodeTime; } // Smoothed ms to decode a frame
+    double convertTime() const { return _convertTime; } // Smoothed ms to convert a frame
+    double latency() const  { return _latency; } // Smoothed ms from packet arrival to display
+    double poolUsage() const { return _poolUsage; } // Percentage of the memory budget in use
+    double renderTime() const { return _renderTime; } // Smoothed ms to draw a frame
+    int renderCount() const { return _renderCount; } // Frames taken by the null backend
+    uint renderChecksum() const { return _renderChecksum; } // Adler-32 of the last of them
+    QString threadInfo() const { return _threadInfo; } // Thread settings that took effect
+    int roiMin() const      { return _roiMin; } // Min luma in the stats region
+    int roiMax() const      { return _roiMax; } // Max luma in the stats region
+    double roiMean() const  { return _roiMean; } // Mean luma in the stats region
+    double centroidX() const { return _centroidX; } // Centroid x in image pixels
+    double centroidY() const { return _centroidY; } // Centroid y in image pixels
+    double sigmaX() const   { return _sigmaX; } // Beam rms width in image pixels
+    double sigmaY() const   { return _sigmaY; } // Beam rms height in image pixels
 
 signals:
     /* Signals: read/write variables */
@@ -128,6 +505,40 @@ signals:
     void gcolChanged(QColor);                   // grid colour
     void fcolChanged(int);                      // false colour
     void urlChanged(QString);                   // ffmpeg url
+    void hideTimeoutChanged(int);               // ms hidden before disconnect, 0 = never
+    void lowresChanged(int);                    // decode at 1/2^lowres resolution
+    void autoLowresChanged(bool);               // pick lowres from widget size
+    void accumulateChanged(int);                // number of frames averaged, 1 = off
+    void accumulateModeChanged(int);            // 0 = boxcar, 1 = exponential decay
+    void rotateChanged(int);                    // degrees clockwise, 0, 90, 180 or 270
+    void flipHChanged(bool);                    // mirror left to right, before rotating
+    void flipVChanged(bool);                    // mirror top to bottom, before rotating
+    void subtractChanged(bool);                 // subtract the captured background
+    void subtractGainChanged(double);           // gain after background subtraction
+    void subtractOffsetChanged(int);            // offset after background subtraction
+    void autoLevelChanged(bool);                // stretch black, white and gamma to suit the frame
+    void levelChanged(int);                     // centre of the window for 16-bit mono streams
+    void windowChanged(int);                    // width of the window for 16-bit mono streams
+    void statsChanged(bool);                    // compute projections, profiles and histogram
+    void roiXChanged(int);                      // stats region x in image pixels
+    void roiYChanged(int);                      // stats region y in image pixels
+    void roiWChanged(int);                      // stats region width, 0 = to the edge
+    void roiHChanged(int);                      // stats region height, 0 = to the edge
+    void thresholdChanged(int);                 // background level for the centroid
+    void followCentroidChanged(bool);           // move the grid to the centroid
+    void replaySecondsChanged(int);             // seconds of packets kept for replay
+    void replayChanged(bool);                   // paused, showing frames from the replay ring
+    void playheadChanged(int);                  // frame shown in replay mode
+    void recordingChanged(bool);                // remuxing the stream to a file
+    void recordFileChanged(QString);            // file to record to, "" = auto
+    void snapshotFormatChanged(QString);        // "png", "tiff" or "raw"
+    void snapshotProcessedChanged(bool);        // burn false colour and grid into snapshots
+    void backendChanged(int);                   // BACKEND_ to draw frames with
+    void cpusChanged(QString);                  // cpus to read and decode on, "" = any
+    void convertCpusChanged(QString);           // cpus to convert on, "" = any
+    void nicenessChanged(int);                  // nice value of the decode thread, NICE_UNSET = as inherited
+    void rtPriorityChanged(int);                // SCHED_FIFO priority of the decode thread, 0 = off, -1 = as inherited
+    void shmNameChanged(QString);               // POSIX shared memory to publish frames to, "" = off
 
     /* Signals: read only */
     void maxXChanged(int);                      // Max x offset in image pixels
@@ -143,11 +554,46 @@ signals:
     void scVisWChanged(int);                    // Image width visible in viewport scaled pixels
     void scVisHChanged(int);                    // Image height visible in viewport scaled pixels
     void fpsChanged(double);                    // Frames per second displayed
+    void onScreenChanged(bool);                 // Widget is visible and not minimised
+    void maxPlayheadChanged(int);               // Last frame in replay mode
+    void recordDroppedChanged(int);             // Packets dropped while recording
+    void framesDroppedChanged(int);             // Decoded frames never displayed
+    void decodeTimeChanged(double);             // Smoothed ms to decode a frame
+    void convertTimeChanged(double);            // Smoothed ms to convert a frame
+    void latencyChanged(double);                // Smoothed ms from packet arrival to display
+    void poolUsageChanged(double);              // Percentage of the memory budget in use
+    void renderTimeChanged(double);             // Smoothed ms to draw a frame
+    void renderCountChanged(int);               // Frames taken by the null backend
+    void renderChecksumChanged(uint);           // Adler-32 of the last of them
+    void threadInfoChanged(QString);            // Thread settings that took effect
+    void roiMinChanged(int);                    // Min luma in the stats region
+    void roiMaxChanged(int);                    // Max luma in the stats region
+    void roiMeanChanged(double);                // Mean luma in the stats region
+    void centroidXChanged(double);              // Centroid x in image pixels
+    void centroidYChanged(double);              // Centroid y in image pixels
+    void sigmaXChanged(double);                 // Beam rms width in image pixels
+    void sigmaYChanged(double);                 // Beam rms height in image pixels
 
     /* Signals: other */
     void visWChanged(QString);
     void visHChanged(QString);
     void fpsChanged(QString);
+    void playheadChanged(QString);
+    void recordDroppedChanged(QString);
+    void recordStarted(QString);
+    void snapshotSaved(QString);
+    void roiMinChanged(QString);
+    void roiMaxChanged(QString);
+    void roiMeanChanged(QString);
+    void centroidXChanged(QString);
+    void centroidYChanged(QString);
+    void sigmaXChanged(QString);
+    void sigmaYChanged(QString);
+    void projectionXChanged(QVector<int>);      // column sums over the stats region
+    void projectionYChanged(QVector<int>);      // row sums over the stats region
+    void profileXChanged(QVector<int>);         // luma along the horizontal grid line
+    void profileYChanged(QVector<int>);         // luma along the vertical grid line
+    void histogramChanged(QVector<int>);        // luma histogram of the stats region
     void aboutToQuit();
 
 public slots:
@@ -162,29 +608,151 @@ public slots:
     void setGcol(QColor);                   // grid colour
     void setFcol(int);                      // false colour
     void setUrl(QString);                   // ffmpeg url
+    void setHideTimeout(int);               // ms hidden before disconnect, 0 = never
+    void setLowres(int);                    // decode at 1/2^lowres resolution
+    void setAutoLowres(bool);               // pick lowres from widget size
+    void setAccumulate(int);                // number of frames averaged, 1 = off
+    void setAccumulateMode(int);            // 0 = boxcar, 1 = exponential decay
+    void setRotate(int);                    // degrees clockwise, 0, 90, 180 or 270
+    void setFlipH(bool);                    // mirror left to right, before rotating
+    void setFlipV(bool);                    // mirror top to bottom, before rotating
+    void setSubtract(bool);                 // subtract the captured background
+    void setSubtractGain(double);           // gain after background subtraction
+    void setSubtractOffset(int);            // offset after background subtraction
+    void setAutoLevel(bool);                // stretch black, white and gamma to suit the frame
+    void setLevel(int);                     // centre of the window for 16-bit mono streams
+    void setWindow(int);                    // width of the window for 16-bit mono streams
+    void setStats(bool);                    // compute projections, profiles and histogram
+    void setRoiX(int);                      // stats region x in image pixels
+    void setRoiY(int);                      // stats region y in image pixels
+    void setRoiW(int);                      // stats region width, 0 = to the edge
+    void setRoiH(int);                      // stats region height, 0 = to the edge
+    void setThreshold(int);                 // background level for the centroid
+    void setFollowCentroid(bool);           // move the grid to the centroid
+    void setReplaySeconds(int);             // seconds of packets kept for replay
+    void setReplay(bool);                   // paused, showing frames from the replay ring
+    void setPlayhead(int);                  // frame shown in replay mode
+    void setRecording(bool);                // remuxing the stream to a file
+    void setRecordFile(QString);            // file to record to, "" = auto
+    void setSnapshotFormat(QString);        // "png", "tiff" or "raw"
+    void setSnapshotProcessed(bool);        // burn false colour and grid into snapshots
+    void setBackend(int);                   // BACKEND_ to draw frames with
+    void setCpus(QString);                  // cpus to read and decode on, "" = any
+    void setConvertCpus(QString);           // cpus to convert on, "" = any
+    void setNiceness(int);                  // nice value of the decode thread, NICE_UNSET = as inherited
+    void setRtPriority(int);                // SCHED_FIFO priority of the decode thread, 0 = off, -1 = as inherited
+    void setShmName(QString);               // POSIX shared memory to publish frames to, "" = off
 
     /* Slots: others */
     void setGcol();
     void setReset();
     void calcFps();
     void updateImage(FFBuffer *buf);
+    void updateOnScreen();
+    void hideTimeoutExpired();
+    void stepForward();
+    void stepBack();
+    void snapshot();
+    void snapshot(QString filename);
+    void captureBackground();
+
+public:
+    /* Shared by all widgets in the process */
+    static QThreadPool * conversionPool();
+    static QThreadPool * snapshotPool();
+
+protected slots:
+    void frameConverted();
+    void statsDone();
+    void recorderFailed(QString);
+    void updateRecordDropped();
+    void threadSettingsApplied(QString);
 
 protected:
-    FFBuffer * formatFrame(FFBuffer *src, PixelFormat pix_fmt);
-    FFBuffer * falseFrame(FFBuffer *src, PixelFormat pix_fmt);
+    friend class FFConvertJob;
+    friend class FFSnapshotJob;
+    friend class FFStatsJob;
+    friend class FFXvRenderer;
+    friend class FFXShmRenderer;
+    friend class FFQImageRenderer;
+    friend class FFNullRenderer;
+    void makeStats();
+    void runStats(FFBuffer *src, const FFStatsParams &params);
+    FFBuffer * formatFrame(FFBuffer *src, PixelFormat pix_fmt, struct SwsContext **sws,
+        const FFXvLayout *layout = NULL);
+    FFBuffer * falseFrame(FFBuffer *src, PixelFormat pix_fmt, int fcol, const unsigned char *lut,
+        struct SwsContext **sws, const FFXvLayout *layout = NULL);
+    FFBuffer * convertFrame(FFBuffer *src, const FFConvertParams &params, struct SwsContext **sws);
+    FFBuffer * reduceFrame(FFBuffer *src, const FFConvertParams &params);
+    void pickView(FFConvertParams &params);
+    void runConversion(FFBuffer *src, const FFConvertParams &params);
+    void runSnapshot(FFBuffer *src, const QString &filename, const QString &format,
+        bool processed, const FFConvertParams &params);
+    void updateLowres();
+    void updatePaused();
+    int orientation();
+    void updateOrientation(int old);
+    FFBuffer * decodeReplayFrame(int index);
+    void closeReplay();
     void paintEvent(QPaintEvent *);
     void mousePressEvent (QMouseEvent* event);
     void mouseMoveEvent (QMouseEvent* event);
     void mouseDoubleClickEvent (QMouseEvent* event);
     void wheelEvent( QWheelEvent* );
+    void showEvent(QShowEvent *);
+    void hideEvent(QHideEvent *);
+    void resizeEvent(QResizeEvent *);
     void updateScalefactor();
 	void makeFullFrame();
     void ffQuit();
     // xv stuff
     void xvSetup();
+    void xvAlloc(int width, int height);
+    void xvFree();
+    // render backends, renderer is the one _backend resolved to
+    FFRenderer *renderer;
+    void pickRenderer();
+    // what the decode thread last reported, and a summary for threadInfo
+    QString readerInfo;
+    void updateThreadInfo();
+    bool usingXv() const {
+        return renderer->backend() == BACKEND_XVSHM || renderer->backend() == BACKEND_XV;
+    }
+    PixelFormat renderFormat() const;
+    void paintXv(FFBuffer *buf);
+    void paintQImage(FFBuffer *buf, const QRect &rect);
+    void updatePanImage(FFBuffer *buf);
+    void renderNull(FFBuffer *buf);
+    // the grid and crosshair are drawn over the frame once it is on screen,
+    // in widget pixels where image pixel x is at x * sx - ox
+    void overlayLines(double sx, double sy, double ox, double oy,
+        QVector<QLine> &major, QVector<QLine> &minor);
+    void paintXvOverlay(double sx, double sy, double ox, double oy);
+    void paintQImageOverlay(QPainter &painter, const QRect &rect);
+    QPixmap overlayPixmap;      // the overlay for the QImage backend
+    bool overlayValid;          // overlayPixmap has the current grid settings
+    int overlayOriginX, overlayOriginY; // and was drawn for this pan
+    double overlaySfx, overlaySfy;      // and scale
+    GC overlay_gc;              // for drawing the overlay over xvideo
+    QColor overlay_col;         // colour overlay_pixel was allocated for
+    unsigned long overlay_pixel;
+    // the QImage and XShm backends keep what they last drew, so a pan only
+    // has to scale the strips that come into view
+    QImage panImage;
+    bool panValid;              // panImage holds fullbuf at the current scale
+    int panOriginX, panOriginY; // scaled image position of its top left
     int xv_port;
     int xv_format;
     XvImage * xv_image;
+    QByteArray xv_packed;       // the frame repacked to xv_image's pitches
+    // shared memory images, conversions fill the back one while the front
+    // one is on screen, then they swap
+    bool xv_shm;                    // the server can read shared memory images
+    XvImage * xv_shm_images[2];     // sized to the converted frames
+    XShmSegmentInfo xv_shminfo[2];
+    int xv_front;                   // index of the image on screen
+    bool xv_front_valid;            // the front image holds fullbuf
+    bool xshm;                      // the server can put shared memory images of our visual
     Display * dpy;
     WId w;
     GC gc;
@@ -192,13 +760,16 @@ protected:
     double sfx, sfy;
     FFBuffer *rawbuf;
     FFBuffer *fullbuf;
+    qint64 fullMs;              // arrival time of fullbuf's packet, 0 once it is on screen
+    void frameShown();
     QTime *lastFrameTime;
     QTimer *timer;
+    QTimer *hideTimer;
+    bool hiddenDisconnect;
     int widgetW, widgetH;
     int clickx, clicky, oldx, oldy, oldgx, oldgy;
     FFThread *ff;
     bool disableUpdates;
-    PixelFormat ff_fmt;
     // fps calculation
     int tickindex;
     int ticksum;
@@ -206,6 +777,38 @@ protected:
     int maxW, maxH;
     QString limited;
     struct SwsContext *ctx;    
+    struct SwsContext *reduceCtx;   // for reduceFrame, only used by our conversion
+    // conversion on the shared pool
+    bool converting;        // GUI side, a conversion has been queued
+    bool convertAgain;      // GUI side, convert rawbuf again when it's done
+    bool rawConverted;      // GUI side, rawbuf has been handed to a conversion
+    int frameSeq;           // incremented when the stream is blanked
+    QMutex *jobMutex;       // protects the variables below
+    QWaitCondition *jobDone;
+    bool jobRunning;        // the pool is running our conversion
+    FFBuffer *converted;    // result of the last conversion
+    int convertedSeq;       // frameSeq of the last conversion
+    int convertedUs;        // time the last conversion took
+    bool convertedXv;       // the last conversion filled the back xv image
+    qint64 convertedMs;     // arrival time of the packet it came from
+    // replay
+    QList<FFPacket> replayPackets;  // snapshot of the packet ring
+    QMap<int, FFBuffer *> replayCache; // decoded frames around the playhead
+    AVCodecContext *replayCtx;      // decoder for replayPackets
+    AVFrame *replayFrame;
+    int replayDecoded;              // last packet fed to replayCtx
+    struct SwsContext *replayOrientCtx; // for turning replay frames
+    // recording
+    QPointer<FFRecorder> recorder;
+    // snapshots still being written, protected by jobMutex
+    int snapshotsRunning;
+    // raw frame to subtract from the others
+    FFBuffer *background;
+    // current auto levels
+    FFLevels *levels;
+    // stats, the results are protected by jobMutex
+    bool statsRunning;      // the pool is running our stats
+    FFStats *statsResult;   // result of the last stats job
 
 private:
     /* Private variables, read/write */
@@ -219,6 +822,40 @@ private:
     QColor _gcol; // grid colour
     int _fcol;    // false colour
     QString _url; // ffmpeg url
+    int _hideTimeout; // ms hidden before disconnect, 0 = never
+    int _lowres;  // decode at 1/2^lowres resolution
+    bool _autoLowres; // pick lowres from widget size
+    int _accumulate; // number of frames averaged, 1 = off
+    int _accumulateMode; // 0 = boxcar, 1 = exponential decay
+    int _rotate;  // degrees clockwise, 0, 90, 180 or 270
+    bool _flipH;  // mirror left to right, before rotating
+    bool _flipV;  // mirror top to bottom, before rotating
+    bool _subtract; // subtract the captured background
+    double _subtractGain; // gain after background subtraction
+    int _subtractOffset; // offset after background subtraction
+    bool _autoLevel; // stretch black, white and gamma to suit the frame
+    int _level;   // centre of the window for 16-bit mono streams
+    int _window;  // width of the window for 16-bit mono streams
+    bool _stats;  // compute projections, profiles and histogram
+    int _roiX;    // stats region x in image pixels
+    int _roiY;    // stats region y in image pixels
+    int _roiW;    // stats region width, 0 = to the edge
+    int _roiH;    // stats region height, 0 = to the edge
+    int _threshold; // background level for the centroid
+    bool _followCentroid; // move the grid to the centroid
+    int _replaySeconds; // seconds of packets kept for replay
+    bool _replay; // paused, showing frames from the replay ring
+    int _playhead; // frame shown in replay mode
+    bool _recording; // remuxing the stream to a file
+    QString _recordFile; // file to record to, "" = auto
+    QString _snapshotFormat; // "png", "tiff" or "raw"
+    bool _snapshotProcessed; // burn false colour and grid into snapshots
+    int _backend; // BACKEND_ to draw frames with
+    QString _cpus; // cpus to read and decode on, "" = any
+    QString _convertCpus; // cpus to convert on, "" = any
+    int _niceness; // nice value of the decode thread, NICE_UNSET = as inherited
+    int _rtPriority; // SCHED_FIFO priority of the decode thread, 0 = off, -1 = as inherited
+    QString _shmName; // POSIX shared memory to publish frames to, "" = off
 
     /* Private variables: read only */
     int _maxX;    // Max x offset in image pixels
@@ -227,6 +864,7 @@ private:
     int _maxGy;   // Max grid y offset in image pixels
     int _imW;     // Image width in image pixels
     int _imH;     // Image height in image pixels
+    int _imOrient; // ORIENT_ flags of the frame _imW and _imH come from
     int _visW;    // Image width currently visible in image pixels
     int _visH;    // Image height currently visible in image pixels
     int _scImW;   // Image width in viewport scaled pixels
@@ -234,6 +872,25 @@ private:
     int _scVisW;  // Image width visible in viewport scaled pixels
     int _scVisH;  // Image height visible in viewport scaled pixels
     double _fps;  // Frames per second displayed
+    bool _onScreen; // Widget is visible and not minimised
+    int _maxPlayhead; // Last frame in replay mode
+    int _recordDropped; // Packets dropped while recording
+    int _framesDropped; // Decoded frames never displayed
+    double _decodeTime; // Smoothed ms to decode a frame
+    double _convertTime; // Smoothed ms to convert a frame
+    double _latency; // Smoothed ms from packet arrival to display
+    double _poolUsage; // Percentage of the memory budget in use
+    double _renderTime; // Smoothed ms to draw a frame
+    int _renderCount; // Frames taken by the null backend
+    uint _renderChecksum; // Adler-32 of the last of them
+    QString _threadInfo; // Thread settings that took effect
+    int _roiMin;  // Min luma in the stats region
+    int _roiMax;  // Max luma in the stats region
+    double _roiMean; // Mean luma in the stats region
+    double _centroidX; // Centroid x in image pixels
+    double _centroidY; // Centroid y in image pixels
+    double _sigmaX; // Beam rms width in image pixels
+    double _sigmaY; // Beam rms height in image pixels
 };
 
 #endif
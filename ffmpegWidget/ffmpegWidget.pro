@@ -1,10 +1,10 @@
 TEMPLATE = lib
 CONFIG = staticlib
 CONFIG += qt debug
-HEADERS += colorMaps.h ffmpegWidget.h 
-SOURCES += ffmpegWidget.cpp
+HEADERS += colorMaps.h ffmpegColorMap.h ffmpegWidget.h ffmpegRecorder.h ffmpegAccumulator.h ffmpegMjpegReader.h ffmpegShm.h ffmpegShmWriter.h
+SOURCES += ffmpegWidget.cpp ffmpegColorMap.cpp ffmpegRecorder.cpp ffmpegAccumulator.cpp ffmpegMjpegReader.cpp ffmpegShmWriter.cpp
 QMAKE_CLEAN += libffmpegWidget.a
-header_files.files = ffmpegWidget.h 
+header_files.files = ffmpegWidget.h ffmpegColorMap.h ffmpegShm.h
 header_files.path = ../../prefix/include
 target.path = ../../prefix/lib
 INSTALLS += target header_files
@@ -0,0 +1,217 @@
+/* Time the conversions ffmpegWidget does on big frames, with buffers laid out
+ * the way they were before FRAMEALIGN and ffAllocFrameMem (calloc and packed
+ * rows) and the way they are now (64 byte aligned, rows padded to 64 bytes and
+ * huge pages for anything over 2MB). It only needs the ffmpeg libraries:
+ *
+ *     g++ -O2 -o frameBench frameBench.cpp -lswscale -lavutil
+ *     ./frameBench 6001 6000 20
+ *
+ * The arguments are the width and height of the grey source frame and the
+ * number of passes to average over. For each layout it times swscale to
+ * YUVJ420P (what xvideo is given) and RGB24 (what the QImage backends are
+ * given), then the false colour pass from falseFrame to each of them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+
+extern "C" {
+#include "libswscale/swscale.h"
+#include "libavutil/imgutils.h"
+}
+
+// as in ffmpegWidget.h
+#define FRAMEALIGN 64
+#define HUGEPAGESIZE (2 * 1024 * 1024)
+#define ALIGNTO(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+// ask for 2MB pages by name, older headers don't have it
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+// a frame and where its memory came from
+struct Frame {
+    PixelFormat pix_fmt;
+    int width, height;
+    uint8_t *data[4];
+    int linesize[4];
+    void *mem;
+    size_t len;     // bytes mapped, 0 if from the heap
+};
+
+// how the aligned layout got its memory, for the report
+static const char *how = "heap";
+
+// a copy of ffAllocFrameMem, which needs Qt to link
+static void * alignedAlloc(size_t size, size_t *len) {
+    *len = 0;
+    if (size < HUGEPAGESIZE) {
+        void *mem = NULL;
+        if (posix_memalign(&mem, FRAMEALIGN, size) != 0) return NULL;
+        return mem;
+    }
+    *len = ALIGNTO(size, HUGEPAGESIZE);
+    void *mem = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (mem != MAP_FAILED) {
+        how = "explicit 2MB pages";
+        return mem;
+    }
+    char *map = (char *) mmap(NULL, *len + HUGEPAGESIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return NULL;
+    char *start = (char *) ALIGNTO((uintptr_t) map, HUGEPAGESIZE);
+    if (start > map) munmap(map, start - map);
+    if (map + HUGEPAGESIZE > start) munmap(start + *len, map + HUGEPAGESIZE - start);
+    if (madvise(start, *len, MADV_HUGEPAGE) == 0) how = "transparent huge pages";
+    return start;
+}
+
+// make a frame, packed in calloc memory or padded in aligned memory
+static bool makeFrame(Frame *f, PixelFormat pix_fmt, int width, int height, bool aligned) {
+    f->pix_fmt = pix_fmt;
+    f->width = width;
+    f->height = height;
+    av_image_fill_linesizes(f->linesize, pix_fmt, width);
+    if (aligned) {
+        for (int i = 0; i < 4; i++) f->linesize[i] = ALIGNTO(f->linesize[i], FRAMEALIGN);
+    }
+    int size = av_image_fill_pointers(f->data, pix_fmt, height, NULL, f->linesize);
+    if (size < 0) return false;
+    f->len = 0;
+    f->mem = aligned ? alignedAlloc(size, &f->len) : calloc(1, size);
+    if (f->mem == NULL) return false;
+    // touch every page now, so the first timed pass doesn't fault them in
+    memset(f->mem, 0, size);
+    av_image_fill_pointers(f->data, pix_fmt, height, (uint8_t *) f->mem, f->linesize);
+    return true;
+}
+
+static void freeFrame(Frame *f) {
+    if (f->len) munmap(f->mem, f->len);
+    else free(f->mem);
+}
+
+static double nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void scale(SwsContext *sws, Frame *src, Frame *dest) {
+    sws_scale(sws, src->data, src->linesize, 0, src->height, dest->data, dest->linesize);
+}
+
+// the YUVJ420P half of falseFrame
+static void falseYuv(Frame *src, Frame *dest, const uint8_t *mapY, const uint8_t *mapU,
+        const uint8_t *mapV) {
+    for (int h = 0; h < dest->height; h++) {
+        const uint8_t *line = src->data[0] + src->linesize[0] * h;
+        uint8_t *destdata = dest->data[0] + dest->linesize[0] * h;
+        for (int w = 0; w < dest->width; w++) *destdata++ = mapY[line[w]];
+    }
+    for (int h = 0; h < dest->height; h += 2) {
+        const uint8_t *line = src->data[0] + src->linesize[0] * h;
+        uint8_t *destu = dest->data[1] + dest->linesize[1] * (h / 2);
+        uint8_t *destv = dest->data[2] + dest->linesize[2] * (h / 2);
+        for (int w = 0; w < dest->width; w += 2) {
+            destu[w / 2] = mapU[line[w]];
+            destv[w / 2] = mapV[line[w]];
+        }
+    }
+}
+
+// the RGB24 half of falseFrame
+static void falseRgb(Frame *src, Frame *dest, const uint8_t *mapR, const uint8_t *mapG,
+        const uint8_t *mapB) {
+    for (int h = 0; h < dest->height; h++) {
+        const uint8_t *line = src->data[0] + src->linesize[0] * h;
+        uint8_t *destdata = dest->data[0] + dest->linesize[0] * h;
+        for (int w = 0; w < dest->width; w++) {
+            *destdata++ = mapR[line[w]];
+            *destdata++ = mapG[line[w]];
+            *destdata++ = mapB[line[w]];
+        }
+    }
+}
+
+// time passes of each conversion in one layout, after a pass to warm up
+static void run(const char *name, bool aligned, int width, int height, int passes) {
+    // falseFrame and formatFrame only do multiples of 8 by 2
+    const int outW = width - width % 8, outH = height - height % 2;
+    Frame src, yuv, rgb;
+    if (!makeFrame(&src, PIX_FMT_GRAY8, width, height, aligned) ||
+            !makeFrame(&yuv, PIX_FMT_YUVJ420P, outW, outH, aligned) ||
+            !makeFrame(&rgb, PIX_FMT_RGB24, outW, outH, aligned)) {
+        printf("Couldn't allocate %dx%d frames\n", width, height);
+        exit(1);
+    }
+    for (int h = 0; h < height; h++) {
+        for (int w = 0; w < width; w++) src.data[0][src.linesize[0] * h + w] = (w ^ h) & 0xff;
+    }
+    SwsContext *toYuv = sws_getContext(width, height, PIX_FMT_GRAY8,
+        outW, outH, PIX_FMT_YUVJ420P, SWS_BICUBIC, NULL, NULL, NULL);
+    SwsContext *toRgb = sws_getContext(width, height, PIX_FMT_GRAY8,
+        outW, outH, PIX_FMT_RGB24, SWS_BICUBIC, NULL, NULL, NULL);
+    if (toYuv == NULL || toRgb == NULL) {
+        printf("Couldn't make swscale contexts\n");
+        exit(1);
+    }
+    // any map will do, it is the lookups that cost
+    uint8_t map[3][256];
+    for (int i = 0; i < 256; i++) {
+        map[0][i] = i;
+        map[1][i] = 255 - i;
+        map[2][i] = (i * 7) & 0xff;
+    }
+    double ms[4] = {0, 0, 0, 0};
+    for (int n = -1; n < passes; n++) {
+        double t0 = nowMs();
+        scale(toYuv, &src, &yuv);
+        double t1 = nowMs();
+        scale(toRgb, &src, &rgb);
+        double t2 = nowMs();
+        falseYuv(&src, &yuv, map[0], map[1], map[2]);
+        double t3 = nowMs();
+        falseRgb(&src, &rgb, map[0], map[1], map[2]);
+        double t4 = nowMs();
+        if (n < 0) continue;
+        ms[0] += t1 - t0;
+        ms[1] += t2 - t1;
+        ms[2] += t3 - t2;
+        ms[3] += t4 - t3;
+    }
+    const char *what[4] = {"swscale to YUVJ420P", "swscale to RGB24",
+        "false colour to YUVJ420P", "false colour to RGB24"};
+    printf("%s:\n", name);
+    for (int i = 0; i < 4; i++) {
+        ms[i] /= passes;
+        printf("  %-26s %8.2f ms  %8.1f Mpixel/s\n", what[i], ms[i],
+            outW * (double) outH / ms[i] / 1000.0);
+    }
+    sws_freeContext(toYuv);
+    sws_freeContext(toRgb);
+    freeFrame(&src);
+    freeFrame(&yuv);
+    freeFrame(&rgb);
+}
+
+int main(int argc, char *argv[]) {
+    int width = argc > 1 ? atoi(argv[1]) : 6001;
+    int height = argc > 2 ? atoi(argv[2]) : 6000;
+    int passes = argc > 3 ? atoi(argv[3]) : 20;
+    if (width < 8 || height < 2 || passes < 1) {
+        printf("Usage: %s [width height [passes]]\n", argv[0]);
+        return 1;
+    }
+    printf("%dx%d grey, mean of %d passes\n", width, height, passes);
+    run("calloc, packed rows", false, width, height, passes);
+    run("aligned, padded rows", true, width, height, passes);
+    printf("Aligned frames over 2MB used %s\n", how);
+    return 0;
+}
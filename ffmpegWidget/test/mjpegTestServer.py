@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""Serve a recorded MJPEG capture the way ffmpegServer does, so the MJPEG
+reader in ffmpegWidget can be checked without a real IOC.
+
+Every GET of a path ending in .mjpg gets a multipart/x-mixed-replace stream
+of the JPEGs in the capture, looped for ever. The options make it misbehave
+in the ways the reader has to cope with:
+
+    ./mjpegTestServer.py &
+    ffmpegViewer http://localhost:8080/test.mjpg
+
+  --no-length        leave out Content-Length, so parts end at the boundary
+  --chunk N          send in random pieces of up to N bytes, splitting
+                     headers, boundaries and JPEGs across reads
+  --disconnect N     drop the connection after N frames, the viewer should
+                     reconnect and carry on
+  --stall N          stop sending after N frames but keep the connection
+                     open, closing the viewer must still be quick
+  --not-multipart    answer with a single JPEG, the viewer should fall back
+                     to avformat
+
+Each frame served is printed, with its number and size, so it can be compared
+with what the viewer shows.
+"""
+
+import argparse
+import os
+import random
+import socketserver
+import sys
+import time
+
+BOUNDARY = b"--myboundary"
+
+
+def load(filename):
+    """Split a multipart capture into its JPEGs"""
+    data = open(filename, "rb").read()
+    frames = []
+    for part in data.split(BOUNDARY)[1:]:
+        head, sep, body = part.partition(b"\r\n\r\n")
+        if not sep:
+            continue
+        length = None
+        for line in head.split(b"\r\n"):
+            if line.lower().startswith(b"content-length:"):
+                length = int(line.split(b":", 1)[1])
+        frames.append(body[:length] if length is not None else body.rstrip(b"\r\n"))
+    return frames
+
+
+class Handler(socketserver.StreamRequestHandler):
+
+    def send(self, data):
+        chunk = self.server.args.chunk
+        while data:
+            n = random.randint(1, chunk) if chunk else len(data)
+            self.wfile.write(data[:n])
+            self.wfile.flush()
+            data = data[n:]
+
+    def handle(self):
+        args = self.server.args
+        frames = self.server.frames
+        request = self.rfile.readline().split()
+        # skip the rest of the request headers
+        while self.rfile.readline().strip():
+            pass
+        if len(request) < 2 or not request[1].split(b"?")[0].endswith(b".mjpg"):
+            self.send(b"HTTP/1.0 404 Not Found\r\n\r\n")
+            return
+        if args.not_multipart:
+            self.send(b"HTTP/1.0 200 OK\r\nContent-Type: image/jpeg\r\n"
+                      b"Content-Length: %d\r\n\r\n" % len(frames[0]) + frames[0])
+            return
+        print("%s connected" % self.client_address[0])
+        self.send(b"HTTP/1.0 200 OK\r\nServer: mjpegTestServer\r\n"
+                  b"Cache-Control: no-cache\r\n"
+                  b"Content-Type: multipart/x-mixed-replace;boundary=" + BOUNDARY +
+                  b"\r\n\r\n")
+        n = 0
+        try:
+            while True:
+                if args.disconnect and n == args.disconnect:
+                    print("Dropping the connection after %d frames" % n)
+                    return
+                if args.stall and n == args.stall:
+                    print("Stalling after %d frames" % n)
+                    while True:
+                        time.sleep(1)
+                jpeg = frames[n % len(frames)]
+                head = BOUNDARY + b"\r\nContent-Type: image/jpeg\r\n"
+                if not args.no_length:
+                    head += b"Content-Length: %d\r\n" % len(jpeg)
+                self.send(head + b"\r\n" + jpeg + b"\r\n")
+                print("Frame %d, %d bytes" % (n, len(jpeg)))
+                n += 1
+                time.sleep(1.0 / args.fps)
+        except (BrokenPipeError, ConnectionResetError):
+            print("%s went away after %d frames" % (self.client_address[0], n))
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--capture", default=os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), "capture.mjpg"),
+        help="capture to serve, in the multipart format ffmpegServer streams")
+    parser.add_argument("--fps", type=float, default=10)
+    parser.add_argument("--no-length", action="store_true")
+    parser.add_argument("--chunk", type=int, default=0)
+    parser.add_argument("--disconnect", type=int, default=0)
+    parser.add_argument("--stall", type=int, default=0)
+    parser.add_argument("--not-multipart", action="store_true")
+    args = parser.parse_args()
+    frames = load(args.capture)
+    if not frames:
+        sys.exit("No JPEGs in %s" % args.capture)
+    print("Serving %d frames from %s on port %d" % (len(frames), args.capture, args.port))
+    server = Server(("", args.port), Handler)
+    server.args = args
+    server.frames = frames
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()